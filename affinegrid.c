@@ -66,6 +66,8 @@ static const struct LayerOps affine_grid_layer_ops = {
 	affine_grid_render_layer,
 	affine_grid_calc_target_data,
 	NULL,
+	TRUE,
+	TRUE,
 };
 
 void
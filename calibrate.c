@@ -66,15 +66,11 @@ static struct AffineGridData calibration_grid = {
 
 static void
 calibration_point_changed_xy(struct Calibration *cal, double x, double y) {
-	GdkRectangle rect;
 	pixel_to_geo_xy(cal->tmpmap->GeoTransform, x, y, &x, &y);
 	geo_to_pixel_xy(cal->mapview->rt.GeoTransform, x, y, &x, &y);
 	//gtk_widget_queue_draw_area(cal->mapview->layout, (int)x-23, (int)y-23, 46, 46);
-	rect.x = (int)x-23;
-	rect.y = (int)y-23;
-	rect.width = 46;
-	rect.height = 46;
-	gdk_window_invalidate_rect(GTK_LAYOUT(cal->mapview->layout)->bin_window, &rect, FALSE);
+	layer_invalidate(&cal->mapview->rt, &cal->mapview->rt.layers[CAL_LAYER_CALIBRATE],
+		(int)x-25, (int)y-25, 50, 50);
 }
 
 static void
@@ -220,6 +216,7 @@ static const struct LayerOps calibrate_layer_ops = {
 	calibrate_render_layer,
 	calibrate_calc_mapview_data,
 	NULL,
+	TRUE,
 };
 
 static void
@@ -560,9 +557,10 @@ bounding_rect_changed(GtkWidget *widget, struct Calibration *cal) {
 		cal->map->Rect.y = MIN(a, b);
 		cal->map->Rect.h = MAX(a, b) - cal->map->Rect.y;
 
+		mapview_redraw_sync(cal->mapview);
 		map_set_croprect(cal->map->mapset, cal->map, cal->map->Rect.x, cal->map->Rect.y, cal->map->Rect.w, cal->map->Rect.h);
 
-		gtk_widget_queue_draw(cal->mapview->layout);
+		mapview_queue_redraw(cal->mapview);
 	}
 }
 
@@ -614,6 +612,7 @@ set_calibration_map(struct Calibration *cal, int mapno) {
 	cal->mapno = mapno;
 
 	/* discard previous data */
+	mapview_redraw_sync(cal->mapview);
 	map_uncache(cal->tmpmap);
 	gmap_free(cal->tmpmap->filename);
 	cal->tmpmap->filename = NULL;
@@ -729,7 +728,7 @@ calibrate_button_clicked(GtkWidget *widget, struct Calibration *cal) {
 		cal->map->visible = TRUE;;
 
 	/* To force a refresh */
-	gtk_widget_queue_draw(cal->mapview->layout);
+	mapview_queue_redraw(cal->mapview);
 }
 
 static void
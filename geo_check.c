@@ -0,0 +1,177 @@
+/*
+ * geo_check.c
+ * Copyright (C) 2007 Itai Nahshon
+ *
+ * Accuracy and speed of the batch track distance (trackseg_calc_distance)
+ * against Vincenty's inverse solution hop by hop, which is how distances
+ * were computed before it. Exits 1 if a hop is off by more than
+ * HOP_TOLERANCE of its length (plus 1 mm), or either misses the reference
+ * geodesics computed with GeographicLib by more than REF_TOLERANCE.
+ */
+
+#include "gmap.h"
+
+#define HOP_TOLERANCE	1e-5	/* relative, what geo_inverse.c promises */
+#define HOP_SLACK	0.001	/* m */
+#define REF_TOLERANCE	0.001	/* m, Vincenty against GeographicLib */
+
+static int points = 1000000;
+static int seed = 1;
+
+static GOptionEntry entries[] = {
+	{ "points", 'p', 0, G_OPTION_ARG_INT, &points, "Points in each synthetic track", "N" },
+	{ "seed", 's', 0, G_OPTION_ARG_INT, &seed, "Random seed", "N" },
+	{ NULL }
+};
+
+/*
+ * Reference geodesics on WGS84, from GeographicLib (Geodesic.WGS84.Inverse).
+ * The first is Flinders Peak - Buninyong, the example of Vincenty's paper.
+ */
+static const struct {
+	double lat1, lon1, lat2, lon2;
+	double s12;		/* m */
+} references[] = {
+	{ -37.95103342, 144.42486789, -37.65282114, 143.92649554, 54972.2705 },
+	{ 40.0, -75.0, 40.0, -74.0, 85393.4091 },
+	{ 0.0, 0.0, 0.0, 1.0, 111319.4908 },
+	{ 0.0, 0.0, 1.0, 0.0, 110574.3886 },
+	{ 51.5, -0.1, 40.7, -74.0, 5587819.5174 },
+	{ -33.9, 151.2, -33.9, -151.2, 5252941.8150 },	/* over the 180 meridian */
+	{ 89.5, 0.0, 89.5, 90.0, 78979.0489 },
+	{ 10.0, 20.0, 10.0001, 20.0001, 15.5740 },
+};
+
+struct Walk {
+	const char *name;
+	double lat, lon;	/* start, degrees */
+	double hop_min, hop_max;	/* m */
+};
+
+/* Random walks: short GPS hops, sparse logs, the 180 meridian, the poles */
+static const struct Walk walks[] = {
+	{ "1s hops, mid latitude", 32.0, 35.0, 0.5, 30.0 },
+	{ "sparse, mid latitude", 47.0, 8.0, 100.0, 20000.0 },
+	{ "equator", 0.0, 20.0, 1.0, 500.0 },
+	{ "180 meridian", -16.0, 179.99, 1.0, 2000.0 },
+	{ "near the pole", 88.9, 0.0, 1.0, 2000.0 },
+};
+
+static double
+now() {
+	return g_get_monotonic_time() / 1e6;
+}
+
+static void
+make_walk(struct TrackSeg *seg, const struct Walk *walk, GRand *rand) {
+	double lat = walk->lat, lon = walk->lon;
+	int i;
+
+	seg->count = points;
+	seg->trackpoints = (struct TrackPoint *)gmap_malloc0(points * sizeof(struct TrackPoint));
+	for(i = 0; i < points; i++) {
+		double hop = g_rand_double_range(rand, walk->hop_min, walk->hop_max);
+		double az = g_rand_double_range(rand, 0, 2 * M_PI);
+
+		seg->trackpoints[i].point.geo_lat = lat;
+		seg->trackpoints[i].point.geo_lon = lon;
+		/* about hop m in direction az */
+		lat += hop * cos(az) / 111000.0;
+		lon += hop * sin(az) / (111000.0 * MAX(cos(lat * M_PI / 180), 0.01));
+		lat = CLAMP(lat, -89.99, 89.99);
+		if(lon > 180)
+			lon -= 360;
+		else if(lon < -180)
+			lon += 360;
+	}
+}
+
+static bool
+check_walk(const struct Walk *walk, GRand *rand) {
+	struct TrackSeg seg;
+	struct TrackPoint *pts;
+	double t0, t_batch, t_vincenty, total, worst;
+	double *vincenty;
+	int i, bad;
+
+	memset(&seg, 0, sizeof(seg));
+	make_walk(&seg, walk, rand);
+	pts = seg.trackpoints;
+	vincenty = (double *)gmap_malloc(points * sizeof(double));
+
+	t0 = now();
+	trackseg_calc_distance(&seg, NULL, 0);
+	t_batch = now() - t0;
+
+	t0 = now();
+	vincenty[0] = 0;
+	for(i = 1; i < points; i++)
+		vincenty[i] = Distance(pts[i-1].point.geo_lat, pts[i-1].point.geo_lon,
+			pts[i].point.geo_lat, pts[i].point.geo_lon);
+	t_vincenty = now() - t0;
+
+	worst = 0;
+	total = 0;
+	for(i = 1, bad = 0; i < points; i++) {
+		double hop = pts[i].distance - pts[i-1].distance;
+		double err = fabs(hop - vincenty[i]);
+
+		total += vincenty[i];
+		worst = MAX(worst, err / MAX(vincenty[i], HOP_SLACK));
+		if(err > vincenty[i] * HOP_TOLERANCE + HOP_SLACK) {
+			if(bad++ < 5)
+				fprintf(stderr, "%s: hop %d is %.6f m, Vincenty %.6f m\n",
+					walk->name, i, hop, vincenty[i]);
+		}
+	}
+
+	printf("%-24s worst %.2e, total off by %.3f m of %.0f m, %.1f Mpts/s batch, %.1f Mpts/s Vincenty\n",
+		walk->name, worst, fabs(pts[points-1].distance - total), total,
+		points / t_batch / 1e6, points / t_vincenty / 1e6);
+	if(bad > 0)
+		fprintf(stderr, "%s: %d hops out of tolerance\n", walk->name, bad);
+
+	gmap_free(vincenty);
+	gmap_free(seg.trackpoints);
+	return bad == 0;
+}
+
+int
+main(int argc, char *argv[]) {
+	GOptionContext *context;
+	GError *err = NULL;
+	GRand *rand;
+	bool ok = TRUE;
+	int i;
+
+	context = g_option_context_new("- check track distances");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if(!g_option_context_parse(context, &argc, &argv, &err)) {
+		fprintf(stderr, "%s\n", err->message);
+		return 2;
+	}
+	g_option_context_free(context);
+	points = MAX(points, 2);
+
+	for(i = 0; i < G_N_ELEMENTS(references); i++) {
+		double s = Distance(references[i].lat1, references[i].lon1, references[i].lat2, references[i].lon2);
+		double h = hop_distance(references[i].lat1, references[i].lon1, references[i].lat2, references[i].lon2);
+
+		if(fabs(s - references[i].s12) > REF_TOLERANCE) {
+			fprintf(stderr, "reference %d: Vincenty %.4f m, expected %.4f m\n", i, s, references[i].s12);
+			ok = FALSE;
+		}
+		if(fabs(h - s) > s * HOP_TOLERANCE + HOP_SLACK) {
+			fprintf(stderr, "reference %d: hop_distance %.4f m, Vincenty %.4f m\n", i, h, s);
+			ok = FALSE;
+		}
+	}
+
+	rand = g_rand_new_with_seed(seed);
+	for(i = 0; i < G_N_ELEMENTS(walks); i++)
+		ok &= check_walk(&walks[i], rand);
+	g_rand_free(rand);
+
+	printf("%s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
@@ -9,7 +9,7 @@ _Distance(double lat1, double lon1, double lat2, double lon2) {
 	double a = WGS84_A;
 	double f = WGS84_f;
 
-	double eps = 1.0e-23;
+	double eps = 1.0e-12;	/* ~0.06mm on the ellipsoid */
 	double max_loop_count = 10;
 
 	double r = 1.0 - f;
@@ -53,7 +53,7 @@ _Distance(double lat1, double lon1, double lat2, double lon2) {
 		x = ( 1.0 - c ) * x * f + dlon;
 		del = d - x;
 
-	} while( (abs(del) > eps) && ( ++cnt <= max_loop_count ) );
+	} while( (fabs(del) > eps) && ( ++cnt <= max_loop_count ) );
 
 	faz = atan2(tu1,tu2);
 	baz = atan2(cu1*sx,(baz*cx - su1*cu2)) + M_PI;
@@ -81,3 +81,102 @@ double
 Distance(double lat1, double lon1, double lat2, double lon2) {
 	return _Distance(RAD(lat1), RAD(lon1), RAD(lat2), RAD(lon2));
 }
+
+/*
+ * Batch distance for a track segment.
+ *
+ * Short hops use the ellipsoidal mean latitude (plane) formula: the
+ * meridian radius M and the prime vertical radius N are taken at the
+ * mean latitude of the hop. The error grows with the hop length and,
+ * as meridians converge, with tan(latitude); for d * max(1, tan(lat))
+ * up to HOP_MAX_M it is below 1e-5 of the hop length (a few cm per
+ * 10 km), see geo_check.c.  The loop has no branches and works on plain
+ * arrays so the compiler can vectorize it. Other hops, hops crossing
+ * the 180 meridian and hops near the poles are marked and recomputed
+ * with _Distance().
+ */
+#define WGS84_e2	(WGS84_f * (2.0 - WGS84_f))
+#define HOP_MAX_M	10000.0
+#define HOP_MAX_LAT	RAD(89.0)
+
+/* Short hop approximation, radians. Sets *slow if Vincenty is needed. */
+static inline double
+hop_approx(double lat1, double lon1, double lat2, double lon2, int *slow) {
+	double phi = 0.5 * (lat1 + lat2);
+	double dphi = lat2 - lat1;
+	double dlam = lon2 - lon1;
+	double s = sin(phi);
+	double w2 = 1.0 - WGS84_e2 * s * s;
+	double w = sqrt(w2);
+	double N = WGS84_A / w;
+	double M = WGS84_A * (1.0 - WGS84_e2) / (w2 * w);
+	double dy = M * dphi;
+	double dx = N * cos(phi) * dlam;
+	double d = sqrt(dx * dx + dy * dy);
+
+	*slow = (d > HOP_MAX_M) |
+		(d * fabs(s) > HOP_MAX_M * cos(phi)) |
+		(fabs(dlam) > M_PI) |
+		(fabs(lat1) > HOP_MAX_LAT) |
+		(fabs(lat2) > HOP_MAX_LAT);
+	return d;
+}
+
+/* Single hop, same result as trackseg_calc_distance() gives. Degrees. */
+double
+hop_distance(double lat1, double lon1, double lat2, double lon2) {
+	int slow;
+	double d = hop_approx(RAD(lat1), RAD(lon1), RAD(lat2), RAD(lon2), &slow);
+
+	if(slow)
+		d = _Distance(RAD(lat1), RAD(lon1), RAD(lat2), RAD(lon2));
+	return d;
+}
+
+void
+trackseg_calc_distance(struct TrackSeg *trackseg, const struct Point *prev, double start) {
+	struct TrackPoint *pts = trackseg->trackpoints;
+	int n = trackseg->count;
+	double *lat, *lon, *hop;
+	int *slow;
+	int i;
+
+	/* Works on the full points only, before trackseg_compact() */
+	if(n == 0 || pts == NULL)
+		return;
+
+	/* One extra slot in front for the last point of the previous segment */
+	lat = (double *)gmap_malloc(3 * (n + 1) * sizeof(double));
+	lon = lat + (n + 1);
+	hop = lon + (n + 1);
+	slow = (int *)gmap_malloc((n + 1) * sizeof(int));
+
+	if(prev) {
+		lat[0] = RAD(prev->geo_lat);
+		lon[0] = RAD(prev->geo_lon);
+	}
+	else {
+		lat[0] = RAD(pts[0].point.geo_lat);
+		lon[0] = RAD(pts[0].point.geo_lon);
+	}
+	for(i = 0; i < n; i++) {
+		lat[i+1] = RAD(pts[i].point.geo_lat);
+		lon[i+1] = RAD(pts[i].point.geo_lon);
+	}
+
+	for(i = 1; i <= n; i++)
+		hop[i] = hop_approx(lat[i-1], lon[i-1], lat[i], lon[i], &slow[i]);
+
+	for(i = 1; i <= n; i++) {
+		if(slow[i])
+			hop[i] = _Distance(lat[i-1], lon[i-1], lat[i], lon[i]);
+	}
+
+	for(i = 0; i < n; i++) {
+		start += hop[i+1];
+		pts[i].distance = start;
+	}
+
+	gmap_free(slow);
+	gmap_free(lat);
+}
@@ -6,8 +6,14 @@
 /* For sake of MSVC... */
 #define _USE_MATH_DEFINES
 
+/* GMAP_HEADLESS builds the rendering core without GTK */
+#ifdef GMAP_HEADLESS
+#include <glib.h>
+#include <cairo.h>
+#else
 #include <gtk/gtk.h>
 #include <gdk/gdk.h>
+#endif
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #include <stdio.h>
 #include <string.h>
@@ -66,9 +72,8 @@ struct Map {
 	struct cpoint	*calibration_points;
 	GdkPixbuf	*cached;			/* If cached in memory */
 
-	void		*cachedDS;			/* cached data set for gdal */
-	/* To fix a feature in GDAL... if the transform is {0 1 0 0 0 1} we must pass in a NULL ! */
-	void		*cachedDSNULL;			/* cached data set for gdal only if GeoTransform is not{ 0 1 0 0 0 1} */
+	GSList		*sources;			/* idle gdal data sets over cached, see mapset_gdal.c */
+	bool		decoding;			/* queued to be cached in the background */
 };
 
 struct MapSet {
@@ -85,6 +90,8 @@ struct MapSet {
 	double		preferred_scale;
 	double		max_scale;
 	double		min_scale;
+
+	int		n_queued, n_decoded;		/* background caching, see mapset_loading() */
 };
 
 enum LayerType {
@@ -99,6 +106,7 @@ enum LayerType {
 	LAYER_WAYPOINTSET,
 	LAYER_AFFINEGRID,
 	LAYER_SRTM,
+	LAYER_PLAYBACK,
 };
 
 struct RenderTarget {
@@ -113,15 +121,34 @@ struct RenderTarget {
 	double		rotation;			/* in degrees. 0 = no roration */
 	double		x_resulution;			/* DPI */
 	double		y_resulution;			/* DPI */
+	double		warp_error;			/* allowed when reprojecting maps, in pixels. 0 = exact */
+
+	/* Called by layer_invalidate(), w <= 0 for the whole layer. Set by views */
+	void		(*layer_changed)(struct RenderTarget *target, int layer, int x, int y, int w, int h, void *data);
+	void		*layer_changed_data;
 };
 
+#define DEFAULT_WARP_ERROR	0.125
+
 struct RenderContext {
 	struct RenderTarget *rt;
 	cairo_surface_t *cs;
 	cairo_t *ct;
 	int x, y, w, h;
+	int *objects;		/* if not NULL layers add what they drew */
+	const gint *cancel;	/* if not NULL and set, the result is not wanted */
+	gint64 deadline;	/* g_get_monotonic_time() to give up at, 0 for none */
 };
 
+#define RENDER_COUNT_OBJECTS(rc, n)	do { if((rc)->objects) *(rc)->objects += (n); } while(0)
+
+/*
+ * Layers check this between objects and return early when it is set;
+ * whatever they drew until then is thrown away.
+ */
+#define RENDER_CANCELLED(rc)	(((rc)->cancel != NULL && g_atomic_int_get((rc)->cancel)) || \
+				 ((rc)->deadline != 0 && g_get_monotonic_time() >= (rc)->deadline))
+
 struct MapView;
 
 /* Layer flags */
@@ -135,6 +162,8 @@ struct LayerOps {
 	void (*render_layer)(const struct Layer *layer, const struct RenderContext *context);
 	void (*calc_target_data)(struct Layer *layer, const struct RenderTarget *target);
 	void (*free_target_data)(struct Layer *layer, const struct RenderTarget *target);
+	bool	vector;		/* draws with cairo only, may go to PDF/print */
+	bool	thread_safe;	/* render_layer may run on any thread, several at once */
 };
 
 struct Layer {
@@ -145,8 +174,10 @@ struct Layer {
 	//char 		*name;
 	void 		*data;	/* Data shared by all instalces */
 	void		*priv;	/* data calculated per-target */
+	struct LayerStats *stats;	/* render timing, see layer_stats.c */
 };
 
+#ifndef GMAP_HEADLESS
 struct MapView {
 	char		*name;
 
@@ -192,6 +223,8 @@ struct MapView {
 	GtkWidget	*MapXY;		/* In map coordinates */
 	GtkWidget	*OtherXY;	/* Normally WGS84 or UTM coordinates */
 	GtkWidget	*ToolName;	/* name of current tool */
+	GtkWidget	*LayerTimes;	/* per layer render times, optional */
+	GtkWidget	*Progress;	/* opening or loading maps, hidden when idle */
 
 	GtkUIManager	*ui;
 	GtkActionGroup	*actions;
@@ -221,6 +254,11 @@ struct MapView {
 	guint		show_near_objects_proc;
 	GtkWidget	*near_objects_window;
 	void		*towgs84;
+
+	struct Playback	*playback;	/* track playback cursor */
+	struct SelectRegion *region;	/* from the select region tool, for export */
+	struct Redraw	*redraw;	/* frame scheduler, see redraw.c */
+	bool		smooth_zoom;	/* animate zooming */
 };
 
 /* input event handlers for current tool */
@@ -261,6 +299,7 @@ struct MainWindow {
 	GtkUIManager	*ui;
 	GtkActionGroup	*actions;
 };
+#endif /* GMAP_HEADLESS */
 
 struct Point {
 	double		geo_lat;
@@ -296,9 +335,42 @@ struct TrackPoint {
 // 	int serial;
 };
 
+/*
+ * Cached totals of a segment or track. Distances in m, times in s. A
+ * segment starts at its first point, a track includes the gaps between
+ * its segments like trkpt->distance.
+ */
+struct TrackStats {
+	int	count;			/* points */
+	double	distance;
+	double	gain, loss;		/* elevation */
+	double	moving_time;
+	double	total_time;
+	double	max_speed, avg_speed;	/* m/s, avg is over moving time */
+	double	min_lat, max_lat, min_lon, max_lon;
+};
+
+/* Quantized track point, see track_compact.c */
+struct CompactPoint {
+	gint32	lat, lon;		/* 1e-7 degrees */
+	guint32	dt;			/* ms after base_time */
+	gint16	ele;			/* decimetres */
+};
+
 struct TrackSeg {
 	int	count;
-	struct TrackPoint *trackpoints;
+	struct TrackPoint *trackpoints;	/* NULL if stored compact */
+	struct CompactPoint *compact;
+	gint64	base_time;		/* ms, compact only */
+	double	*checkpoints;		/* distances, compact only */
+	struct TrackStats stats;
+	struct TrackSegPrefix *prefix;	/* per-point sums for range queries */
+};
+
+/* A point by position, valid for both storage modes */
+struct TrackPointRef {
+	int	seg;
+	int	idx;
 };
 
 struct Track {
@@ -309,6 +381,8 @@ struct Track {
 	COLOR_T	color;
 	double	width;
 	void	*dashes;
+	struct TrackTimeIndex *timeindex;	/* points sorted by time */
+	struct TrackStats stats;
 };
 
 struct TrackSet {
@@ -361,6 +435,7 @@ extern char *UTF8[UTF8_LAST];
 
 /* mapset.c */
 struct MapSet *new_mapset();
+void free_mapset(struct MapSet *mapset);
 void mapset_set_projection(struct MapSet *mapset, const char *str);
 void mapset_set_description(struct MapSet *mapset, const char *str);
 void mapset_set_name(struct MapSet *mapset, const char *str);
@@ -378,20 +453,21 @@ struct MapSet *mapset_from_doc(xmlDocPtr doc);
 void mapset_recalculate_preferred_scale(struct MapSet *mapset);
 void mapset_recalculate_bounds(struct MapSet *mapset);
 
-/* mapset_gui.c */
-GtkWidget * mapset_view(struct MapSet *mapset, struct MapView *mapview);
+/* mapset_index.c */
+struct MapSet *mapset_from_index(const char *filename);
+bool mapset_write_index(const struct MapSet *mapset, const char *filename);
+bool mapset_wants_index(const struct MapSet *mapset, const char *filename);
+void mapset_remove_index(const char *filename);
 
 /* mapset_gdal.c */
 void GDAL_init_drivers();
-void mapview_set_projection_and_scale_from_mapset(struct MapSet *mapset, struct MapView *mapview);
+void target_set_projection_and_scale_from_mapset(struct MapSet *mapset, struct RenderTarget *target);
 void map_cache(struct Map *map);
 void mapset_init_layer(struct Layer *layer, enum LayerType type, struct MapSet *mapset);
+bool mapset_target_bounds(const struct Layer *layer, int *left, int *top, int *right, int *bottom);
+bool mapset_area_is_empty(const struct Layer *layer, int x, int y, int w, int h);
 void map_uncache(struct Map *map);
-void mapview_changed_projection(struct MapView *mapview);
-void mapview_center_map_region(struct MapView *mapview, double xx0, double xx1, double yy0, double yy1);
-
-/* projection_gui.c */
-GtkWidget *create_projection_tool(struct MapView *mapview);
+bool mapset_loading(struct MapSet *mapset, int *done, int *total);
 
 /* gdal_utils.c */
 void pixel_to_geo_xy(const double *GeoTransform, double pixel_x, double pixel_y, double *geo_x, double *geo_y);
@@ -401,24 +477,118 @@ void copy_geotransform(const double *G1, double *res);
 void set_unity_geotransform(double *res);
 bool is_unity_geotransform(double *GeoTransform);
 
+/* render_target.c */
+struct Layer *target_add_layer(struct RenderTarget *target);
+void target_set_scale(struct RenderTarget *target, double scale);
+void target_free_data(struct RenderTarget *target);
+void target_render_area(struct RenderTarget *target, cairo_surface_t *cs, int x, int y, int w, int h);
+void target_render_layers(struct RenderTarget *target, cairo_t *ct, int x, int y, int w, int h, int first, int last);
+bool target_render_layers_cancellable(struct RenderTarget *target, cairo_t *ct, int x, int y, int w, int h,
+	int first, int last, const gint *cancel, gint64 deadline);
+bool target_layers_thread_safe(const struct RenderTarget *target, int first, int last);
+int target_raster_layers(const struct RenderTarget *target);
+void layer_invalidate(struct RenderTarget *target, struct Layer *layer, int x, int y, int w, int h);
+
+/* layer_stats.c */
+void layer_render(struct Layer *layer, const struct RenderContext *rc);
+void layer_calc_target_data(struct Layer *layer, const struct RenderTarget *target);
+void layer_free_stats(struct Layer *layer);
+const char *layer_type_name(enum LayerType type);
+int format_layer_stats(char *ptr, int left, const struct RenderTarget *target);
+
+/* trace.c */
+extern FILE *trace_file;
+void trace_init();
+void trace_event(char ph, const char *name, const char *detail);
+#define TRACE_BEGIN(name, detail)	do { if(trace_file) trace_event('B', (name), (detail)); } while(0)
+#define TRACE_END(name)			do { if(trace_file) trace_event('E', (name), NULL); } while(0)
+
+/* render_tiles.c */
+bool render_target_to_file(struct RenderTarget *target, const char *filename, const char *format,
+	int tile_size, int threads);
+bool render_target_to_file_cancellable(struct RenderTarget *target, const char *filename, const char *format,
+	int tile_size, int threads, const gint *cancel);
+
+#ifndef GMAP_HEADLESS
+/* mapset_gui.c */
+GtkWidget * mapset_view(struct MapSet *mapset, struct MapView *mapview);
+
+/* projection_gui.c */
+GtkWidget *create_projection_tool(struct MapView *mapview);
 
 /* mapwindow.c */
 struct MapView *create_map_window(struct MainWindow *mainwindow);
+void mapview_close(struct MapView *mapview);
 void mapview_goto_xy(struct MapView *mapview, double geo_x, double geo_y, double dpy_x, double dpy_y);
 void mapview_point_to_view(struct MapView *mapview, double geo_x, double geo_y);
 void mapview_get_center(struct MapView *mapview, double *geo_x, double *geo_y);
 void mapwindow_register_tool(struct MapView *mapview, struct Tool *tool, void *tooldata,
 bool add_to_tools_menu, bool add_to_context_menu, bool make_it_current_tool);
-void mapview_set_name(struct MapView *mapview, char *name);
-struct Layer *target_add_layer(struct RenderTarget *target);
+void mapview_set_name(struct MapView *mapview, const char *name);
 void mapview_set_scale(struct MapView *mapview, double scale);
-void target_set_scale(struct RenderTarget *target, double scale);
-void target_free_data(struct RenderTarget *target);
 void mapview_register_copy_coord_tool(struct MapView *mapview);
+void mapview_changed_projection(struct MapView *mapview);
+void mapview_set_projection_and_scale_from_mapset(struct MapSet *mapset, struct MapView *mapview);
+void mapview_center_map_region(struct MapView *mapview, double xx0, double xx1, double yy0, double yy1);
+void mapview_set_progress(struct MapView *mapview, const char *text, double fraction);
+void mapview_update_progress(struct MapView *mapview);
+
+/* redraw.c */
+void mapview_redraw_init(struct MapView *mapview);
+void mapview_redraw_free(struct MapView *mapview);
+void mapview_redraw_sync(struct MapView *mapview);
+void mapview_queue_redraw(struct MapView *mapview);
+void mapview_queue_redraw_area(struct MapView *mapview, int x, int y, int w, int h);
+void mapview_queue_redraw_layer(struct MapView *mapview, int i);
+void mapview_layers_changed(struct MapView *mapview);
+void mapview_show_layer(struct MapView *mapview, int i, bool visible);
+void mapview_view_changed(struct MapView *mapview);
+gboolean mapview_redraw_expose(struct MapView *mapview, GdkEventExpose *event);
+void mapview_zoom_to(struct MapView *mapview, double scale, double geo_x, double geo_y, double dpy_x, double dpy_y);
+void mapview_zoom_at(struct MapView *mapview, double scale, double dpy_x, double dpy_y);
+double mapview_zoom_scale(struct MapView *mapview);
+#endif /* GMAP_HEADLESS */
 
 /* track.c */
+struct TrackSet *new_trackset();
+struct Track *new_track(char *name, struct TrackSet *trackset);
+struct TrackSeg *new_trackseg(struct Track *track);
+struct TrackPoint *new_trackpoint(struct TrackSeg *trackseg);
 bool load_from_gpx(char *filename, struct TrackSet **trkset, struct RouteSet **routeset, struct WayPointSet **waypointset);
 
+/* track_compact.c */
+bool compact_tracks_enabled();
+bool trackseg_compact(struct TrackSeg *seg);
+void trackseg_get_point(const struct TrackSeg *seg, int i, struct TrackPoint *tp);
+void trackseg_get_points(const struct TrackSeg *seg, int first, int n, struct TrackPoint *tp);
+void trackseg_get_latlon(const struct TrackSeg *seg, int i, double *lat, double *lon);
+gint64 trackseg_point_time(const struct TrackSeg *seg, int i);
+double trackseg_point_distance(const struct TrackSeg *seg, int i);
+
+/* track_time.c */
+gint64 trackpoint_time(const struct TrackPoint *p);
+void track_build_time_index(struct Track *track);
+void track_free_time_index(struct Track *track);
+bool track_time_range(const struct Track *track, gint64 *t0, gint64 *t1);
+bool track_position_at_time(const struct Track *track, gint64 t, struct Point *pos, double *distance);
+const struct TrackPointRef *track_points_in_window(const struct Track *track, gint64 t0, gint64 t1, int *count);
+
+/* track_stats.c */
+void trackseg_update_stats(struct TrackSeg *seg);
+void track_update_stats(struct Track *track);
+bool trackseg_range_stats(const struct TrackSeg *seg, int i, int j, struct TrackStats *s);
+int format_track_stats(char *ptr, int left, const struct TrackStats *s);
+
+/* playback.c */
+struct Playback;
+#ifndef GMAP_HEADLESS
+void playback_init_layer(struct Layer *layer, enum LayerType type, struct Playback *pb);
+void playback_start(struct MapView *mapview);
+void playback_stop(struct MapView *mapview);
+void playback_set_speed(struct MapView *mapview, double factor);
+void playback_free(struct MapView *mapview);
+#endif /* GMAP_HEADLESS */
+
 /* waypoint.c */
 struct WayPointSet *new_waypointset();
 struct WayPoint *new_waypoint(char *name, struct WayPointSet *waypointset);
@@ -432,12 +602,12 @@ bool map_calc_GeoReference(struct Map *map);
 
 /* tree.c */
 struct TreeNode;
-void tree_to_pixmap(struct TreeNode *t, struct RenderTarget *target, cairo_t *ct, int x, int y, int w, int h);
+int tree_to_pixmap(struct TreeNode *t, const struct RenderContext *rc);
 void free_tree(struct TreeNode *t);
 struct TreeNode *new_branch(int top, int bottom, int left, int right);
 void tree_add_waypoint(struct TreeNode *t, struct WayPoint *wpt, int x, int y);
-void tree_add_segment(struct TreeNode *t, struct Track *trk, int x0, int y0, int x1, int y1, struct TrackPoint *p1, struct TrackPoint *p2);
-char *get_near_object(struct MapView *mapview, int x, int y);
+void tree_add_segment(struct TreeNode *t, struct Track *trk, struct TrackSeg *seg, int x0, int y0, int x1, int y1, int i1, int i2);
+char *get_near_object(const struct RenderTarget *target, int x, int y);
 
 /* solid_fill.c */
 void solid_fill_init_layer(struct Layer *layer, enum LayerType type, double a, double r, double g, double b);
@@ -446,32 +616,27 @@ void solid_fill_init_layer(struct Layer *layer, enum LayerType type, double a, d
 void trackset_init_layer(struct Layer *layer, enum LayerType type, struct TrackSet *trackset);
 void routeset_init_layer(struct Layer *layer, enum LayerType type, struct RouteSet *routeset);
 void waypointset_init_layer(struct Layer *layer, enum LayerType type, struct WayPointSet *waypointset);
-bool trackset_calc_extents(struct TrackSet *trackset, const struct RenderTarget *target, struct GeoRect *rect);
+bool trackset_calc_extents(const struct Layer *layer, struct GeoRect *rect);
+struct TreeNode *pointset_tree(const struct Layer *layer);
 
 /* file_utils.c */
 char *get_relative_filename(const char *filename, const char *basedir);
 char *get_absolute_filename(const char *filename);
 
+#ifndef GMAP_HEADLESS
 /* gmap_dock.c */
 void show_about_dialog (GtkAction *action, struct MainWindow *mainwindow);
 
-/* affinegrid.c */
-void affine_grid_init_layer(struct Layer *layer, enum LayerType type, struct AffineGridData *data);
-
 /* calibrate.c */
 struct MapView *calibrate_map(struct MainWindow *mainwindow, struct MapSet *mapset, int mapno);
 
-/* waypoint_symbols.c */
-void *get_image_for_symbol(char *sym);
-
 /* layers_box.c */
 GtkWidget *create_layers_box(struct MapView *mapview);
 
-/* inverse.c */
-double Distance(double lat1, double lon1, double lat2, double lon2);
-
-/* utf8.c */
-void utf8_init();
+/* select_region.c */
+void select_region_tool_start(struct MapView *mapview);
+void do_export_region(struct MapView *mapview);
+void export_region_cancel(struct MapView *mapview);
 
 /* print.c */
 void do_page_setup (struct MapView *mapview);
@@ -479,3 +644,18 @@ void do_print(struct MapView *mapview);
 
 /* projection.c */
 void do_set_projection(struct MapView *mapview);
+#endif /* GMAP_HEADLESS */
+
+/* affinegrid.c */
+void affine_grid_init_layer(struct Layer *layer, enum LayerType type, struct AffineGridData *data);
+
+/* waypoint_symbols.c */
+void *get_image_for_symbol(char *sym);
+
+/* inverse.c */
+double Distance(double lat1, double lon1, double lat2, double lon2);
+void trackseg_calc_distance(struct TrackSeg *trackseg, const struct Point *prev, double start);
+double hop_distance(double lat1, double lon1, double lat2, double lon2);
+
+/* utf8.c */
+void utf8_init();
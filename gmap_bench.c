@@ -0,0 +1,493 @@
+/*
+ * gmap_bench.c
+ * Copyright (C) 2007 Itai Nahshon
+ *
+ * Rendering benchmark. Runs scripted pan/zoom/reprojection sequences
+ * over mapsets and synthetic data without a display and writes the
+ * timings as JSON.
+ */
+
+#include "gmap.h"
+#include <cpl_conv.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define ROBINSON_X	17005833.33	/* half the world in Robinson, m */
+#define ROBINSON_Y	8625154.67
+#define EARTH_RADIUS	6378137.0
+
+static char **mapset_files = NULL;
+static char *output_file = NULL;
+static int tile_size = 256;
+static int view_width = 1024;
+static int view_height = 768;
+static int sheets = 16;			/* synthetic mapset is sheets X sheets */
+static int points = 200000;		/* synthetic track points */
+static int repeat = 3;
+
+static GOptionEntry entries[] = {
+	{ "mapset", 'm', 0, G_OPTION_ARG_FILENAME_ARRAY, &mapset_files, "Mapset (XML) file, may repeat", "FILE" },
+	{ "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_file, "JSON output (default stdout)", "FILE" },
+	{ "tile-size", 't', 0, G_OPTION_ARG_INT, &tile_size, "Tile size", "PIXELS" },
+	{ "width", 'W', 0, G_OPTION_ARG_INT, &view_width, "Viewport width", "PIXELS" },
+	{ "height", 'H', 0, G_OPTION_ARG_INT, &view_height, "Viewport height", "PIXELS" },
+	{ "sheets", 's', 0, G_OPTION_ARG_INT, &sheets, "Synthetic mapset sheets per side (0 = none)", "N" },
+	{ "points", 'p', 0, G_OPTION_ARG_INT, &points, "Synthetic track points (0 = none)", "N" },
+	{ "repeat", 'r', 0, G_OPTION_ARG_INT, &repeat, "Renders of each step", "N" },
+	{ NULL }
+};
+
+/*
+ * Allocation counter. g_malloc() and most libraries use malloc, so
+ * counting the calls here is enough.
+ */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static volatile gint n_allocs = 0;
+
+void *
+malloc(size_t size) {
+	g_atomic_int_inc(&n_allocs);
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size) {
+	g_atomic_int_inc(&n_allocs);
+	return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size) {
+	g_atomic_int_inc(&n_allocs);
+	return __libc_realloc(ptr, size);
+}
+
+#define ALLOCS()	g_atomic_int_get(&n_allocs)
+#else
+#define ALLOCS()	0
+#endif
+
+/* One step of a scripted sequence, applied to the current view */
+struct BenchStep {
+	const char	*name;
+	double		zoom;		/* multiply the scale */
+	double		pan_x, pan_y;	/* in viewports */
+	const char	*projection;	/* NULL = keep */
+};
+
+static const struct BenchStep bench_steps[] = {
+	{ "initial",		1.0,	0,	0,	NULL },
+	{ "zoom_in",		0.5,	0,	0,	NULL },
+	{ "zoom_in",		0.5,	0,	0,	NULL },
+	{ "pan_east",		1.0,	1.0,	0,	NULL },
+	{ "pan_south",		1.0,	0,	1.0,	NULL },
+	{ "pan_west_half",	1.0,	-0.5,	0,	NULL },
+	{ "zoom_out",		4.0,	0,	0,	NULL },
+	{ "orthographic",	1.0,	0,	0,	"ortho" },
+	{ "zoom_in",		0.5,	0,	0,	NULL },
+	{ "robinson",		1.0,	0,	0,	"robinson" },
+	{ "native",		1.0,	0,	0,	"native" },
+};
+
+struct LayerTiming {
+	double		calc_us;
+	double		render_us;
+};
+
+struct Bench {
+	FILE		*out;
+	bool		first_scene;
+	struct RenderTarget rt;
+	char		*native_wkt;
+	struct GeoRect	native;			/* extent and scale to go back to */
+	double		native_scale;
+	double		center_lat, center_lon;	/* for reprojection */
+	double		cx, cy;			/* view center, target units */
+	struct LayerTiming *timing;
+};
+
+static char *
+wgs84_wkt() {
+	OGRSpatialReferenceH srs = OSRNewSpatialReference(NULL);
+	char *wkt = NULL, *ret;
+
+	OSRSetWellKnownGeogCS(srs, "WGS84");
+	OSRExportToWkt(srs, &wkt);
+	ret = gmap_strdup(wkt);
+	CPLFree(wkt);
+	OSRDestroySpatialReference(srs);
+	return ret;
+}
+
+static char *
+make_wkt(const char *projection, double lat, double lon) {
+	OGRSpatialReferenceH srs = OSRNewSpatialReference(NULL);
+	char *wkt = NULL, *ret;
+
+	OSRSetProjCS(srs, projection);
+	OSRSetWellKnownGeogCS(srs, "WGS84");
+	if(!strcmp(projection, "ortho"))
+		OSRSetOrthographic(srs, lat, lon, 0, 0);
+	else
+		OSRSetRobinson(srs, lon, 0, 0);
+	OSRExportToWkt(srs, &wkt);
+	ret = gmap_strdup(wkt);
+	CPLFree(wkt);
+	OSRDestroySpatialReference(srs);
+	return ret;
+}
+
+/* Scale and geotransform, timing each layer's calc_target_data */
+static void
+bench_set_scale(struct Bench *b, double scale) {
+	struct RenderTarget *rt = &b->rt;
+	int i, n = rt->n_layers;
+	gint64 t;
+
+	rt->n_layers = 0;
+	target_set_scale(rt, scale);
+	rt->n_layers = n;
+
+	for(i = 0; i < n; i++) {
+		if(!(rt->layers[i].flags & LAYER_IS_VISIBLE))
+			continue;
+		t = g_get_monotonic_time();
+		(*rt->layers[i].ops->calc_target_data)(&rt->layers[i], rt);
+		b->timing[i].calc_us += g_get_monotonic_time() - t;
+	}
+}
+
+/* Returns the scale to use in the new projection */
+static double
+bench_reproject(struct Bench *b, const char *projection) {
+	struct RenderTarget *rt = &b->rt;
+
+	gmap_free(rt->WKT);
+	if(!strcmp(projection, "native")) {
+		rt->WKT = gmap_strdup(b->native_wkt);
+		rt->left = b->native.left;
+		rt->right = b->native.right;
+		rt->top = b->native.top;
+		rt->bottom = b->native.bottom;
+	}
+	else {
+		rt->WKT = make_wkt(projection, b->center_lat, b->center_lon);
+		if(!strcmp(projection, "ortho")) {
+			rt->left = rt->bottom = -EARTH_RADIUS;
+			rt->right = rt->top = EARTH_RADIUS;
+		}
+		else {
+			rt->left = -ROBINSON_X;
+			rt->right = ROBINSON_X;
+			rt->top = ROBINSON_Y;
+			rt->bottom = -ROBINSON_Y;
+		}
+	}
+	b->cx = (rt->left + rt->right) / 2;
+	b->cy = (rt->top + rt->bottom) / 2;
+
+	if(!strcmp(projection, "native"))
+		return b->native_scale;
+	/* the whole projection across two viewports */
+	return fabs(rt->right - rt->left) / (2 * view_width);
+}
+
+static void
+bench_render_view(struct Bench *b, int *n_tiles) {
+	struct RenderTarget *rt = &b->rt;
+	double px, py;
+	int x0, y0, x, y, i;
+
+	geo_to_pixel_xy(rt->GeoTransform, b->cx, b->cy, &px, &py);
+	x0 = (int)px - view_width / 2;
+	y0 = (int)py - view_height / 2;
+
+	for(y = y0; y < y0 + view_height; y += tile_size) {
+		for(x = x0; x < x0 + view_width; x += tile_size) {
+			struct RenderContext rc;
+			cairo_surface_t *cs = cairo_image_surface_create(CAIRO_FORMAT_RGB24, tile_size, tile_size);
+
+			rc.rt = rt;
+			rc.cs = cs;
+			rc.ct = cairo_create(cs);
+			rc.x = x;
+			rc.y = y;
+			rc.w = tile_size;
+			rc.h = tile_size;
+			rc.objects = NULL;
+			rc.cancel = NULL;
+			rc.deadline = 0;
+
+			for(i = 0; i < rt->n_layers; i++) {
+				gint64 t;
+				if(!(rt->layers[i].flags & LAYER_IS_VISIBLE))
+					continue;
+				t = g_get_monotonic_time();
+				(*rt->layers[i].ops->render_layer)(&rt->layers[i], &rc);
+				cairo_surface_flush(cs);
+				b->timing[i].render_us += g_get_monotonic_time() - t;
+			}
+
+			cairo_destroy(rc.ct);
+			cairo_surface_destroy(cs);
+			(*n_tiles)++;
+		}
+	}
+}
+
+static void
+bench_run_step(struct Bench *b, const char *source, int stepno, const struct BenchStep *step) {
+	struct RenderTarget *rt = &b->rt;
+	int i, n_tiles = 0, allocs;
+	double scale, mpix;
+	gint64 t;
+
+	for(i = 0; i < rt->n_layers; i++)
+		b->timing[i].calc_us = b->timing[i].render_us = 0;
+
+	allocs = ALLOCS();
+	t = g_get_monotonic_time();
+
+	scale = rt->scale * step->zoom;
+	if(step->projection != NULL)
+		scale = bench_reproject(b, step->projection) * step->zoom;
+	b->cx += step->pan_x * view_width * scale;
+	b->cy -= step->pan_y * view_height * scale;
+	bench_set_scale(b, scale);
+
+	for(i = 0; i < repeat; i++)
+		bench_render_view(b, &n_tiles);
+
+	t = g_get_monotonic_time() - t;
+	allocs = ALLOCS() - allocs;
+	mpix = (double)n_tiles * tile_size * tile_size / 1e6;
+
+	fprintf(b->out, "%s\n    {\"source\": \"%s\", \"step\": %d, \"name\": \"%s\", "
+		"\"scale\": %g, \"width\": %d, \"height\": %d, \"tiles\": %d, "
+		"\"ms\": %.3f, \"mpix_per_s\": %.3f, \"allocs\": %d, \"layers\": [",
+		b->first_scene ? "" : ",", source, stepno, step->name,
+		rt->scale, rt->width, rt->height, n_tiles,
+		t / 1000.0, t > 0 ? mpix / (t / 1e6) : 0, allocs);
+	b->first_scene = FALSE;
+
+	for(i = 0; i < rt->n_layers; i++) {
+		fprintf(b->out, "%s\n      {\"layer\": %d, \"type\": \"%s\", \"calc_ms\": %.3f, "
+			"\"render_ms\": %.3f, \"ms_per_tile\": %.4f}",
+			i ? "," : "", i, layer_type_name(rt->layers[i].type),
+			b->timing[i].calc_us / 1000.0, b->timing[i].render_us / 1000.0,
+			n_tiles ? b->timing[i].render_us / 1000.0 / n_tiles : 0);
+	}
+	fprintf(b->out, "\n    ]}");
+}
+
+/* Runs the whole script on a target whose layers are set up */
+static void
+bench_run(struct Bench *b, const char *source, double scale) {
+	int i;
+
+	b->native_wkt = gmap_strdup(b->rt.WKT);
+	b->native.left = b->rt.left;
+	b->native.right = b->rt.right;
+	b->native.top = b->rt.top;
+	b->native.bottom = b->rt.bottom;
+	b->native_scale = scale;
+	b->cx = (b->rt.left + b->rt.right) / 2;
+	b->cy = (b->rt.top + b->rt.bottom) / 2;
+	b->timing = (struct LayerTiming *)gmap_malloc0(b->rt.n_layers * sizeof(struct LayerTiming));
+
+	/* the initial step keeps this scale */
+	b->rt.scale = scale;
+	for(i = 0; i < G_N_ELEMENTS(bench_steps); i++)
+		bench_run_step(b, source, i, &bench_steps[i]);
+
+	target_free_data(&b->rt);
+	memset(&b->rt, 0, sizeof(b->rt));
+	gmap_free(b->native_wkt);
+	gmap_free(b->timing);
+}
+
+static void
+bench_init_target(struct Bench *b) {
+	memset(&b->rt, 0, sizeof(b->rt));
+	b->rt.x_resulution = b->rt.y_resulution = 96;
+	b->rt.warp_error = DEFAULT_WARP_ERROR;
+	solid_fill_init_layer(target_add_layer(&b->rt), LAYER_SOLID, 1.0, 1.0, 1.0, 1.0);
+}
+
+static void
+bench_mapset(struct Bench *b, const char *source, struct MapSet *mapset) {
+	bench_init_target(b);
+	target_set_projection_and_scale_from_mapset(mapset, &b->rt);
+	mapset_init_layer(target_add_layer(&b->rt), LAYER_MAPSET, mapset);
+	b->center_lat = 0;
+	b->center_lon = 10;
+	bench_run(b, source, mapset->preferred_scale);
+}
+
+/* Many small sheets in geographic coordinates, images made in memory */
+static struct MapSet *
+synthetic_mapset(int n) {
+	struct MapSet *mapset = new_mapset();
+	int i, j, size = 512;
+
+	mapset_set_name(mapset, "synthetic sheets");
+	mapset->WKT = wgs84_wkt();
+
+	for(i = 0; i < n; i++) {
+		for(j = 0; j < n; j++) {
+			char name[40];
+			struct Map *map;
+
+			snprintf(name, sizeof(name), "sheet_%d_%d", i, j);
+			map = new_map(mapset, name);
+			map->fullpath = gmap_strdup(name);
+			map->cached = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, size, size);
+			gdk_pixbuf_fill(map->cached, (g_random_int() & 0xFFFFFF00) | 0xFF);
+			map->width = map->Rect.w = size;
+			map->height = map->Rect.h = size;
+			map->bpp = 24;
+			map->visible = TRUE;
+			/* 10 X 10 degrees around 30N 30E */
+			map->GeoTransform[0] = 30 + (j - n / 2.0) * 10.0 / n;
+			map->GeoTransform[1] = 10.0 / n / size;
+			map->GeoTransform[2] = 0;
+			map->GeoTransform[3] = 30 - (i - n / 2.0) * 10.0 / n;
+			map->GeoTransform[4] = 0;
+			map->GeoTransform[5] = -10.0 / n / size;
+		}
+	}
+	mapset_recalculate_bounds(mapset);
+	mapset_recalculate_preferred_scale(mapset);
+	return mapset;
+}
+
+/* A random walk track and a waypoint every 1000 points */
+static void
+synthetic_tracks(int n, struct TrackSet **trackset, struct WayPointSet **waypointset) {
+	struct Track *trk;
+	struct TrackSeg *seg = NULL;
+	double lat = 30, lon = 30, dlat = 0, dlon = 0;
+	int i;
+
+	*trackset = new_trackset();
+	*waypointset = new_waypointset();
+	trk = new_track("synthetic", *trackset);
+
+	for(i = 0; i < n; i++) {
+		struct TrackPoint *tp;
+
+		if(i % 10000 == 0) {
+			if(seg != NULL)
+				trackseg_calc_distance(seg, NULL, 0);
+			seg = new_trackseg(trk);
+		}
+		dlat = CLAMP(dlat + g_random_double_range(-1e-5, 1e-5), -1e-4, 1e-4);
+		dlon = CLAMP(dlon + g_random_double_range(-1e-5, 1e-5), -1e-4, 1e-4);
+		lat = CLAMP(lat + dlat, 25, 35);
+		lon = CLAMP(lon + dlon, 25, 35);
+
+		tp = new_trackpoint(seg);
+		tp->point.geo_lat = lat;
+		tp->point.geo_lon = lon;
+		tp->point.elevation = 100 + 50 * sin(i / 500.0);
+		tp->time.tv_sec = 1180000000 + i;
+		tp->time.tv_usec = 0;
+
+		if(i % 1000 == 0) {
+			char name[20];
+			struct WayPoint *wpt;
+
+			snprintf(name, sizeof(name), "WP%d", i / 1000);
+			wpt = new_waypoint(name, *waypointset);
+			wpt->point = tp->point;
+			wpt->symbol = gmap_strdup("");
+			wpt->image = get_image_for_symbol(wpt->symbol);
+		}
+	}
+	if(seg != NULL)
+		trackseg_calc_distance(seg, NULL, 0);
+	track_build_time_index(trk);
+	track_update_stats(trk);
+}
+
+static void
+bench_synthetic_points(struct Bench *b, int n) {
+	struct TrackSet *trackset;
+	struct WayPointSet *waypointset;
+
+	synthetic_tracks(n, &trackset, &waypointset);
+
+	bench_init_target(b);
+	b->rt.WKT = wgs84_wkt();
+
+	b->rt.left = 25;
+	b->rt.right = 35;
+	b->rt.top = 35;
+	b->rt.bottom = 25;
+	trackset_init_layer(target_add_layer(&b->rt), LAYER_TRACKSET, trackset);
+	waypointset_init_layer(target_add_layer(&b->rt), LAYER_WAYPOINTSET, waypointset);
+
+	b->center_lat = 30;
+	b->center_lon = 30;
+	bench_run(b, "synthetic_points", 10.0 / view_width);
+}
+
+int main(int argc, char **argv) {
+	GOptionContext *context;
+	GError *error = NULL;
+	struct Bench bench;
+	struct rusage ru;
+	char *default_mapsets[] = { "refmaps/political_world2.xml", NULL };
+	char **files;
+	int i;
+
+	context = g_option_context_new("- rendering benchmark");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if(!g_option_context_parse(context, &argc, &argv, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		return 1;
+	}
+	g_option_context_free(context);
+
+	tile_size = MAX(tile_size, 16);
+	repeat = MAX(repeat, 1);
+
+	trace_init();
+	GDAL_init_drivers();
+	utf8_init();
+
+	bench.out = stdout;
+	if(output_file != NULL && (bench.out = fopen(output_file, "w")) == NULL) {
+		perror(output_file);
+		return 1;
+	}
+	bench.first_scene = TRUE;
+
+	fprintf(bench.out, "{\n  \"tile_size\": %d, \"view_width\": %d, \"view_height\": %d, "
+		"\"repeat\": %d,\n  \"scenes\": [", tile_size, view_width, view_height, repeat);
+
+	files = mapset_files ? mapset_files : default_mapsets;
+	for(i = 0; files[i] != NULL; i++) {
+		struct MapSet *mapset = mapset_from_file(files[i]);
+		if(mapset == NULL) {
+			fprintf(stderr, "%s: could not open\n", files[i]);
+			continue;
+		}
+		bench_mapset(&bench, files[i], mapset);
+	}
+	if(sheets > 0)
+		bench_mapset(&bench, "synthetic_sheets", synthetic_mapset(sheets));
+	if(points > 0)
+		bench_synthetic_points(&bench, points);
+
+	getrusage(RUSAGE_SELF, &ru);
+	fprintf(bench.out, "\n  ],\n  \"peak_rss_kb\": %ld\n}\n", ru.ru_maxrss);
+
+	if(bench.out != stdout)
+		fclose(bench.out);
+	return 0;
+}
@@ -4,6 +4,7 @@
  */
 
 #include "gmap.h"
+#include <libxml/parser.h>
 
 #if 0
 static struct AffineGridData default_grid = {
@@ -34,33 +35,105 @@ activate_action (GtkAction *action, struct MainWindow *mainwindow)
 	g_message ("Action \"%s\" activated", gtk_action_get_name(action));
 }
 
-struct MapView *
-new_mapview_open_mapset(struct MainWindow *mainwindow, const char *filename) {
-	struct MapView *mapview;
-	struct MapSet *mapset;
-	struct Layer *layer;
+/* A mapset read in the background for a new view */
+struct OpenMapSet {
+	struct MainWindow *mainwindow;
+	struct MapView	*mapview;	/* NULL if the window was closed meanwhile */
+	char		*filename;
+	struct MapSet	*mapset;
+	int		layer;		/* gets the mapset */
+	guint		pulse;
+};
+
+static void
+open_window_destroyed(GtkWidget *widget, struct OpenMapSet *op) {
+	op->mapview = NULL;
+}
+
+static gboolean
+open_pulse(gpointer data) {
+	struct OpenMapSet *op = (struct OpenMapSet *)data;
+
+	if(op->mapview != NULL)
+		mapview_set_progress(op->mapview, "Opening", -1);
+	return TRUE;
+}
+
+/* Main thread: the mapset was read, or could not be */
+static gboolean
+open_mapset_done(gpointer data) {
+	struct OpenMapSet *op = (struct OpenMapSet *)data;
+	struct MapView *mapview = op->mapview;
+	struct MapSet *mapset = op->mapset;
+
+	g_source_remove(op->pulse);
+	if(mapview != NULL) {
+		g_signal_handlers_disconnect_by_func(mapview->window, G_CALLBACK(open_window_destroyed), op);
+		mapview_set_progress(mapview, NULL, 0);
+	}
 
-	mapset = mapset_from_file(filename);
 	if(mapset == NULL) {
-		GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(mainwindow->window),
+		GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(op->mainwindow->window),
 						0, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE,
-						"Could not open %s", filename);
+						"Could not open %s", op->filename);
 		gtk_dialog_run(GTK_DIALOG(dialog));
 		gtk_widget_destroy(dialog);
-		return NULL;
+		if(mapview != NULL)
+			mapview_close(mapview);
 	}
+	else if(mapview == NULL)
+		free_mapset(mapset);
+	else {
+		/* the sheets are cached as they are drawn */
+		mapset_init_layer(&mapview->rt.layers[op->layer], LAYER_MAPSET, mapset);
+		mapview_set_projection_and_scale_from_mapset(mapset,  mapview);
+		mapview_layers_changed(mapview);
+		mapview_set_name(mapview, mapset->name);
+	}
+
+	gmap_free(op->filename);
+	gmap_free(op);
+	return FALSE;
+}
+
+static gpointer
+open_mapset_thread(gpointer data) {
+	struct OpenMapSet *op = (struct OpenMapSet *)data;
+
+	op->mapset = mapset_from_file(op->filename);
+	g_idle_add(open_mapset_done, op);
+	return NULL;
+}
+
+/*
+ * The view is shown at once; the mapset is read by a thread and drawn
+ * when it is there.
+ */
+struct MapView *
+new_mapview_open_mapset(struct MainWindow *mainwindow, const char *filename) {
+	struct MapView *mapview;
+	struct OpenMapSet *op;
+	struct Layer *layer;
 
 	mapview = create_map_window(mainwindow);
 	layer = target_add_layer(&mapview->rt);
 	solid_fill_init_layer(layer, LAYER_SOLID, 1.0, 1.0, 1.0, 1.0);
 	layer = target_add_layer(&mapview->rt);
-	mapset_init_layer(layer, LAYER_MAPSET, mapset);
-
-	mapview_set_projection_and_scale_from_mapset(mapset,  mapview);
+	mapset_init_layer(layer, LAYER_MAPSET, NULL);
 
  	mapview_register_copy_coord_tool(mapview);
 
-	mapview_set_name(mapview, mapset->name);
+	mapview_set_name(mapview, filename);
+
+	op = (struct OpenMapSet *)gmap_malloc0(sizeof(struct OpenMapSet));
+	op->mainwindow = mainwindow;
+	op->mapview = mapview;
+	op->filename = gmap_strdup(filename);
+	op->layer = mapview->rt.n_layers - 1;
+	g_signal_connect(G_OBJECT(mapview->window), "destroy", G_CALLBACK(open_window_destroyed), op);
+	op->pulse = g_timeout_add(100, open_pulse, op);
+	open_pulse(op);
+	g_thread_unref(g_thread_new("open_mapset", open_mapset_thread, op));
 
 	return mapview;
 }
@@ -288,70 +361,27 @@ create_main_window() {
 int main(int argc, char **argv) {
 	struct MainWindow *mainwindow;
 	struct MapView *mapview;
-	/* data layers */
-	struct MapSet *mapset;
-	// struct TrackSet *trackset;
-	// struct RouteSet *routeset;
-	// struct WayPointSet *waypointset;
 	
 	/* Initialize GTK */
 	gtk_init (&argc, &argv);
+	xmlInitParser();	/* mapsets are read by threads */
+	trace_init();
 	GDAL_init_drivers();
 	utf8_init();
 	
 
 	mainwindow = create_main_window();
 
-#if 1
 	/* First mapview */
-	mapset = mapset_from_file(
+	mapview = new_mapview_open_mapset(mainwindow,
 		//"refmaps/maps50.xml"
 		//"maps250.xml"
 		//"world_map.xml"
 		"refmaps/political_world2.xml"
 		//"physical_world.xml"
 		);
-	if(mapset) {
-		mapview = create_map_window(mainwindow);
-		mapview_set_name(mapview, mapset->name);
-		solid_fill_init_layer(target_add_layer(&mapview->rt), LAYER_SOLID, 1.0, 1.0, 0.5, 0.5);
-		mapset_init_layer(target_add_layer(&mapview->rt), LAYER_MAPSET, mapset);
-		//solid_fill_init_layer(target_add_layer(&mapview->rt), LAYER_SOLID_ALPHA, 0.75, 1.0, 1.0, 1.0);
-		//affine_grid_init_layer(target_add_layer(&mapview->rt), LAYER_AFFINEGRID, &default_grid);
-#if 0
-		load_from_gpx(
-			//"20070602.gpx",
-			"backup-2007-03-11.gpx",
-			&trackset, &routeset, &waypointset);
-		//waypointset = NULL;
-		trackset_init_layer(target_add_layer(&mapview->rt), LAYER_TRACKSET, trackset);
-		routeset_init_layer(target_add_layer(&mapview->rt), LAYER_ROUTESET, routeset);
-		waypointset_init_layer(target_add_layer(&mapview->rt), LAYER_WAYPOINTSET, waypointset);
-#endif
-
-#if 1
-		mapview_set_projection_and_scale_from_mapset(mapset,  mapview);
-#else
-		{
-		OGRSpatialReferenceH osrs = OSRNewSpatialReference(NULL);
-		OSRSetOrthographic(osrs, 50., 70., 0, 0.);
-		//OSRSetRobinson(osrs, 10., 0., 0.);
-		char *wkt;
-		OSRExportToWkt(osrs, &wkt);
-		mapview->rt.WKT = gmap_strdup(wkt);
-		mapview->rt.left =   -6400000;
-		mapview->rt.right =   6400000;
-		mapview->rt.top =     6400000;
-		mapview->rt.bottom = -6400000;
-		mapview_set_scale(mapview, 20000.);
-		mapview_changed_projection(mapview);
-		g_message("WKT='%s'", wkt);
-		}
-#endif
-	}
-#endif
 
-	// select_region_tool_start(mapview);
+	select_region_tool_start(mapview);
 
 	//create_layers_box(mapview);
 
@@ -0,0 +1,208 @@
+/*
+ * gmap_render.c
+ * Copyright (C) 2007 Itai Nahshon
+ *
+ * Command line renderer: a mapset and GPX files to PNG, GeoTIFF, PDF or SVG,
+ * without a display.
+ */
+
+#include "gmap.h"
+#include <cpl_conv.h>
+
+static char *mapset_file = NULL;
+static char *output_file = NULL;
+static char *output_format = NULL;
+static char *extent_str = NULL;
+static char *wkt_str = NULL;
+static double scale = 0;
+static int width = 0;
+static double dpi = 96;
+static int tile_size = 256;
+static int threads = 0;
+static double warp_error = DEFAULT_WARP_ERROR;
+
+static GOptionEntry entries[] = {
+	{ "mapset", 'm', 0, G_OPTION_ARG_FILENAME, &mapset_file, "Mapset (XML) file", "FILE" },
+	{ "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_file, "Output image", "FILE" },
+	{ "format", 'f', 0, G_OPTION_ARG_STRING, &output_format, "Output format (default by file name)", "PNG|GTiff|PDF|SVG" },
+	{ "extent", 'e', 0, G_OPTION_ARG_STRING, &extent_str, "Area in target coordinates", "LEFT,TOP,RIGHT,BOTTOM" },
+	{ "wkt", 'p', 0, G_OPTION_ARG_STRING, &wkt_str, "Target projection (WKT, EPSG:n, ...)", "SRS" },
+	{ "scale", 's', 0, G_OPTION_ARG_DOUBLE, &scale, "Target units per pixel", "S" },
+	{ "width", 'w', 0, G_OPTION_ARG_INT, &width, "Output width, sets the scale", "PIXELS" },
+	{ "dpi", 'd', 0, G_OPTION_ARG_DOUBLE, &dpi, "Output resolution", "DPI" },
+	{ "tile-size", 't', 0, G_OPTION_ARG_INT, &tile_size, "Render tile size", "PIXELS" },
+	{ "threads", 'j', 0, G_OPTION_ARG_INT, &threads, "Render threads (default: all CPUs)", "N" },
+	{ "warp-error", 'E', 0, G_OPTION_ARG_DOUBLE, &warp_error, "Reprojection error allowed, 0 = exact (default 0.125)", "PIXELS" },
+	{ NULL }
+};
+
+static char *
+srs_to_wkt(const char *str) {
+	OGRSpatialReferenceH srs = OSRNewSpatialReference(NULL);
+	char *wkt = NULL, *ret = NULL;
+
+	if(OSRSetFromUserInput(srs, str) == OGRERR_NONE && OSRExportToWkt(srs, &wkt) == OGRERR_NONE)
+		ret = gmap_strdup(wkt);
+	CPLFree(wkt);
+	OSRDestroySpatialReference(srs);
+	return ret;
+}
+
+/* Adds the layers of a GPX file, tracks grow *bounds (top is the smaller y) */
+static bool
+add_gpx_file(struct RenderTarget *target, char *filename, struct GeoRect *bounds, bool *have_bounds) {
+	struct TrackSet *trackset;
+	struct RouteSet *routeset;
+	struct WayPointSet *waypointset;
+	struct GeoRect rect;
+	bool have_rect = FALSE;
+
+	if(!load_from_gpx(filename, &trackset, &routeset, &waypointset)) {
+		fprintf(stderr, "%s: could not open\n", filename);
+		return FALSE;
+	}
+	if(trackset != NULL) {
+		struct Layer *layer = target_add_layer(target);
+
+		trackset_init_layer(layer, LAYER_TRACKSET, trackset);
+		/* Only the projection is known yet: the extents, no pixels.
+		   target_set_scale() computes it again */
+		layer_calc_target_data(layer, target);
+		have_rect = trackset_calc_extents(layer, &rect);
+	}
+	if(routeset != NULL)
+		routeset_init_layer(target_add_layer(target), LAYER_ROUTESET, routeset);
+	if(waypointset != NULL)
+		waypointset_init_layer(target_add_layer(target), LAYER_WAYPOINTSET, waypointset);
+
+	if(have_rect) {
+		if(!*have_bounds)
+			*bounds = rect;
+		else {
+			bounds->left = MIN(bounds->left, rect.left);
+			bounds->right = MAX(bounds->right, rect.right);
+			bounds->top = MIN(bounds->top, rect.top);
+			bounds->bottom = MAX(bounds->bottom, rect.bottom);
+		}
+		*have_bounds = TRUE;
+	}
+	return TRUE;
+}
+
+int main(int argc, char **argv) {
+	GOptionContext *context;
+	GError *error = NULL;
+	struct RenderTarget rt;
+	struct MapSet *mapset = NULL;
+	struct GeoRect extent, bounds;
+	bool have_extent = FALSE, have_bounds = FALSE;
+	int i;
+
+	context = g_option_context_new("[GPX-FILE...] - render maps and tracks to an image");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if(!g_option_context_parse(context, &argc, &argv, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		return 1;
+	}
+	g_option_context_free(context);
+
+	if(output_file == NULL) {
+		fprintf(stderr, "--output is required\n");
+		return 1;
+	}
+
+	trace_init();
+	GDAL_init_drivers();
+	utf8_init();
+
+	memset(&rt, 0, sizeof(rt));
+	rt.x_resulution = rt.y_resulution = dpi;
+	rt.warp_error = MAX(warp_error, 0);
+
+	/* The mapset gives the default projection, extent and scale */
+	if(mapset_file != NULL) {
+		mapset = mapset_from_file(mapset_file);
+		if(mapset == NULL) {
+			fprintf(stderr, "%s: could not open\n", mapset_file);
+			return 1;
+		}
+		target_set_projection_and_scale_from_mapset(mapset, &rt);
+	}
+
+	if(wkt_str != NULL) {
+		gmap_free(rt.WKT);
+		rt.WKT = srs_to_wkt(wkt_str);
+		if(rt.WKT == NULL) {
+			fprintf(stderr, "%s: unknown projection\n", wkt_str);
+			return 1;
+		}
+	}
+	else if(rt.WKT == NULL)
+		rt.WKT = srs_to_wkt("WGS84");
+
+	/* Mapset bounds are only good in its own projection */
+	if(mapset != NULL && wkt_str == NULL) {
+		extent.left = mapset->left;
+		extent.right = mapset->right;
+		extent.top = mapset->top;
+		extent.bottom = mapset->bottom;
+		have_extent = TRUE;
+	}
+
+	solid_fill_init_layer(target_add_layer(&rt), LAYER_SOLID, 1.0, 1.0, 1.0, 1.0);
+	if(mapset != NULL)
+		mapset_init_layer(target_add_layer(&rt), LAYER_MAPSET, mapset);
+
+	for(i = 1; i < argc; i++) {
+		if(!add_gpx_file(&rt, argv[i], &bounds, &have_bounds))
+			return 1;
+	}
+
+	/* Otherwise the tracks set the extent, north up */
+	if(!have_extent && have_bounds) {
+		extent.left = bounds.left;
+		extent.right = bounds.right;
+		extent.top = bounds.bottom;
+		extent.bottom = bounds.top;
+		have_extent = TRUE;
+	}
+
+	if(extent_str != NULL) {
+		if(sscanf(extent_str, "%lf,%lf,%lf,%lf",
+			  &extent.left, &extent.top, &extent.right, &extent.bottom) != 4) {
+			fprintf(stderr, "%s: bad extent\n", extent_str);
+			return 1;
+		}
+		have_extent = TRUE;
+	}
+	if(!have_extent) {
+		fprintf(stderr, "no extent, use --extent\n");
+		return 1;
+	}
+	rt.left = extent.left;
+	rt.right = extent.right;
+	rt.top = extent.top;
+	rt.bottom = extent.bottom;
+
+	if(width > 0)
+		scale = fabs(rt.right - rt.left) / width;
+	else if(scale <= 0 && mapset != NULL)
+		scale = mapset->preferred_scale;
+	if(scale <= 0) {
+		fprintf(stderr, "no scale, use --scale or --width\n");
+		return 1;
+	}
+
+	if(threads <= 0)
+		threads = g_get_num_processors();
+
+	/* Computes the size and the layers' target data */
+	target_set_scale(&rt, scale);
+	g_message("rendering %d X %d pixels, %d threads", rt.width, rt.height, threads);
+
+	if(!render_target_to_file(&rt, output_file, output_format, tile_size, threads))
+		return 1;
+
+	target_free_data(&rt);
+	return 0;
+}
@@ -0,0 +1,385 @@
+/*
+ * gmap_tiles.c
+ * Copyright (C) 2007 Itai Nahshon
+ *
+ * Render a mapset to a Web Mercator tile pyramid, either an MBTiles
+ * file or a z/x/y directory of PNG tiles. Tiles outside the maps are
+ * skipped, and so are tiles already written: an interrupted run is
+ * continued by running it again.
+ */
+
+#include "gmap.h"
+#include <ogr_srs_api.h>
+#include <cpl_conv.h>
+#include <sqlite3.h>
+
+#define TILE_SIZE	256
+#define MERC_MAX	20037508.342789244	/* half the equator, in meters */
+#define MAX_ZOOM	22			/* target width must fit an int */
+#define COMMIT_EVERY	500			/* tiles per MBTiles transaction */
+
+static char *mapset_file = NULL;
+static char *output = NULL;
+static int min_zoom = 0;
+static int max_zoom = -1;
+static int threads = 0;
+
+static GOptionEntry entries[] = {
+	{ "mapset", 'm', 0, G_OPTION_ARG_FILENAME, &mapset_file, "Mapset (XML) file", "FILE" },
+	{ "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "MBTiles file (*.mbtiles) or tile directory", "PATH" },
+	{ "min-zoom", 'z', 0, G_OPTION_ARG_INT, &min_zoom, "First zoom level (default 0)", "Z" },
+	{ "max-zoom", 'Z', 0, G_OPTION_ARG_INT, &max_zoom, "Last zoom level", "Z" },
+	{ "threads", 'j', 0, G_OPTION_ARG_INT, &threads, "Render threads (default: all CPUs)", "N" },
+	{ NULL }
+};
+
+struct TileWriter {
+	sqlite3		*db;		/* MBTiles, or */
+	const char	*dir;		/* z/x/y.png under dir */
+	sqlite3_stmt	*exists;
+	sqlite3_stmt	*insert;
+	int		pending;	/* inserted since the last commit */
+	int		written, failed;
+};
+
+struct ZoomJob {
+	struct RenderTarget *target;
+	struct TileWriter *out;
+	int		z;
+};
+
+struct PyramidTile {
+	int		x, y;
+};
+
+/* sqlite connection and counters */
+G_LOCK_DEFINE_STATIC(tile_writer);
+
+static char *
+mercator_wkt() {
+	OGRSpatialReferenceH srs = OSRNewSpatialReference(NULL);
+	char *wkt = NULL, *ret = NULL;
+
+	if(OSRImportFromEPSG(srs, 3857) == OGRERR_NONE && OSRExportToWkt(srs, &wkt) == OGRERR_NONE)
+		ret = gmap_strdup(wkt);
+	CPLFree(wkt);
+	OSRDestroySpatialReference(srs);
+	return ret;
+}
+
+static bool
+db_exec(sqlite3 *db, const char *sql) {
+	char *err = NULL;
+
+	if(sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", sql, err);
+		sqlite3_free(err);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static bool
+writer_open(struct TileWriter *out, const char *path) {
+	memset(out, 0, sizeof(*out));
+
+	if(!g_str_has_suffix(path, ".mbtiles")) {
+		out->dir = path;
+		if(g_mkdir_with_parents(path, 0755) != 0) {
+			perror(path);
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	if(sqlite3_open(path, &out->db) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", path, sqlite3_errmsg(out->db));
+		return FALSE;
+	}
+	if(!db_exec(out->db,
+		"CREATE TABLE IF NOT EXISTS metadata (name TEXT, value TEXT);"
+		"CREATE TABLE IF NOT EXISTS tiles (zoom_level INTEGER, tile_column INTEGER,"
+			" tile_row INTEGER, tile_data BLOB);"
+		"CREATE UNIQUE INDEX IF NOT EXISTS tile_index ON tiles (zoom_level, tile_column, tile_row);"))
+		return FALSE;
+
+	if(sqlite3_prepare_v2(out->db,
+		"SELECT 1 FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?",
+		-1, &out->exists, NULL) != SQLITE_OK ||
+	   sqlite3_prepare_v2(out->db,
+		"INSERT OR REPLACE INTO tiles VALUES (?, ?, ?, ?)",
+		-1, &out->insert, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", path, sqlite3_errmsg(out->db));
+		return FALSE;
+	}
+	return db_exec(out->db, "BEGIN");
+}
+
+static void
+writer_close(struct TileWriter *out) {
+	if(out->db == NULL)
+		return;
+	db_exec(out->db, "COMMIT");
+	sqlite3_finalize(out->exists);
+	sqlite3_finalize(out->insert);
+	sqlite3_close(out->db);
+}
+
+static void
+set_metadata(struct TileWriter *out, const char *name, const char *value) {
+	sqlite3_stmt *st;
+
+	if(out->db == NULL)
+		return;
+	sqlite3_prepare_v2(out->db, "DELETE FROM metadata WHERE name=?", -1, &st, NULL);
+	sqlite3_bind_text(st, 1, name, -1, SQLITE_STATIC);
+	sqlite3_step(st);
+	sqlite3_finalize(st);
+	sqlite3_prepare_v2(out->db, "INSERT INTO metadata VALUES (?, ?)", -1, &st, NULL);
+	sqlite3_bind_text(st, 1, name, -1, SQLITE_STATIC);
+	sqlite3_bind_text(st, 2, value, -1, SQLITE_STATIC);
+	sqlite3_step(st);
+	sqlite3_finalize(st);
+}
+
+static char *
+tile_filename(struct TileWriter *out, int z, int x, int y) {
+	return g_strdup_printf("%s/%d/%d/%d.png", out->dir, z, x, y);
+}
+
+/* MBTiles rows count from the south (TMS) */
+static bool
+tile_exists(struct TileWriter *out, int z, int x, int y) {
+	bool ret;
+
+	if(out->db == NULL) {
+		char *filename = tile_filename(out, z, x, y);
+		ret = g_file_test(filename, G_FILE_TEST_EXISTS);
+		g_free(filename);
+		return ret;
+	}
+
+	G_LOCK(tile_writer);
+	sqlite3_bind_int(out->exists, 1, z);
+	sqlite3_bind_int(out->exists, 2, x);
+	sqlite3_bind_int(out->exists, 3, (1 << z) - 1 - y);
+	ret = sqlite3_step(out->exists) == SQLITE_ROW;
+	sqlite3_reset(out->exists);
+	G_UNLOCK(tile_writer);
+	return ret;
+}
+
+static cairo_status_t
+append_png(void *closure, const unsigned char *data, unsigned int length) {
+	g_byte_array_append((GByteArray *)closure, data, length);
+	return CAIRO_STATUS_SUCCESS;
+}
+
+static bool
+write_tile_file(struct TileWriter *out, int z, int x, int y, GByteArray *png) {
+	char *dirname = g_strdup_printf("%s/%d/%d", out->dir, z, x);
+	char *filename = tile_filename(out, z, x, y);
+	char *tmpname = g_strconcat(filename, ".tmp", NULL);
+	bool ret;
+
+	/* A tile file is either complete or missing */
+	ret = g_mkdir_with_parents(dirname, 0755) == 0 &&
+	      g_file_set_contents(tmpname, (const gchar *)png->data, png->len, NULL) &&
+	      rename(tmpname, filename) == 0;
+
+	g_free(dirname);
+	g_free(filename);
+	g_free(tmpname);
+	return ret;
+}
+
+static bool
+write_tile_db(struct TileWriter *out, int z, int x, int y, GByteArray *png) {
+	bool ret;
+
+	sqlite3_bind_int(out->insert, 1, z);
+	sqlite3_bind_int(out->insert, 2, x);
+	sqlite3_bind_int(out->insert, 3, (1 << z) - 1 - y);
+	sqlite3_bind_blob(out->insert, 4, png->data, png->len, SQLITE_STATIC);
+	ret = sqlite3_step(out->insert) == SQLITE_DONE;
+	sqlite3_reset(out->insert);
+
+	/* What is committed survives an interruption */
+	if(++out->pending >= COMMIT_EVERY) {
+		db_exec(out->db, "COMMIT");
+		db_exec(out->db, "BEGIN");
+		out->pending = 0;
+	}
+	return ret;
+}
+
+static void
+render_pyramid_tile(gpointer data, gpointer user_data) {
+	struct PyramidTile *tile = (struct PyramidTile *)data;
+	struct ZoomJob *job = (struct ZoomJob *)user_data;
+	struct TileWriter *out = job->out;
+	cairo_surface_t *cs;
+	GByteArray *png = g_byte_array_new();
+	bool ok;
+
+	TRACE_BEGIN("tile", NULL);
+	cs = cairo_image_surface_create(CAIRO_FORMAT_RGB24, TILE_SIZE, TILE_SIZE);
+	target_render_area(job->target, cs, tile->x * TILE_SIZE, tile->y * TILE_SIZE, TILE_SIZE, TILE_SIZE);
+	ok = cairo_surface_write_to_png_stream(cs, append_png, png) == CAIRO_STATUS_SUCCESS;
+	cairo_surface_destroy(cs);
+
+	if(ok && out->db == NULL)
+		ok = write_tile_file(out, job->z, tile->x, tile->y, png);
+
+	G_LOCK(tile_writer);
+	if(ok && out->db != NULL)
+		ok = write_tile_db(out, job->z, tile->x, tile->y, png);
+	if(ok)
+		out->written++;
+	else
+		out->failed++;
+	G_UNLOCK(tile_writer);
+	TRACE_END("tile");
+
+	g_byte_array_free(png, TRUE);
+	gmap_free(tile);
+}
+
+/* Bounds of a tile range in lon/lat, for the MBTiles metadata */
+static void
+set_bounds_metadata(struct TileWriter *out, const struct RenderTarget *target,
+	int left, int top, int right, int bottom) {
+	double res = target->GeoTransform[1];
+	double lon0 = (-MERC_MAX + left * res) / MERC_MAX * 180;
+	double lon1 = (-MERC_MAX + right * res) / MERC_MAX * 180;
+	double lat0 = atan(sinh((MERC_MAX - bottom * res) / MERC_MAX * M_PI)) * 180 / M_PI;
+	double lat1 = atan(sinh((MERC_MAX - top * res) / MERC_MAX * M_PI)) * 180 / M_PI;
+	char str[200];
+
+	snprintf(str, sizeof(str), "%f,%f,%f,%f", lon0, lat0, lon1, lat1);
+	set_metadata(out, "bounds", str);
+}
+
+static int
+render_zoom(struct RenderTarget *target, struct Layer *maps, struct TileWriter *out, int z) {
+	struct ZoomJob job;
+	GThreadPool *pool;
+	int left, top, right, bottom;
+	int x, y, n = 1 << z;
+	int queued = 0, skipped = 0;
+
+	/* The whole world, TILE_SIZE << z pixels wide */
+	target->left = -MERC_MAX;
+	target->right = MERC_MAX;
+	target->top = MERC_MAX;
+	target->bottom = -MERC_MAX;
+	target_set_scale(target, 2 * MERC_MAX / (TILE_SIZE * n));
+
+	if(!mapset_target_bounds(maps, &left, &top, &right, &bottom)) {
+		g_message("zoom %d: no maps", z);
+		return 0;
+	}
+	if(z == min_zoom)
+		set_bounds_metadata(out, target, left, top, right, bottom);
+
+	job.target = target;
+	job.out = out;
+	job.z = z;
+	pool = g_thread_pool_new(render_pyramid_tile, &job, threads, TRUE, NULL);
+
+	for(y = MAX(top / TILE_SIZE, 0); y <= MIN(bottom / TILE_SIZE, n-1); y++) {
+		for(x = MAX(left / TILE_SIZE, 0); x <= MIN(right / TILE_SIZE, n-1); x++) {
+			struct PyramidTile *tile;
+
+			if(mapset_area_is_empty(maps, x * TILE_SIZE, y * TILE_SIZE, TILE_SIZE, TILE_SIZE))
+				continue;
+			if(tile_exists(out, z, x, y)) {
+				skipped++;
+				continue;
+			}
+			tile = (struct PyramidTile *)gmap_malloc(sizeof(struct PyramidTile));
+			tile->x = x;
+			tile->y = y;
+			g_thread_pool_push(pool, tile, NULL);
+			queued++;
+		}
+	}
+
+	/* wait for this zoom, the next one changes the target */
+	g_thread_pool_free(pool, FALSE, TRUE);
+	g_message("zoom %d: %d tiles rendered, %d already there", z, queued, skipped);
+	return queued;
+}
+
+int main(int argc, char **argv) {
+	GOptionContext *context;
+	GError *error = NULL;
+	struct RenderTarget rt;
+	struct MapSet *mapset;
+	struct TileWriter out;
+	struct Layer *maps;
+	char str[20];
+	char *name;
+	int z;
+
+	context = g_option_context_new("- render a mapset to MBTiles or z/x/y tiles");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if(!g_option_context_parse(context, &argc, &argv, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		return 1;
+	}
+	g_option_context_free(context);
+
+	if(mapset_file == NULL || output == NULL || max_zoom < 0) {
+		fprintf(stderr, "--mapset, --output and --max-zoom are required\n");
+		return 1;
+	}
+	if(min_zoom < 0 || min_zoom > max_zoom || max_zoom > MAX_ZOOM) {
+		fprintf(stderr, "zoom levels must be 0 <= min <= max <= %d\n", MAX_ZOOM);
+		return 1;
+	}
+	if(threads <= 0)
+		threads = g_get_num_processors();
+
+	trace_init();
+	GDAL_init_drivers();
+	utf8_init();
+
+	mapset = mapset_from_file(mapset_file);
+	if(mapset == NULL) {
+		fprintf(stderr, "%s: could not open\n", mapset_file);
+		return 1;
+	}
+	if(!writer_open(&out, output))
+		return 1;
+
+	memset(&rt, 0, sizeof(rt));
+	rt.WKT = mercator_wkt();
+	rt.x_resulution = rt.y_resulution = 96;
+	rt.warp_error = DEFAULT_WARP_ERROR;
+
+	solid_fill_init_layer(target_add_layer(&rt), LAYER_SOLID, 1.0, 1.0, 1.0, 1.0);
+	mapset_init_layer(target_add_layer(&rt), LAYER_MAPSET, mapset);
+	maps = &rt.layers[1];
+
+	name = g_path_get_basename(mapset_file);
+	set_metadata(&out, "name", name);
+	set_metadata(&out, "type", "baselayer");
+	set_metadata(&out, "version", "1.1");
+	set_metadata(&out, "format", "png");
+	snprintf(str, sizeof(str), "%d", min_zoom);
+	set_metadata(&out, "minzoom", str);
+	snprintf(str, sizeof(str), "%d", max_zoom);
+	set_metadata(&out, "maxzoom", str);
+	g_free(name);
+
+	/* Decoded sheets stay cached from one zoom level to the next */
+	for(z = min_zoom; z <= max_zoom; z++)
+		render_zoom(&rt, maps, &out, z);
+
+	writer_close(&out);
+	target_free_data(&rt);
+
+	g_message("%d tiles written, %d failed", out.written, out.failed);
+	return out.failed ? 1 : 0;
+}
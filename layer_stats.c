@@ -0,0 +1,158 @@
+/*
+ * layer_stats.c
+ * Copyright (C) 2007 Itai Nahshon
+ *
+ * Per-layer render timing. Every render_layer and calc_target_data
+ * call made through layer_render()/layer_calc_target_data() is timed;
+ * the last STATS_SAMPLES render times of each layer are kept in a
+ * rolling log2 histogram.
+ */
+
+#include "gmap.h"
+
+#define STATS_SAMPLES	64
+#define STATS_BUCKETS	24		/* bucket b holds [2^b, 2^(b+1)) usec */
+
+struct LayerStats {
+	int		n;			/* samples in the ring */
+	int		next;
+	int		samples[STATS_SAMPLES];	/* render time, usec */
+	int		buckets[STATS_SAMPLES];	/* histogram bucket of each */
+	int		hist[STATS_BUCKETS];
+	gint64		sum;
+	int		objects;		/* drawn in the last call */
+	int		calc_us;		/* last calc_target_data */
+};
+
+/* Tiles may render in parallel */
+G_LOCK_DEFINE_STATIC(layer_stats);
+
+static int
+bucket_of(int us) {
+	int b = 0;
+
+	while(us > 1 && b < STATS_BUCKETS-1) {
+		us >>= 1;
+		b++;
+	}
+	return b;
+}
+
+static struct LayerStats *
+get_stats(struct Layer *layer) {
+	if(layer->stats == NULL)
+		layer->stats = (struct LayerStats *)gmap_malloc0(sizeof(struct LayerStats));
+	return layer->stats;
+}
+
+static void
+add_sample(struct LayerStats *st, int us, int objects) {
+	if(st->n == STATS_SAMPLES) {
+		st->hist[st->buckets[st->next]]--;
+		st->sum -= st->samples[st->next];
+	}
+	else
+		st->n++;
+
+	st->samples[st->next] = us;
+	st->buckets[st->next] = bucket_of(us);
+	st->hist[st->buckets[st->next]]++;
+	st->sum += us;
+	st->next = (st->next + 1) % STATS_SAMPLES;
+	st->objects = objects;
+}
+
+/* Upper bound of the bucket holding the p-th fraction of the samples */
+static int
+percentile(const struct LayerStats *st, double p) {
+	int b, seen = 0, want = (int)ceil(p * st->n);
+
+	for(b = 0; b < STATS_BUCKETS; b++) {
+		seen += st->hist[b];
+		if(seen >= want)
+			break;
+	}
+	return 2 << b;
+}
+
+void
+layer_render(struct Layer *layer, const struct RenderContext *rc) {
+	struct RenderContext lrc = *rc;
+	int objects = 0;
+	gint64 t;
+
+	lrc.objects = &objects;
+	TRACE_BEGIN("render_layer", layer_type_name(layer->type));
+	t = g_get_monotonic_time();
+	(*layer->ops->render_layer)(layer, &lrc);
+	t = g_get_monotonic_time() - t;
+	TRACE_END("render_layer");
+
+	RENDER_COUNT_OBJECTS(rc, objects);
+
+	G_LOCK(layer_stats);
+	add_sample(get_stats(layer), (int)t, objects);
+	G_UNLOCK(layer_stats);
+}
+
+void
+layer_calc_target_data(struct Layer *layer, const struct RenderTarget *target) {
+	gint64 t;
+
+	TRACE_BEGIN("calc_target_data", layer_type_name(layer->type));
+	t = g_get_monotonic_time();
+	(*layer->ops->calc_target_data)(layer, target);
+	t = g_get_monotonic_time() - t;
+	TRACE_END("calc_target_data");
+
+	G_LOCK(layer_stats);
+	get_stats(layer)->calc_us = (int)t;
+	G_UNLOCK(layer_stats);
+}
+
+void
+layer_free_stats(struct Layer *layer) {
+	gmap_free(layer->stats);
+	layer->stats = NULL;
+}
+
+const char *
+layer_type_name(enum LayerType type) {
+	switch(type) {
+	case LAYER_SOLID:	return "solid";
+	case LAYER_SOLID_ALPHA:	return "solid_alpha";
+	case LAYER_MAPSET:	return "mapset";
+	case LAYER_CALIBRATE:	return "calibrate";
+	case LAYER_GRID:	return "grid";
+	case LAYER_TRACKSET:	return "tracks";
+	case LAYER_ROUTESET:	return "routes";
+	case LAYER_WAYPOINTSET:	return "waypoints";
+	case LAYER_AFFINEGRID:	return "affinegrid";
+	case LAYER_SRTM:	return "srtm";
+	case LAYER_PLAYBACK:	return "playback";
+	default:		return "other";
+	}
+}
+
+/* One line for the status bar: name mean/p95 ms, objects, per layer */
+int
+format_layer_stats(char *ptr, int left, const struct RenderTarget *target) {
+	int i, filled = 0;
+
+	G_LOCK(layer_stats);
+	for(i = 0; i < target->n_layers && filled < left; i++) {
+		const struct LayerStats *st = target->layers[i].stats;
+
+		if(st == NULL || st->n == 0)
+			continue;
+		filled += snprintf(ptr+filled, left-filled, "%s%s %.1f/%.1fms",
+			filled ? "  " : "", layer_type_name(target->layers[i].type),
+			st->sum / 1000.0 / st->n, percentile(st, 0.95) / 1000.0);
+		if(filled < left && st->objects > 0)
+			filled += snprintf(ptr+filled, left-filled, " %d obj", st->objects);
+		if(filled < left && st->calc_us >= 1000)
+			filled += snprintf(ptr+filled, left-filled, " calc %.0fms", st->calc_us / 1000.0);
+	}
+	G_UNLOCK(layer_stats);
+	return MIN(filled, left);
+}
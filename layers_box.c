@@ -11,8 +11,27 @@ static const char *layer_type_names[] = {
 	"ROUTESET",
 	"WAYPOINTSET",
 	"AFFINEGRID",
+	"SRTM",
+	"PLAYBACK",
 };
 
+static void
+visible_toggled(GtkCellRendererToggle *renderer, gchar *path, struct MapView *mapview) {
+	GtkTreeModel *store = GTK_TREE_MODEL(g_object_get_data(G_OBJECT(renderer), "store"));
+	GtkTreeIter iter;
+	gboolean visible;
+	int i;
+
+	if(!gtk_tree_model_get_iter_from_string(store, &iter, path))
+		return;
+	gtk_tree_model_get(store, &iter, 0, &i, 2, &visible, -1);
+	visible = !visible;
+	gtk_list_store_set(GTK_LIST_STORE(store), &iter, 2, visible, -1);
+
+	/* Only the layer's own group renders, if at all */
+	mapview_show_layer(mapview, i, visible);
+}
+
 GtkWidget *
 create_layers_box(struct MapView *mapview) {
 	GtkWidget *vbox;
@@ -52,6 +71,8 @@ create_layers_box(struct MapView *mapview) {
 					       "mode", GTK_CELL_RENDERER_MODE_EDITABLE,
                                                NULL);
 	renderer = gtk_cell_renderer_toggle_new ();
+	g_object_set_data(G_OBJECT(renderer), "store", store);
+	g_signal_connect(G_OBJECT(renderer), "toggled", G_CALLBACK(visible_toggled), mapview);
 	gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(treeview),
                                                -1,      
                                                "Visible",  
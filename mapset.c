@@ -44,6 +44,8 @@ new_mapset() {
 	mapset->preferred_scale = 1.0;	/* arbitrary = 1 unit/pixel */
 	mapset->max_scale = 0.0;
 	mapset->min_scale = 0.0;
+	mapset->n_queued = 0;
+	mapset->n_decoded = 0;
 
 	return mapset;
 }
@@ -55,12 +57,14 @@ free_mapset(struct MapSet *mapset) {
 	gmap_free(mapset->description);
 	gmap_free(mapset->WKT);
 	gmap_free(mapset->filename);
+	gmap_free(mapset->basedir);
 	for(i = 0; i < mapset->count; i++) {
 		/* free from cache */
 		map_uncache(&mapset->maps[i]);
 		gmap_free(mapset->maps[i].filename);
 		gmap_free(mapset->maps[i].fullpath);
 		gmap_free(mapset->maps[i].calibration_points);
+		gmap_free(mapset->maps[i].Crop);
 	}
 	gmap_free(mapset->maps);
 	gmap_free(mapset);
@@ -78,7 +82,8 @@ new_map(struct MapSet *mapset, const char *filename) {
 	mp->calibration_points = NULL;
 	mp->visible = FALSE;
 	mp->cached = NULL;
-	mp->cachedDS = NULL;
+	mp->sources = NULL;
+	mp->decoding = FALSE;
 	mp->mapset = mapset;
 	mp->fullpath = NULL;
 	mp->width = 0;
@@ -267,13 +272,24 @@ mapset_from_file(const char *filename) {
 	xmlDocPtr doc;
 	struct MapSet *mapset;
 
-	doc = xmlReadFile(filename, NULL, XML_PARSE_NOBLANKS|XML_PARSE_NOXINCNODE|XML_PARSE_NONET|XML_PARSE_NOENT);
-	if (doc == NULL ) {
-		/* XXX */
-		fprintf(stderr,"GPX Document %s not parsed successfully.\n", filename);
-		return NULL;
+	TRACE_BEGIN("mapset_from_file", filename);
+	mapset = mapset_from_index(filename);
+	if(mapset == NULL) {
+		doc = xmlReadFile(filename, NULL, XML_PARSE_NOBLANKS|XML_PARSE_NOXINCNODE|XML_PARSE_NONET|XML_PARSE_NOENT);
+		if (doc == NULL ) {
+			/* XXX */
+			fprintf(stderr,"GPX Document %s not parsed successfully.\n", filename);
+			TRACE_END("mapset_from_file");
+			return NULL;
+		}
+		mapset = mapset_from_doc(doc);
+		if(mapset == NULL) {
+			TRACE_END("mapset_from_file");
+			return NULL;
+		}
+		if(mapset_wants_index(mapset, filename))
+			mapset_write_index(mapset, filename);
 	}
-	mapset = mapset_from_doc(doc);
 
 	if(mapset->basedir == NULL) {
 		char *basedir = g_path_get_dirname (filename);
@@ -283,6 +299,7 @@ mapset_from_file(const char *filename) {
 	mapset->filename = get_absolute_filename(filename);
 	mapset->dirty = FALSE;
 
+	TRACE_END("mapset_from_file");
 	return mapset;
 }
 
@@ -421,6 +438,8 @@ mapset_save(struct MapSet *mapset, char *filename) {
 
 	if(xmlSaveFormatFile(filename, doc, TRUE) < 0)
 		fprintf(stderr, "Cannot save file %s\n", "out.xml");
+	else
+		mapset_remove_index(filename);	/* stale, made from the XML on the next load */
 
 	/* After successful save */
 	if(mapset->filename)
@@ -18,10 +18,67 @@ extern GDALDatasetH GDALOpenCairo(cairo_surface_t *, GDALAccess);
 struct MapTargetdata {
 	bool visible;
 	struct {
-		int left, right, top, bottom;	/* bounding rect in Target's pixels coordinates */
+		int left, right, top, bottom;	/* bounding rect in Target's pixels coordinates, inclusive */
 	} Bounds;
+	int n_outline;
+	double *outline;			/* crop polygon in target pixels, x y pairs */
+	GHashTable *meshes;			/* struct Mesh by block, see below */
 };
 
+struct MapsetTargetdata {
+	OGRCoordinateTransformationH to_mapset;	/* target to mapset coordinates */
+	int n_meshes;
+	struct MapTargetdata *maps;
+};
+
+/*
+ * Reprojection meshes. The target is cut in MESH_BLOCK pixel blocks; for
+ * each block and map the map pixel under every MESH_STEP'th target pixel
+ * is computed exactly once, and the pixels between are interpolated from
+ * these points. Meshes stay until the target data is recalculated, so
+ * exposing the same area again costs no projection at all.
+ */
+#define MESH_BLOCK	256
+#define MESH_STEP	16
+#define MESH_N		(MESH_BLOCK / MESH_STEP + 1)	/* points each way */
+#define MESH_MAX	4096				/* cached per layer */
+
+struct Mesh {
+	bool	usable;			/* all points could be transformed */
+	float	max_error;		/* of the interpolation, in map pixels */
+	float	sx[MESH_N * MESH_N];	/* map pixel of each point */
+	float	sy[MESH_N * MESH_N];
+};
+
+/* The mesh tables */
+G_LOCK_DEFINE_STATIC(mapset_mesh);
+/* to_mapset, a transformation is not safe to use from two threads at once */
+G_LOCK_DEFINE_STATIC(mapset_transform);
+
+/*
+ * GDAL source data sets of the cached maps. A data set must not be read
+ * by two threads at once, so every warp takes one of its own; they all
+ * read the pixels of the same pixbuf. Idle ones are kept on the map for
+ * the next warp, up to MAP_SOURCES_IDLE of them over all maps; the block
+ * cache GDAL keeps for each is bounded by GDAL_CACHEMAX.
+ */
+#define MAP_SOURCES_IDLE	64
+
+struct MapSource {
+	GDALDatasetH	ds;
+	bool		unity;		/* GDAL wants NULL for a {0 1 0 0 0 1} transform */
+	GdkPixbuf	*pixbuf;	/* made for these */
+	int		x, y, w, h;
+	double		GeoTransform[6];
+};
+
+/* Map sources lists and n_idle_sources */
+G_LOCK_DEFINE_STATIC(map_sources);
+static int n_idle_sources = 0;
+
+/* The decoded maps */
+G_LOCK_DEFINE_STATIC(mapset_cache);
+
 static void  proj_hack() {
 	if(access("/usr/lib/libproj.so", R_OK|X_OK) &&	!access("/usr/lib/libproj.so.0", R_OK|X_OK)) {
 		setenv("PROJSO", "/usr/lib/libproj.so.0", FALSE);
@@ -38,10 +95,9 @@ GDAL_init_drivers() {
 
 #if 1
 static bool
-map_set_bounds(struct Map *map, struct MapTargetdata *data, const struct RenderTarget *target, OGRCoordinateTransformationH xform,
-				bool *first, double map_x, double map_y) {
+map_to_target(const struct Map *map, const struct RenderTarget *target, OGRCoordinateTransformationH xform,
+				double map_x, double map_y, double *screen_x, double *screen_y) {
 	double geo_x, geo_y;
-	double screen_x, screen_y;
 
 	pixel_to_geo_xy(map->GeoTransform, map_x, map_y, &geo_x, &geo_y);
 
@@ -50,7 +106,15 @@ map_set_bounds(struct Map *map, struct MapTargetdata *data, const struct RenderT
 		return FALSE;
 	}
 
-	if(!geo_to_pixel_xy(target->GeoTransform, geo_x, geo_y, &screen_x, &screen_y))
+	return geo_to_pixel_xy(target->GeoTransform, geo_x, geo_y, screen_x, screen_y);
+}
+
+static bool
+map_set_bounds(struct Map *map, struct MapTargetdata *data, const struct RenderTarget *target, OGRCoordinateTransformationH xform,
+				bool *first, double map_x, double map_y) {
+	double screen_x, screen_y;
+
+	if(!map_to_target(map, target, xform, map_x, map_y, &screen_x, &screen_y))
 	 	return FALSE;
 
 	if(*first) {
@@ -71,25 +135,239 @@ map_set_bounds(struct Map *map, struct MapTargetdata *data, const struct RenderT
 	return TRUE;
 }
 
+/*
+ * Crop polygons. The crop polygon of a map, or its Rect if it has none,
+ * is transformed to target pixels once with the target data. Edges are
+ * split where the projections bend them by more than OUTLINE_ERROR.
+ * Render areas and mesh blocks are compared to it: those outside are not
+ * drawn at all, those inside without checking every pixel.
+ */
+#define OUTLINE_ERROR	0.5	/* target pixels */
+#define OUTLINE_DEPTH	8	/* splits of an edge, 256 parts at most */
+
+enum Outline {
+	OUTLINE_OUTSIDE,
+	OUTLINE_INSIDE,
+	OUTLINE_PARTIAL,
+};
+
+/* The polygon that is drawn of map, n points in map pixels */
+static const struct MapPoint *
+map_crop(const struct Map *map, struct MapPoint *rect, int *n) {
+	if(map->CropPoints >= 3) {
+		*n = map->CropPoints;
+		return map->Crop;
+	}
+	rect[0].X = map->Rect.x;
+	rect[0].Y = map->Rect.y;
+	rect[1].X = map->Rect.x + map->Rect.w;
+	rect[1].Y = map->Rect.y;
+	rect[2].X = map->Rect.x + map->Rect.w;
+	rect[2].Y = map->Rect.y + map->Rect.h;
+	rect[3].X = map->Rect.x;
+	rect[3].Y = map->Rect.y + map->Rect.h;
+	*n = 4;
+	return rect;
+}
+
+/* Add the edge from a (at ta on the target) to b, without b */
+static bool
+outline_add_edge(GArray *outline, const struct Map *map, const struct RenderTarget *target,
+	OGRCoordinateTransformationH xform, double ax, double ay, double tax, double tay,
+	double bx, double by, double tbx, double tby, int depth) {
+	double mx = (ax + bx) / 2, my = (ay + by) / 2;
+	double tmx, tmy;
+
+	/* Same projection, the edge stays straight */
+	if(xform == NULL || depth >= OUTLINE_DEPTH) {
+		g_array_append_val(outline, tax);
+		g_array_append_val(outline, tay);
+		return TRUE;
+	}
+	if(!map_to_target(map, target, xform, mx, my, &tmx, &tmy))
+		return FALSE;
+	if(hypot(tmx - (tax + tbx) / 2, tmy - (tay + tby) / 2) <= OUTLINE_ERROR) {
+		g_array_append_val(outline, tax);
+		g_array_append_val(outline, tay);
+		return TRUE;
+	}
+	return outline_add_edge(outline, map, target, xform, ax, ay, tax, tay, mx, my, tmx, tmy, depth+1) &&
+		outline_add_edge(outline, map, target, xform, mx, my, tmx, tmy, bx, by, tbx, tby, depth+1);
+}
+
+/* The outline of map on the target, none if it cannot be transformed */
+static void
+map_set_outline(struct Map *map, struct MapTargetdata *data, const struct RenderTarget *target,
+	OGRCoordinateTransformationH xform) {
+	struct MapPoint rect[4];
+	const struct MapPoint *crop;
+	GArray *outline;
+	double tx0, ty0, tax, tay, tbx, tby;
+	bool ok;
+	int i, n;
+
+	crop = map_crop(map, rect, &n);
+	outline = g_array_new(FALSE, FALSE, sizeof(double));
+	ok = map_to_target(map, target, xform, crop[0].X, crop[0].Y, &tx0, &ty0);
+	tax = tx0;
+	tay = ty0;
+	for(i = 0; ok && i < n; i++) {
+		const struct MapPoint *a = &crop[i], *b = &crop[(i+1) % n];
+
+		if(i+1 < n)
+			ok = map_to_target(map, target, xform, b->X, b->Y, &tbx, &tby);
+		else {
+			tbx = tx0;
+			tby = ty0;
+		}
+		ok = ok && outline_add_edge(outline, map, target, xform, a->X, a->Y, tax, tay, b->X, b->Y, tbx, tby, 0);
+		tax = tbx;
+		tay = tby;
+	}
+	if(!ok) {
+		g_array_free(outline, TRUE);
+		return;
+	}
+
+	data->n_outline = outline->len / 2;
+	data->outline = (double *)g_array_free(outline, FALSE);
+
+	/* Nothing outside of it is drawn */
+	for(i = 0; i < data->n_outline; i++) {
+		double x = data->outline[2*i], y = data->outline[2*i+1];
+		if(i == 0) {
+			tax = tbx = x;
+			tay = tby = y;
+		}
+		tax = MIN(tax, x);
+		tay = MIN(tay, y);
+		tbx = MAX(tbx, x);
+		tby = MAX(tby, y);
+	}
+	data->Bounds.left = MAX(data->Bounds.left, (int)floor(tax));
+	data->Bounds.top = MAX(data->Bounds.top, (int)floor(tay));
+	data->Bounds.right = MIN(data->Bounds.right, (int)ceil(tbx));
+	data->Bounds.bottom = MIN(data->Bounds.bottom, (int)ceil(tby));
+	if(data->Bounds.left > data->Bounds.right || data->Bounds.top > data->Bounds.bottom)
+		data->visible = FALSE;
+}
+
+/* Whether the segment a-b crosses the rectangle, Liang-Barsky */
+static bool
+segment_in_rect(double ax, double ay, double bx, double by, double x0, double y0, double x1, double y1) {
+	double p[4], q[4];
+	double t0 = 0, t1 = 1;
+	int k;
+
+	p[0] = ax - bx; q[0] = ax - x0;
+	p[1] = bx - ax; q[1] = x1 - ax;
+	p[2] = ay - by; q[2] = ay - y0;
+	p[3] = by - ay; q[3] = y1 - ay;
+	for(k = 0; k < 4; k++) {
+		if(p[k] == 0) {
+			if(q[k] < 0)
+				return FALSE;
+		}
+		else if(p[k] < 0)
+			t0 = MAX(t0, q[k] / p[k]);
+		else
+			t1 = MIN(t1, q[k] / p[k]);
+	}
+	return t0 <= t1;
+}
+
+/* Even-odd */
+static bool
+outline_contains(const struct MapTargetdata *data, double x, double y) {
+	const double *o = data->outline;
+	bool in = FALSE;
+	int i, j;
+
+	for(i = 0, j = data->n_outline - 1; i < data->n_outline; j = i++) {
+		if((o[2*i+1] > y) != (o[2*j+1] > y) &&
+		   x < o[2*j] + (y - o[2*j+1]) * (o[2*i] - o[2*j]) / (o[2*i+1] - o[2*j+1]))
+			in = !in;
+	}
+	return in;
+}
+
+/* Where the target area at x, y is relative to the outline */
+static enum Outline
+outline_classify(const struct MapTargetdata *data, int x, int y, int w, int h) {
+	const double *o = data->outline;
+	int i, j;
+
+	if(!data->visible || data->Bounds.left >= x + w || data->Bounds.right < x ||
+	   data->Bounds.top >= y + h || data->Bounds.bottom < y)
+		return OUTLINE_OUTSIDE;
+	if(data->outline == NULL)
+		return OUTLINE_PARTIAL;
+
+	for(i = 0, j = data->n_outline - 1; i < data->n_outline; j = i++) {
+		if(segment_in_rect(o[2*j], o[2*j+1], o[2*i], o[2*i+1], x, y, x + w, y + h))
+			return OUTLINE_PARTIAL;
+	}
+	/* No edge in it: all in or all out */
+	return outline_contains(data, x + w / 2.0, y + h / 2.0) ? OUTLINE_INSIDE : OUTLINE_OUTSIDE;
+}
+
+static int
+compare_doubles(const void *a, const void *b) {
+	double d = *(const double *)a - *(const double *)b;
+	return (d < 0) ? -1 : (d > 0);
+}
+
+/*
+ * The pixels of row y that are in the outline, as spans [x0, x1) in
+ * xs, sorted; their number times 2
+ */
+static int
+outline_row(const struct MapTargetdata *data, int y, int *xs) {
+	const double *o = data->outline;
+	double yc = y + 0.5;
+	double cross[data->n_outline];
+	int i, j, n;
+
+	for(i = 0, j = data->n_outline - 1, n = 0; i < data->n_outline; j = i++) {
+		if((o[2*i+1] > yc) != (o[2*j+1] > yc))
+			cross[n++] = o[2*j] + (yc - o[2*j+1]) * (o[2*i] - o[2*j]) / (o[2*i+1] - o[2*j+1]);
+	}
+	qsort(cross, n, sizeof(double), compare_doubles);
+	/* pixel centers in the span */
+	for(i = 0; i < n; i++)
+		xs[i] = (int)ceil(cross[i] - 0.5);
+	return n & ~1;
+}
+
+static void mapset_free_target_data(struct Layer *layer, const struct RenderTarget *target);
+static void decode_listen(const struct Layer *layer, const struct RenderTarget *target);
+
 static void
 mapset_calc_target_data(struct Layer *layer, const struct RenderTarget *target) {
 	struct MapSet *mapset = (struct MapSet *)layer->data;
 	OGRSpatialReferenceH osrsSrc, osrsDst;
 	OGRCoordinateTransformationH xform = NULL;
+	struct MapsetTargetdata *priv;
 	struct MapTargetdata *data;
 	int i;
 
+	/* Old meshes are for another scale or projection */
+	mapset_free_target_data(layer, target);
+	decode_listen(layer, target);
+	priv = (struct MapsetTargetdata *)gmap_malloc0(sizeof(struct MapsetTargetdata));
+	priv->maps = (struct MapTargetdata *)gmap_malloc0(mapset->count * sizeof(struct MapTargetdata));
+	layer->priv = priv;
+	data = priv->maps;
+
 	if(mapset->WKT != NULL && target->WKT != NULL) {
 		osrsSrc = OSRNewSpatialReference(mapset->WKT);
 		osrsDst = OSRNewSpatialReference(target->WKT);
 		xform = OCTNewCoordinateTransformation(osrsSrc, osrsDst);
+		priv->to_mapset = OCTNewCoordinateTransformation(osrsDst, osrsSrc);
 		OSRDestroySpatialReference(osrsDst);
 		OSRDestroySpatialReference(osrsSrc);
 	}
 
-	layer->priv = gmap_realloc(layer->priv, mapset->count * sizeof(struct MapTargetdata)); 
-	data = (struct MapTargetdata *)layer->priv;
-
 	for(i = 0; i < mapset->count; i++) {
 		struct Map *map = &mapset->maps[i];
 		bool b;
@@ -123,6 +401,9 @@ mapset_calc_target_data(struct Layer *layer, const struct RenderTarget *target)
 					g_random_double_range(map->Rect.y, map->Rect.y+map->Rect.h));
 			}
 		}
+
+		if(data[i].visible)
+			map_set_outline(map, &data[i], target, xform);
 	}
 
 	if(xform != NULL)
@@ -191,51 +472,8 @@ target_set_projection_and_scale_from_mapset(struct MapSet *mapset, struct Render
 	target_set_scale(target, mapset->preferred_scale);;
 }
 
-/* Call after changing the WKT for a mapview. This will set-up
-a translator from the new CS to WGS84, and also set/clear
-a flag telling is the coordinates should be shown in
-degrees or not. */
-void
-mapview_changed_projection(struct MapView *mapview) {
-	OGRSpatialReferenceH osrsSrc, osrsDst;
-	/* The parameter that are calculated here are used when displaying coordinated on the
-	   statusbar (updated by mouse_move */
-	if(mapview->towgs84)
-		OCTDestroyCoordinateTransformation((OGRCoordinateTransformationH)(mapview->towgs84));
-
-	mapview->towgs84 = NULL;
-	mapview->geographic_ref = FALSE;
-
-	if(mapview->rt.WKT != NULL) {
-		osrsSrc = OSRNewSpatialReference(mapview->rt.WKT);
-		mapview->geographic_ref = OSRIsGeographic(osrsSrc);
-		osrsDst = OSRNewSpatialReference(NULL);
-		OSRSetWellKnownGeogCS(osrsDst, "WGS84");
-		mapview->towgs84 = (void *)OCTNewCoordinateTransformation(osrsSrc, osrsDst);
-		OSRDestroySpatialReference(osrsDst);
-		OSRDestroySpatialReference(osrsSrc);
-	}
-}
-
-/* XXX set mapview parameters from this mapset */
-void
-mapview_set_projection_and_scale_from_mapset(struct MapSet *mapset, struct MapView *mapview) {
-
-	/* first set the target */
-	target_set_projection_and_scale_from_mapset(mapset, &mapview->rt);
-
-	gtk_layout_set_size(GTK_LAYOUT(mapview->layout), mapview->rt.width, mapview->rt.height);
-
-	/* reset to this scale value when hitting '=' */
-	mapview->preferred_scale = mapview->rt.scale;
-
-	mapview_changed_projection(mapview);
-}
-
-void
-map_cache(struct Map *map) {
-	GError *err = NULL;
-
+static void
+map_set_fullpath(struct Map *map) {
 	if(!map->fullpath) {
 		if(g_path_is_absolute(map->filename)) {
 			map->fullpath = gmap_strdup(map->filename);
@@ -244,6 +482,13 @@ map_cache(struct Map *map) {
 			map->fullpath = g_build_filename(map->mapset->basedir, map->filename, NULL);
 		}
 	}
+}
+
+void
+map_cache(struct Map *map) {
+	GError *err = NULL;
+
+	map_set_fullpath(map);
 
 	// Open input file
 	if(!map->cached) {
@@ -256,64 +501,301 @@ map_cache(struct Map *map) {
 	}
 }
 
+static void
+close_source(struct MapSource *src) {
+	GDALClose(src->ds);
+	gmap_free(src);
+}
+
+/* An idle source of the map, or a new one. NULL if GDAL can not read it */
+static struct MapSource *
+map_get_source(struct Map *map) {
+	struct MapSource *src = NULL;
+
+	G_LOCK(map_sources);
+	if(map->sources != NULL) {
+		src = (struct MapSource *)map->sources->data;
+		map->sources = g_slist_delete_link(map->sources, map->sources);
+		n_idle_sources--;
+	}
+	G_UNLOCK(map_sources);
+
+	/* Calibration may have changed the map since */
+	if(src != NULL && (src->pixbuf != map->cached ||
+	   src->x != map->Rect.x || src->y != map->Rect.y || src->w != map->Rect.w || src->h != map->Rect.h ||
+	   memcmp(src->GeoTransform, map->GeoTransform, sizeof(src->GeoTransform)) != 0)) {
+		close_source(src);
+		src = NULL;
+	}
+
+	if(src == NULL) {
+		double GeoTransform[6];
+		GDALDatasetH ds;
+
+		ds = GDALOpenPixbuf2(map->cached, GA_ReadOnly,
+			map->Rect.x, map->Rect.y, map->Rect.w, map->Rect.h);
+		if(ds == NULL)
+			return NULL;
+
+		GeoTransform[0] = map->GeoTransform[0] + map->Rect.x * map->GeoTransform[1] + map->Rect.y * map->GeoTransform[2];
+		GeoTransform[1] = map->GeoTransform[1];
+		GeoTransform[2] = map->GeoTransform[2];
+		GeoTransform[3] = map->GeoTransform[3] + map->Rect.x * map->GeoTransform[4] + map->Rect.y * map->GeoTransform[5];
+		GeoTransform[4] = map->GeoTransform[4];
+		GeoTransform[5] = map->GeoTransform[5];
+
+		GDALSetProjection(ds, map->mapset->WKT);
+		GDALSetGeoTransform(ds, GeoTransform);
+
+		src = (struct MapSource *)gmap_malloc(sizeof(struct MapSource));
+		src->ds = ds;
+		src->unity = is_unity_geotransform(GeoTransform);
+		src->pixbuf = map->cached;
+		src->x = map->Rect.x;
+		src->y = map->Rect.y;
+		src->w = map->Rect.w;
+		src->h = map->Rect.h;
+		memcpy(src->GeoTransform, map->GeoTransform, sizeof(src->GeoTransform));
+	}
+	return src;
+}
+
+/* The warp is done with src, keep it for the next one */
+static void
+map_put_source(struct Map *map, struct MapSource *src) {
+	G_LOCK(map_sources);
+	if(n_idle_sources < MAP_SOURCES_IDLE) {
+		map->sources = g_slist_prepend(map->sources, src);
+		n_idle_sources++;
+		src = NULL;
+	}
+	G_UNLOCK(map_sources);
+
+	if(src != NULL)
+		close_source(src);
+}
+
+/* Nothing may render the map meanwhile */
 void
 map_uncache(struct Map *map) {
-	if(map->cachedDS) {
-		GDALClose(map->cachedDS);
-		map->cachedDS = NULL;
-		map->cachedDSNULL = NULL;
+	GSList *l;
+
+	G_LOCK(map_sources);
+	for(l = map->sources; l != NULL; l = l->next) {
+		close_source((struct MapSource *)l->data);
+		n_idle_sources--;
 	}
+	g_slist_free(map->sources);
+	map->sources = NULL;
+	G_UNLOCK(map_sources);
+
 	if(map->cached) {
 		g_object_unref(map->cached);
 		map->cached = NULL;
 	}
 }
 
+/*
+ * Background caching. Targets that have a layer_changed callback are
+ * not kept waiting for maps to decode: their render skips the maps that
+ * are not cached yet and queues them to the decode pool, and the layer
+ * is invalidated where each map lands when it is done. Other targets
+ * (files, print) decode in the render as before.
+ */
+struct DecodeJob {
+	struct MapSet	*mapset;
+	int		map;		/* maps may move, the index does not */
+};
+
+/* Mapset layers of targets to tell, main thread only */
+struct DecodeListener {
+	struct RenderTarget *target;
+	int		layer;
+};
+
+static GThreadPool *decode_pool = NULL;
+static GSList *decode_listeners = NULL;
+
+static void
+decode_listen(const struct Layer *layer, const struct RenderTarget *target) {
+	struct DecodeListener *l;
+
+	if(target->layer_changed == NULL)
+		return;
+	l = (struct DecodeListener *)gmap_malloc(sizeof(struct DecodeListener));
+	l->target = (struct RenderTarget *)target;
+	l->layer = layer - target->layers;
+	decode_listeners = g_slist_prepend(decode_listeners, l);
+}
+
+static void
+decode_unlisten(const struct Layer *layer, const struct RenderTarget *target) {
+	GSList *l;
+
+	for(l = decode_listeners; l != NULL; l = l->next) {
+		struct DecodeListener *dl = (struct DecodeListener *)l->data;
+		if(dl->target == target && dl->layer == layer - target->layers) {
+			gmap_free(dl);
+			decode_listeners = g_slist_delete_link(decode_listeners, l);
+			return;
+		}
+	}
+}
+
+/* Main thread: the map is cached, or failed. Render where it is */
+static gboolean
+decode_done(gpointer data) {
+	struct DecodeJob *job = (struct DecodeJob *)data;
+	GSList *l;
+
+	for(l = decode_listeners; l != NULL; l = l->next) {
+		struct DecodeListener *dl = (struct DecodeListener *)l->data;
+		struct Layer *layer = &dl->target->layers[dl->layer];
+		struct MapsetTargetdata *priv = (struct MapsetTargetdata *)layer->priv;
+		struct MapTargetdata *md;
+
+		if(layer->data != job->mapset || priv == NULL || job->map >= job->mapset->count)
+			continue;
+		md = &priv->maps[job->map];
+		if(md->visible)
+			layer_invalidate(dl->target, layer, md->Bounds.left, md->Bounds.top,
+				md->Bounds.right - md->Bounds.left + 1, md->Bounds.bottom - md->Bounds.top + 1);
+	}
+	gmap_free(job);
+	return FALSE;
+}
+
+static void
+decode_map(gpointer data, gpointer user_data) {
+	struct DecodeJob *job = (struct DecodeJob *)data;
+	struct MapSet *mapset = job->mapset;
+	struct Map *map;
+	GdkPixbuf *pixbuf;
+	GError *err = NULL;
+	char *path;
+
+	G_LOCK(mapset_cache);
+	map = &mapset->maps[job->map];
+	map_set_fullpath(map);
+	path = gmap_strdup(map->fullpath);
+	G_UNLOCK(mapset_cache);
+
+	TRACE_BEGIN("decode", path);
+	pixbuf = gdk_pixbuf_new_from_file(path, &err);
+	TRACE_END("decode");
+	g_message("caching of \"%s\" %s", path, pixbuf ? "success" : err->message);
+	if(err != NULL)
+		g_error_free(err);
+
+	G_LOCK(mapset_cache);
+	map = &mapset->maps[job->map];
+	map->decoding = FALSE;
+	if(pixbuf == NULL)
+		map->visible = FALSE;
+	else if(map->cached == NULL && map->fullpath != NULL && !strcmp(map->fullpath, path)) {
+		map->cached = pixbuf;
+		pixbuf = NULL;
+	}
+	/* progress restarts when all that was asked for is done */
+	if(++mapset->n_decoded >= mapset->n_queued)
+		mapset->n_decoded = mapset->n_queued = 0;
+	G_UNLOCK(mapset_cache);
+
+	if(pixbuf != NULL)
+		g_object_unref(pixbuf);
+	gmap_free(path);
+	g_idle_add(decode_done, job);
+}
+
+/*
+ * Whether map i can be drawn now. If the target does not wait for it,
+ * it is queued to be cached and FALSE is returned.
+ */
+static bool
+map_ready(struct MapSet *mapset, int i, const struct RenderTarget *target) {
+	struct Map *map = &mapset->maps[i];
+	struct DecodeJob *job;
+	bool ready;
+
+	if(target->layer_changed == NULL)
+		return TRUE;
+
+	G_LOCK(mapset_cache);
+	ready = (map->cached != NULL);
+	if(!ready && map->visible && !map->decoding) {
+		if(decode_pool == NULL)
+			decode_pool = g_thread_pool_new(decode_map, NULL, g_get_num_processors(), FALSE, NULL);
+		map->decoding = TRUE;
+		mapset->n_queued++;
+		job = (struct DecodeJob *)gmap_malloc(sizeof(struct DecodeJob));
+		job->mapset = mapset;
+		job->map = i;
+		g_thread_pool_push(decode_pool, job, NULL);
+	}
+	G_UNLOCK(mapset_cache);
+	return ready;
+}
+
+/* Maps queued to be cached in the background: FALSE if there are none */
+bool
+mapset_loading(struct MapSet *mapset, int *done, int *total) {
+	G_LOCK(mapset_cache);
+	*done = mapset->n_decoded;
+	*total = mapset->n_queued;
+	G_UNLOCK(mapset_cache);
+	return *total > 0;
+}
+
 static int
 myProgressFunc(double dfComplete, const char *pszMessage, void *pProgressArg) {
 	return TRUE; 	/* indicating process should continue */
 }
 
+/* Crop polygon of the map in pixels of src, NULL if it is src's Rect */
+static OGRGeometryH
+map_cutline(const struct Map *map, const struct MapSource *src) {
+	OGRGeometryH poly, ring;
+	int i;
+
+	if(map->CropPoints < 3)
+		return NULL;
+	if(map->CropPoints == 4 &&
+	   map->Crop[0].X == src->x && map->Crop[0].Y == src->y &&
+	   map->Crop[1].X == src->x + src->w && map->Crop[1].Y == src->y &&
+	   map->Crop[2].X == src->x + src->w && map->Crop[2].Y == src->y + src->h &&
+	   map->Crop[3].X == src->x && map->Crop[3].Y == src->y + src->h)
+		return NULL;
+
+	ring = OGR_G_CreateGeometry(wkbLinearRing);
+	for(i = 0; i <= map->CropPoints; i++) {
+		const struct MapPoint *p = &map->Crop[i % map->CropPoints];
+		OGR_G_AddPoint_2D(ring, p->X - src->x, p->Y - src->y);
+	}
+	poly = OGR_G_CreateGeometry(wkbPolygon);
+	OGR_G_AddGeometryDirectly(poly, ring);
+	return poly;
+}
+
 static int
-open_merge_map(struct Map *map, GDALDatasetH hDstDS) {
+open_merge_map(struct Map *map, GDALDatasetH hDstDS, double max_error) {
 	GDALDatasetH  hSrcDS;
 	GDALDatasetH  hSrcDSNULL;
+	struct MapSource *src;
 	GDALWarpOptions *psWarpOptions;
 	GDALWarpOperationH oOperation;
 
+	G_LOCK(mapset_cache);
+	TRACE_BEGIN("decode", map->filename);
 	map_cache(map);
+	TRACE_END("decode");
+	src = (map->cached != NULL) ? map_get_source(map) : NULL;
+	G_UNLOCK(mapset_cache);
 
-	if(map->cached == NULL)
+	if(src == NULL)
 		return 1;	/* XXX Error.. must emit a message in map_cache */
 
-	if(map->cachedDS != NULL) {
-		hSrcDS = (GDALDatasetH)map->cachedDS;
-		hSrcDSNULL = (GDALDatasetH)map->cachedDSNULL;
-	}
-	else {
-		double GeoTransform[6];
-		hSrcDS = GDALOpenPixbuf2(map->cached, GA_ReadOnly,
-			map->Rect.x, map->Rect.y, map->Rect.w, map->Rect.h);
-
-		GeoTransform[0] = map->GeoTransform[0] + map->Rect.x * map->GeoTransform[1] + map->Rect.y * map->GeoTransform[2];
-		GeoTransform[1] = map->GeoTransform[1];
-		GeoTransform[2] = map->GeoTransform[2];
-		GeoTransform[3] = map->GeoTransform[3] + map->Rect.x * map->GeoTransform[4] + map->Rect.y * map->GeoTransform[5];
-		GeoTransform[4] = map->GeoTransform[4];
-		GeoTransform[5] = map->GeoTransform[5];
-
-		GDALSetProjection(hSrcDS, map->mapset->WKT);
-		GDALSetGeoTransform(hSrcDS, GeoTransform);
-
-		hSrcDSNULL = hSrcDS;
-		map->cachedDS = hSrcDS;
-		map->cachedDSNULL = hSrcDS;
-
-		if(is_unity_geotransform(GeoTransform)) {
-			hSrcDSNULL = NULL;
-			map->cachedDSNULL = NULL;
-		}
-	}
+	hSrcDS = src->ds;
+	hSrcDSNULL = src->unity ? NULL : src->ds;
 
 	/* Setup warp options.  */
 	psWarpOptions = GDALCreateWarpOptions();
@@ -330,49 +812,514 @@ open_merge_map(struct Map *map, GDALDatasetH hDstDS) {
 
 	psWarpOptions->pfnProgress = (GDALProgressFunc)myProgressFunc; /* was GDALTermProgress;   */
 
+	/* Only what is in the crop polygon, the collar is left to the
+	   neighbours. Freed with the options */
+	psWarpOptions->hCutline = map_cutline(map, src);
+
 	/* Establish reprojection transformer.  */
+	TRACE_BEGIN("create_transformer", NULL);
 	psWarpOptions->pTransformerArg = 
 		GDALCreateGenImgProjTransformer( hSrcDSNULL, GDALGetProjectionRef(hSrcDS), 
 						 hDstDS, GDALGetProjectionRef(hDstDS), 
 						 FALSE, 0.0, 1 );
 	psWarpOptions->pfnTransformer = GDALGenImgProjTransform;
 
+	/* Transform exactly only some points along each line and interpolate
+	   between them, subdividing until within max_error pixels */
+	if(max_error > 0) {
+		psWarpOptions->pTransformerArg =
+			GDALCreateApproxTransformer(GDALGenImgProjTransform,
+						    psWarpOptions->pTransformerArg, max_error);
+		GDALApproxTransformerOwnsSubtransformer(psWarpOptions->pTransformerArg, TRUE);
+		psWarpOptions->pfnTransformer = GDALApproxTransform;
+	}
+	TRACE_END("create_transformer");
+
 	/* Initialize and execute the warp operation. */
 	oOperation = GDALCreateWarpOperation(psWarpOptions);;
 
-	if(oOperation == NULL)
+	if(oOperation == NULL) {
+		map_put_source(map, src);
 		return 1;	/* XXX error! That should not happen! */
+	}
 
+	TRACE_BEGIN("warp", map->filename);
 	GDALChunkAndWarpImage(oOperation, 0, 0,
 				  GDALGetRasterXSize( hDstDS ), 
 				  GDALGetRasterYSize( hDstDS ) );
+	TRACE_END("warp");
 
 	GDALDestroyWarpOperation(oOperation);
 
-	GDALDestroyGenImgProjTransformer(psWarpOptions->pTransformerArg);
+	if(max_error > 0)
+		GDALDestroyApproxTransformer(psWarpOptions->pTransformerArg);
+	else
+		GDALDestroyGenImgProjTransformer(psWarpOptions->pTransformerArg);
 	GDALDestroyWarpOptions( psWarpOptions );
+	map_put_source(map, src);
 
 	return 0;
 }
 
+/* Union of the bounds of the visible maps in target pixels, FALSE if none */
+bool
+mapset_target_bounds(const struct Layer *layer, int *left, int *top, int *right, int *bottom) {
+	struct MapSet *mapset = (struct MapSet *)layer->data;
+	struct MapsetTargetdata *priv = (struct MapsetTargetdata *)layer->priv;
+	struct MapTargetdata *data;
+	bool found = FALSE;
+	int i;
+
+	if(priv == NULL)
+		return FALSE;
+	data = priv->maps;
+	for(i = 0; i < mapset->count; i++) {
+		if(!mapset->maps[i].visible || !data[i].visible)
+			continue;
+		if(!found) {
+			*left = data[i].Bounds.left;
+			*top = data[i].Bounds.top;
+			*right = data[i].Bounds.right;
+			*bottom = data[i].Bounds.bottom;
+			found = TRUE;
+		}
+		else {
+			*left = MIN(*left, data[i].Bounds.left);
+			*top = MIN(*top, data[i].Bounds.top);
+			*right = MAX(*right, data[i].Bounds.right);
+			*bottom = MAX(*bottom, data[i].Bounds.bottom);
+		}
+	}
+	return found;
+}
+
+/* TRUE if no map falls in the target area, rendering it draws nothing */
+bool
+mapset_area_is_empty(const struct Layer *layer, int x, int y, int w, int h) {
+	struct MapSet *mapset = (struct MapSet *)layer->data;
+	struct MapsetTargetdata *priv = (struct MapsetTargetdata *)layer->priv;
+	int i;
+
+	for(i = 0; priv != NULL && i < mapset->count; i++) {
+		if(mapset->maps[i].visible && outline_classify(&priv->maps[i], x, y, w, h) != OUTLINE_OUTSIDE)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static struct Mesh *
+compute_mesh(const struct Map *map, const struct RenderTarget *target,
+	OGRCoordinateTransformationH to_mapset, int bx, int by) {
+	struct Mesh *mesh = (struct Mesh *)gmap_malloc(sizeof(struct Mesh));
+	/* the mesh points, then the centers of the cells to check the error */
+	int n = MESH_N * MESH_N + (MESH_N-1) * (MESH_N-1);
+	double x[n], y[n];
+	int ok[n];
+	int i, j, k;
+
+	for(j = 0, k = 0; j < MESH_N; j++) {
+		for(i = 0; i < MESH_N; i++, k++)
+			pixel_to_geo_xy(target->GeoTransform, bx + i * MESH_STEP + 0.5, by + j * MESH_STEP + 0.5, &x[k], &y[k]);
+	}
+	for(j = 0; j < MESH_N-1; j++) {
+		for(i = 0; i < MESH_N-1; i++, k++)
+			pixel_to_geo_xy(target->GeoTransform, bx + (i+0.5) * MESH_STEP + 0.5, by + (j+0.5) * MESH_STEP + 0.5, &x[k], &y[k]);
+	}
+
+	for(k = 0; k < n; k++)
+		ok[k] = TRUE;
+	if(to_mapset != NULL) {
+		G_LOCK(mapset_transform);
+		OCTTransformEx(to_mapset, n, x, y, NULL, ok);
+		G_UNLOCK(mapset_transform);
+	}
+
+	mesh->usable = TRUE;
+	for(k = 0; k < n; k++) {
+		if(!ok[k] || !geo_to_pixel_xy(map->GeoTransform, x[k], y[k], &x[k], &y[k]))
+			mesh->usable = FALSE;
+	}
+	if(!mesh->usable)
+		return mesh;
+
+	for(k = 0; k < MESH_N * MESH_N; k++) {
+		mesh->sx[k] = x[k];
+		mesh->sy[k] = y[k];
+	}
+
+	/* Error at the center of each cell */
+	mesh->max_error = 0;
+	for(j = 0; j < MESH_N-1; j++) {
+		for(i = 0; i < MESH_N-1; i++, k++) {
+			int c = j * MESH_N + i;
+			double ix = (mesh->sx[c] + mesh->sx[c+1] + mesh->sx[c+MESH_N] + mesh->sx[c+MESH_N+1]) / 4;
+			double iy = (mesh->sy[c] + mesh->sy[c+1] + mesh->sy[c+MESH_N] + mesh->sy[c+MESH_N+1]) / 4;
+			mesh->max_error = MAX(mesh->max_error, hypot(ix - x[k], iy - y[k]));
+		}
+	}
+	return mesh;
+}
+
+/*
+ * The mesh of map i for the block at bx, by, computed if not cached.
+ * It is computed without the lock; if another thread put the same block
+ * in the table meanwhile, that one is used and ours is dropped.
+ */
+static struct Mesh *
+get_mesh(const struct Layer *layer, int i, const struct RenderTarget *target, int bx, int by, bool *cached) {
+	struct MapSet *mapset = (struct MapSet *)layer->data;
+	struct MapsetTargetdata *priv = (struct MapsetTargetdata *)layer->priv;
+	struct MapTargetdata *data = &priv->maps[i];
+	gint64 key = ((gint64)by << 32) | (guint32)bx;
+	struct Mesh *mesh, *other;
+
+	G_LOCK(mapset_mesh);
+	if(data->meshes == NULL)
+		data->meshes = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, g_free);
+	mesh = (struct Mesh *)g_hash_table_lookup(data->meshes, &key);
+	G_UNLOCK(mapset_mesh);
+	if(mesh != NULL)
+		return mesh;
+
+	TRACE_BEGIN("compute_mesh", mapset->maps[i].filename);
+	mesh = compute_mesh(&mapset->maps[i], target, priv->to_mapset, bx, by);
+	TRACE_END("compute_mesh");
+
+	G_LOCK(mapset_mesh);
+	other = (struct Mesh *)g_hash_table_lookup(data->meshes, &key);
+	if(other != NULL) {
+		gmap_free(mesh);
+		mesh = other;
+	}
+	/* Meshes are only freed with the target data, as other
+	   threads may use them. Past the limit they are not kept */
+	else if(priv->n_meshes < MESH_MAX) {
+		g_hash_table_insert(data->meshes, g_memdup(&key, sizeof(key)), mesh);
+		priv->n_meshes++;
+	}
+	else
+		*cached = FALSE;
+	G_UNLOCK(mapset_mesh);
+	return mesh;
+}
+
+/*
+ * Occlusion in a render area. The area is cut in cells, the same as the
+ * mesh cells; a cell is covered by the first map drawn in the area that
+ * is opaque and has all of the cell in its outline. Maps are looked at
+ * front to back: one whose cells are all covered by maps after it, or
+ * out of its outline, is not drawn at all, and the others skip covered
+ * cells where they go through meshes.
+ */
+#define COVER_CELL	MESH_STEP
+#define COVER_NONE	G_MAXINT
+
+struct Cover {
+	const struct RenderContext *rc;
+	int	cx, cy;			/* first cell, in cells */
+	int	nx, ny;
+	int	n_covered;
+	int	*by;			/* map covering each cell, index in vis */
+};
+
+static void
+cover_init(struct Cover *cover, const struct RenderContext *rc) {
+	int i;
+
+	cover->rc = rc;
+	cover->cx = (int)floor((double)rc->x / COVER_CELL);
+	cover->cy = (int)floor((double)rc->y / COVER_CELL);
+	cover->nx = (int)ceil((double)(rc->x + rc->w) / COVER_CELL) - cover->cx;
+	cover->ny = (int)ceil((double)(rc->y + rc->h) / COVER_CELL) - cover->cy;
+	cover->n_covered = 0;
+	cover->by = (int *)gmap_malloc(cover->nx * cover->ny * sizeof(int));
+	for(i = 0; i < cover->nx * cover->ny; i++)
+		cover->by[i] = COVER_NONE;
+}
+
+/* The cells of the area x, y, w, h in cover, FALSE if none */
+static bool
+cover_cells(const struct Cover *cover, int x, int y, int w, int h, int *i0, int *j0, int *i1, int *j1) {
+	const struct RenderContext *rc = cover->rc;
+	int x0 = MAX(x, rc->x), y0 = MAX(y, rc->y);
+	int x1 = MIN(x + w, rc->x + rc->w), y1 = MIN(y + h, rc->y + rc->h);
+
+	if(x0 >= x1 || y0 >= y1)
+		return FALSE;
+	*i0 = (int)floor((double)x0 / COVER_CELL) - cover->cx;
+	*j0 = (int)floor((double)y0 / COVER_CELL) - cover->cy;
+	*i1 = (int)ceil((double)x1 / COVER_CELL) - cover->cx;
+	*j1 = (int)ceil((double)y1 / COVER_CELL) - cover->cy;
+	return TRUE;
+}
+
+/* Cell i, j clipped to the render area */
+static void
+cover_cell_area(const struct Cover *cover, int i, int j, int *x, int *y, int *w, int *h) {
+	const struct RenderContext *rc = cover->rc;
+
+	*x = MAX((cover->cx + i) * COVER_CELL, rc->x);
+	*y = MAX((cover->cy + j) * COVER_CELL, rc->y);
+	*w = MIN((cover->cx + i + 1) * COVER_CELL, rc->x + rc->w) - *x;
+	*h = MIN((cover->cy + j + 1) * COVER_CELL, rc->y + rc->h) - *y;
+}
+
+/* Whether map k draws nothing in the area x, y, w, h that is not covered by maps after it */
 static bool
-is_visible(struct MapTargetdata *data, int left, int right, int top, int bottom) {
-	if(!data->visible) return FALSE;
-	if(data->Bounds.top > bottom) return FALSE;
-	if(data->Bounds.bottom < top) return FALSE;
-	if(data->Bounds.left > right) return FALSE;
-	if(data->Bounds.right < left) return FALSE;
+cover_hides(const struct Cover *cover, const struct MapTargetdata *data, int k, int x, int y, int w, int h) {
+	int i, j, i0, j0, i1, j1;
+	int cx, cy, cw, ch;
+
+	if(cover->n_covered == 0)
+		return FALSE;
+	if(!cover_cells(cover, x, y, w, h, &i0, &j0, &i1, &j1))
+		return TRUE;
+	for(j = j0; j < j1; j++) {
+		for(i = i0; i < i1; i++) {
+			int by = cover->by[j * cover->nx + i];
+
+			if(by == COVER_NONE || by <= k) {
+				cover_cell_area(cover, i, j, &cx, &cy, &cw, &ch);
+				if(outline_classify(data, cx, cy, cw, ch) != OUTLINE_OUTSIDE)
+					return FALSE;
+			}
+		}
+	}
 	return TRUE;
 }
 
+/* Map k, opaque, covers the cells all in its outline */
+static void
+cover_add(struct Cover *cover, const struct MapTargetdata *data, int k) {
+	int i, j, i0, j0, i1, j1;
+	int cx, cy, cw, ch;
+
+	if(!cover_cells(cover, data->Bounds.left, data->Bounds.top,
+	   data->Bounds.right - data->Bounds.left + 1, data->Bounds.bottom - data->Bounds.top + 1, &i0, &j0, &i1, &j1))
+		return;
+	for(j = j0; j < j1; j++) {
+		for(i = i0; i < i1; i++) {
+			int *by = &cover->by[j * cover->nx + i];
+
+			if(*by != COVER_NONE)
+				continue;
+			cover_cell_area(cover, i, j, &cx, &cy, &cw, &ch);
+			if(outline_classify(data, cx, cy, cw, ch) == OUTLINE_INSIDE) {
+				*by = k;
+				cover->n_covered++;
+			}
+		}
+	}
+}
+
+/* Whether what map k draws at X, Y is drawn over by a later map */
+static inline bool
+cover_covered(const struct Cover *cover, int k, int X, int Y) {
+	int i = (int)floor((double)X / COVER_CELL) - cover->cx;
+	int j = (int)floor((double)Y / COVER_CELL) - cover->cy;
+
+	int by = cover->by[j * cover->nx + i];
+
+	return by != COVER_NONE && by > k;
+}
+
+/*
+ * Resample the block at bx, by clipped to the render area, nearest
+ * neighbour. The map pixel is interpolated along each row from the
+ * edges of the mesh cell, one addition per pixel. If clip is set the
+ * block is not all in the outline, each row is clipped to it. Cells
+ * covered by later maps are skipped.
+ */
+static void
+mesh_resample(const struct Mesh *mesh, const struct Map *map, const struct MapTargetdata *data,
+	bool clip, const struct Cover *cover, int ck, const struct RenderContext *rc,
+	int bx, int by, unsigned char *dst, int stride) {
+	GdkPixbuf *pixbuf = map->cached;
+	const guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
+	int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+	int nch = gdk_pixbuf_get_n_channels(pixbuf);
+	int x0 = MAX(bx, rc->x), x1 = MIN(bx + MESH_BLOCK, rc->x + rc->w);
+	int y0 = MAX(by, rc->y), y1 = MIN(by + MESH_BLOCK, rc->y + rc->h);
+	int spans[clip ? data->n_outline + 2 : 2];
+	int X, Y, ns, k;
+
+	for(Y = y0; Y < y1; Y++) {
+		guint32 *row = (guint32 *)(dst + (Y - rc->y) * stride);
+		int cj = (Y - by) / MESH_STEP;
+		float fy = (float)((Y - by) % MESH_STEP) / MESH_STEP;
+		const float *sx = mesh->sx + cj * MESH_N, *sy = mesh->sy + cj * MESH_N;
+
+		if(clip)
+			ns = outline_row(data, Y, spans);
+		else {
+			spans[0] = x0;
+			spans[1] = x1;
+			ns = 2;
+		}
+
+		for(k = 0; k < ns; k += 2) {
+			int xs = MAX(x0, spans[k]), xe = MIN(x1, spans[k+1]);
+
+			for(X = xs; X < xe; ) {
+				int ci = (X - bx) / MESH_STEP;
+				int end = MIN(xe, bx + (ci+1) * MESH_STEP);
+				/* cell edges at this row */
+				float lx = sx[ci] + (sx[ci+MESH_N] - sx[ci]) * fy;
+				float ly = sy[ci] + (sy[ci+MESH_N] - sy[ci]) * fy;
+				float rx = sx[ci+1] + (sx[ci+MESH_N+1] - sx[ci+1]) * fy;
+				float ry = sy[ci+1] + (sy[ci+MESH_N+1] - sy[ci+1]) * fy;
+				float dx = (rx - lx) / MESH_STEP, dy = (ry - ly) / MESH_STEP;
+				float u = (X - bx) - ci * MESH_STEP;
+				float mx = lx + dx * u, my = ly + dy * u;
+
+				if(cover_covered(cover, ck, X, Y)) {
+					X = end;
+					continue;
+				}
+
+				for(; X < end; X++, mx += dx, my += dy) {
+					int ix = (int)floorf(mx), iy = (int)floorf(my);
+					const guchar *p;
+
+					if(ix < map->Rect.x || iy < map->Rect.y ||
+					   ix >= map->Rect.x + map->Rect.w || iy >= map->Rect.y + map->Rect.h)
+						continue;
+					p = pixels + iy * rowstride + ix * nch;
+					row[X - rc->x] = (p[0] << 16) | (p[1] << 8) | p[2];
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Draw map i, vis[ck] in cover, through its meshes. FALSE if it has to
+ * be warped by GDAL: exact reprojection was asked for, the map is not
+ * plain RGB, or some block cannot be interpolated within the allowed error.
+ */
+static bool
+mesh_render_map(const struct Layer *layer, int i, const struct Cover *cover, int ck,
+	const struct RenderContext *rc) {
+	struct MapSet *mapset = (struct MapSet *)layer->data;
+	struct MapsetTargetdata *priv = (struct MapsetTargetdata *)layer->priv;
+	struct MapTargetdata *data = &priv->maps[i];
+	struct Map *map = &mapset->maps[i];
+	int x0, y0, x1, y1, bx, by, nb, k;
+	struct Mesh **meshes;
+	enum Outline *where;
+	bool *cached;
+	bool ok = TRUE;
+
+	if(rc->rt->warp_error <= 0 || cairo_image_surface_get_format(rc->cs) != CAIRO_FORMAT_RGB24)
+		return FALSE;
+
+	G_LOCK(mapset_cache);
+	TRACE_BEGIN("decode", map->filename);
+	map_cache(map);
+	TRACE_END("decode");
+	G_UNLOCK(mapset_cache);
+	if(map->cached == NULL)
+		return TRUE;	/* nothing to draw */
+	if(gdk_pixbuf_get_bits_per_sample(map->cached) != 8 || gdk_pixbuf_get_n_channels(map->cached) < 3)
+		return FALSE;
+
+	/* Blocks of the area that the map covers */
+	x0 = MAX(rc->x, data->Bounds.left);
+	y0 = MAX(rc->y, data->Bounds.top);
+	x1 = MIN(rc->x + rc->w, data->Bounds.right + 1);
+	y1 = MIN(rc->y + rc->h, data->Bounds.bottom + 1);
+	if(x0 >= x1 || y0 >= y1)
+		return TRUE;
+	x0 = (int)floor((double)x0 / MESH_BLOCK) * MESH_BLOCK;
+	y0 = (int)floor((double)y0 / MESH_BLOCK) * MESH_BLOCK;
+
+	nb = ((x1 - x0 + MESH_BLOCK - 1) / MESH_BLOCK) * ((y1 - y0 + MESH_BLOCK - 1) / MESH_BLOCK);
+	meshes = (struct Mesh **)gmap_malloc(nb * sizeof(struct Mesh *));
+	where = (enum Outline *)gmap_malloc(nb * sizeof(enum Outline));
+	cached = (bool *)gmap_malloc(nb * sizeof(bool));
+
+	/* All blocks must be good before anything is drawn. Those out
+	   of the outline or covered by later maps need no mesh */
+	for(by = y0, k = 0; by < y1; by += MESH_BLOCK) {
+		for(bx = x0; bx < x1; bx += MESH_BLOCK, k++) {
+			int ax = MAX(bx, rc->x), ay = MAX(by, rc->y);
+			int aw = MIN(bx + MESH_BLOCK, rc->x + rc->w) - ax, ah = MIN(by + MESH_BLOCK, rc->y + rc->h) - ay;
+
+			cached[k] = TRUE;
+			meshes[k] = NULL;
+			where[k] = outline_classify(data, ax, ay, aw, ah);
+			if(where[k] != OUTLINE_OUTSIDE && cover_hides(cover, data, ck, ax, ay, aw, ah))
+				where[k] = OUTLINE_OUTSIDE;
+			if(where[k] == OUTLINE_OUTSIDE)
+				continue;
+			meshes[k] = get_mesh(layer, i, rc->rt, bx, by, &cached[k]);
+			if(!meshes[k]->usable || meshes[k]->max_error > rc->rt->warp_error)
+				ok = FALSE;
+		}
+	}
+
+	if(ok) {
+		unsigned char *dst = cairo_image_surface_get_data(rc->cs);
+		int stride = cairo_image_surface_get_stride(rc->cs);
+
+		TRACE_BEGIN("mesh_resample", map->filename);
+		for(by = y0, k = 0; by < y1; by += MESH_BLOCK) {
+			for(bx = x0; bx < x1; bx += MESH_BLOCK, k++) {
+				if(where[k] != OUTLINE_OUTSIDE)
+					mesh_resample(meshes[k], map, data, where[k] == OUTLINE_PARTIAL && data->outline != NULL,
+						cover, ck, rc, bx, by, dst, stride);
+			}
+		}
+		TRACE_END("mesh_resample");
+	}
+
+	for(k = 0; k < nb; k++) {
+		if(!cached[k])
+			gmap_free(meshes[k]);
+	}
+	gmap_free(meshes);
+	gmap_free(where);
+	gmap_free(cached);
+	return ok;
+}
+
+/*
+ * Whether all of map i is drawn over it: the map is cached, or the target
+ * waits for it, it has no alpha and its crop polygon is within its Rect.
+ */
+static bool
+map_opaque(struct MapSet *mapset, int i, const struct RenderTarget *target) {
+	struct Map *map = &mapset->maps[i];
+	bool opaque;
+	int k;
+
+	if(!map_ready(mapset, i, target))
+		return FALSE;
+	for(k = 0; k < map->CropPoints; k++) {
+		if(map->Crop[k].X < map->Rect.x || map->Crop[k].X > map->Rect.x + map->Rect.w ||
+		   map->Crop[k].Y < map->Rect.y || map->Crop[k].Y > map->Rect.y + map->Rect.h)
+			return FALSE;
+	}
+
+	G_LOCK(mapset_cache);
+	TRACE_BEGIN("decode", map->filename);
+	map_cache(map);
+	TRACE_END("decode");
+	opaque = (map->cached != NULL && !gdk_pixbuf_get_has_alpha(map->cached));
+	G_UNLOCK(mapset_cache);
+	return opaque;
+}
+
 static void
 mapset_render_layer(const struct Layer *layer, const struct RenderContext *rc) {
 	struct MapSet *mapset = (struct MapSet *)layer->data;
 	GDALDatasetH  hDstDS;
 	double GeoTransform[6];
 	struct MapTargetdata *data;
-
-	int i;
+	struct Cover cover;
+	bool *hidden;
+	int *vis;
+	int i, k, n;
 
 	cairo_surface_flush(rc->cs);
 
@@ -388,12 +1335,42 @@ mapset_render_layer(const struct Layer *layer, const struct RenderContext *rc) {
 	GDALSetProjection(hDstDS, rc->rt->WKT);
 	GDALSetGeoTransform(hDstDS, GeoTransform);
 
-	data = (struct MapTargetdata *)layer->priv;
+	data = ((struct MapsetTargetdata *)layer->priv)->maps;
 
-	for(i = 0; i < mapset->count; i++) {
+	/* The maps with some of their crop polygon in the area */
+	vis = (int *)gmap_malloc(mapset->count * sizeof(int));
+	for(i = 0, n = 0; i < mapset->count; i++) {
+		if(mapset->maps[i].visible && outline_classify(&data[i], rc->x, rc->y, rc->w, rc->h) != OUTLINE_OUTSIDE)
+			vis[n++] = i;
+	}
+
+	/* Front to back, the maps hidden by those over them. Once all the
+	   area is covered, the rest are */
+	cover_init(&cover, rc);
+	hidden = (bool *)gmap_malloc0(n * sizeof(bool));
+	for(k = n; --k >= 0; ) {
+		struct MapTargetdata *md = &data[vis[k]];
+
+		if(cover.n_covered == cover.nx * cover.ny ||
+		   cover_hides(&cover, md, k, md->Bounds.left, md->Bounds.top,
+				md->Bounds.right - md->Bounds.left + 1, md->Bounds.bottom - md->Bounds.top + 1))
+			hidden[k] = TRUE;
+		else if(map_opaque(mapset, vis[k], rc->rt))
+			cover_add(&cover, md, k);
+	}
+
+	/* and drawn back to front, GDAL only draws over */
+	for(k = 0; k < n && !RENDER_CANCELLED(rc); k++) {
+		i = vis[k];
 		if(!mapset->maps[i].visible)
 			continue;
-		if(is_visible(&data[i], rc->x, rc->x+rc->w, rc->y, rc->y+rc->h)) {
+		if(!hidden[k]) {
+			/* drawn when it is cached */
+			if(!map_ready(mapset, i, rc->rt))
+				continue;
+			RENDER_COUNT_OBJECTS(rc, 1);
+			if(mesh_render_map(layer, i, &cover, k, rc))
+				continue;
 
 /*
 			g_message("%s: %d, %d, %d, %d", mapset->maps[i].filename,
@@ -403,17 +1380,37 @@ mapset_render_layer(const struct Layer *layer, const struct RenderContext *rc) {
 				mapset->maps[i].mapview_data[mapview->index].Bounds.bottom);
 */
 
-			open_merge_map(&mapset->maps[i], hDstDS);
+			TRACE_BEGIN("open_merge_map", mapset->maps[i].filename);
+			open_merge_map(&mapset->maps[i], hDstDS, rc->rt->warp_error);
+			TRACE_END("open_merge_map");
 		}
 	}
 
+	gmap_free(cover.by);
+	gmap_free(hidden);
+	gmap_free(vis);
 	GDALClose( hDstDS );
 	cairo_surface_mark_dirty(rc->cs);
 }
 
 static void
 mapset_free_target_data(struct Layer *layer, const struct RenderTarget *target) {
-	gmap_free(layer->priv);
+	struct MapSet *mapset = (struct MapSet *)layer->data;
+	struct MapsetTargetdata *priv = (struct MapsetTargetdata *)layer->priv;
+	int i;
+
+	if(priv == NULL)
+		return;
+	decode_unlisten(layer, target);
+	for(i = 0; i < mapset->count; i++) {
+		if(priv->maps[i].meshes != NULL)
+			g_hash_table_destroy(priv->maps[i].meshes);
+		g_free(priv->maps[i].outline);
+	}
+	if(priv->to_mapset != NULL)
+		OCTDestroyCoordinateTransformation(priv->to_mapset);
+	gmap_free(priv->maps);
+	gmap_free(priv);
 	layer->priv = NULL;
 }
 
@@ -422,6 +1419,8 @@ struct LayerOps mapset_layer_ops = {
 	mapset_render_layer,
 	mapset_calc_target_data,
 	mapset_free_target_data,
+	FALSE,
+	TRUE,
 };
 
 void
@@ -431,20 +1430,3 @@ mapset_init_layer(struct Layer *layer, enum LayerType type, struct MapSet *mapse
 	layer->data = mapset;
 	layer->flags = (layer->data != NULL) ? LAYER_IS_VISIBLE : LAYER_FLAGS_NONE;
 }
-
-void
-mapview_center_map_region(struct MapView *mapview, double xx0, double xx1, double yy0, double yy1) {
-	double scale;
-
-	/* scale that fits the rectangle into the alloctted rectangle */
-	scale = MAX(ABS(yy1-yy0)/mapview->allocation_height, ABS(xx1-xx0)/mapview->allocation_width);
-
-	/* center to region */
-	xx0 = (xx0 + xx1) / 2;
-	yy0 = (yy0 + yy1) / 2;
-
-	gtk_widget_hide(mapview->layout);
-	mapview_set_scale(mapview, scale);
-	mapview_goto_xy(mapview, xx0, yy0, mapview->allocation_width/2.0, mapview->allocation_height/2.0);
-	gtk_widget_show(mapview->layout);
-}
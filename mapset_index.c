@@ -0,0 +1,328 @@
+/*
+ * mapset_index.c
+ * Copyright (C) 2007 Itai Nahshon
+ *
+ * Binary index of a mapset XML file, kept next to it as <file>.idx.
+ * It holds everything mapset_from_doc() reads, in arrays that are
+ * mapped and copied in a few allocations instead of parsed. The XML
+ * stays the source: the index records the size and mtime of the XML it
+ * was made from and is ignored, and made again, when they differ.
+ *
+ * Layout, native byte order and alignment:
+ *	struct IndexHeader
+ *	struct IndexMap	maps[n_maps]
+ *	struct cpoint	cpoints[n_cpoints]	all maps, in map order
+ *	struct MapPoint	crop[n_crop]		same
+ *	char		strings[strings_size]	NUL terminated
+ * Strings are offsets into strings; NO_STRING is NULL.
+ */
+
+#include "gmap.h"
+#include <sys/stat.h>
+#include <errno.h>
+
+#define INDEX_MAGIC	"GMAPIDX"
+#define INDEX_VERSION	2
+#define INDEX_BYTE_ORDER 0x01020304
+#define NO_STRING	0xFFFFFFFFu
+
+/* Smaller mapsets read fast enough from the XML */
+#define INDEX_MIN_MAPS	100
+
+struct IndexHeader {
+	char		magic[8];
+	guint32		version;
+	guint32		byte_order;
+	gint64		xml_size;		/* of the XML the index was made from */
+	gint64		xml_mtime;
+	guint32		n_maps;
+	guint32		n_cpoints;
+	guint32		n_crop;
+	guint32		strings_size;
+	guint32		name, description, basedir, wkt;
+	double		left, right, top, bottom;
+	double		preferred_scale;
+	double		max_scale;
+	double		min_scale;
+};
+
+struct IndexMap {
+	double		GeoTransform[6];
+	gint32		width, height, bpp;
+	gint32		x, y, w, h;		/* Rect */
+	guint32		filename;
+	guint32		n_cpoints;
+	guint32		n_crop;
+};
+
+static char *
+index_filename(const char *filename) {
+	return g_strconcat(filename, ".idx", NULL);
+}
+
+/* mtime is in nsec where the system has it, saving twice a second is common */
+static bool
+xml_stat(const char *filename, gint64 *size, gint64 *mtime) {
+	struct stat st;
+
+	if(stat(filename, &st) != 0)
+		return FALSE;
+	*size = st.st_size;
+#ifdef LINUX
+	*mtime = (gint64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+	*mtime = st.st_mtime;
+#endif
+	return TRUE;
+}
+
+static const char *
+index_string(const char *strings, guint32 size, guint32 off) {
+	if(off == NO_STRING || off >= size)
+		return NULL;
+	return strings + off;
+}
+
+/*
+ * The mapset of filename from its index, or NULL if there is none or it
+ * does not match the XML. Only the mapset is read, like mapset_from_doc().
+ */
+struct MapSet *
+mapset_from_index(const char *filename) {
+	const struct IndexHeader *hdr;
+	const struct IndexMap *imaps;
+	const struct cpoint *cpoints;
+	const struct MapPoint *crop;
+	const char *strings, *data;
+	struct MapSet *mapset;
+	GMappedFile *mf;
+	gint64 size, mtime;
+	gsize length, need;
+	guint32 i, nc, np;
+	char *idx;
+
+	if(!xml_stat(filename, &size, &mtime))
+		return NULL;
+	idx = index_filename(filename);
+	mf = g_mapped_file_new(idx, FALSE, NULL);
+	gmap_free(idx);
+	if(mf == NULL)
+		return NULL;
+
+	data = g_mapped_file_get_contents(mf);
+	length = g_mapped_file_get_length(mf);
+	hdr = (const struct IndexHeader *)data;
+	if(length < sizeof(*hdr) || memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) ||
+	   hdr->version != INDEX_VERSION || hdr->byte_order != INDEX_BYTE_ORDER ||
+	   hdr->xml_size != size || hdr->xml_mtime != mtime) {
+		g_mapped_file_unref(mf);
+		return NULL;
+	}
+	need = sizeof(*hdr) + (gsize)hdr->n_maps * sizeof(struct IndexMap) +
+		(gsize)hdr->n_cpoints * sizeof(struct cpoint) + (gsize)hdr->n_crop * sizeof(struct MapPoint) +
+		hdr->strings_size;
+	if(length != need || hdr->strings_size == 0 || data[length-1] != '\0') {
+		g_mapped_file_unref(mf);
+		return NULL;
+	}
+
+	imaps = (const struct IndexMap *)(hdr + 1);
+	cpoints = (const struct cpoint *)(imaps + hdr->n_maps);
+	crop = (const struct MapPoint *)(cpoints + hdr->n_cpoints);
+	strings = (const char *)(crop + hdr->n_crop);
+
+	TRACE_BEGIN("mapset_from_index", filename);
+	mapset = new_mapset();
+	mapset->name = gmap_strdup(index_string(strings, hdr->strings_size, hdr->name));
+	mapset->description = gmap_strdup(index_string(strings, hdr->strings_size, hdr->description));
+	mapset->basedir = gmap_strdup(index_string(strings, hdr->strings_size, hdr->basedir));
+	mapset->WKT = gmap_strdup(index_string(strings, hdr->strings_size, hdr->wkt));
+	mapset->left = hdr->left;
+	mapset->right = hdr->right;
+	mapset->top = hdr->top;
+	mapset->bottom = hdr->bottom;
+	mapset->preferred_scale = hdr->preferred_scale;
+	mapset->max_scale = hdr->max_scale;
+	mapset->min_scale = hdr->min_scale;
+
+	mapset->count = hdr->n_maps;
+	mapset->maps = (struct Map *)gmap_malloc0(hdr->n_maps * sizeof(struct Map));
+	for(i = 0, nc = 0, np = 0; i < hdr->n_maps; i++) {
+		const struct IndexMap *im = &imaps[i];
+		struct Map *map = &mapset->maps[i];
+
+		if(nc + im->n_cpoints > hdr->n_cpoints || np + im->n_crop > hdr->n_crop ||
+		   index_string(strings, hdr->strings_size, im->filename) == NULL) {
+			fprintf(stderr, "%s.idx: bad index, ignored\n", filename);
+			mapset->count = i;
+			free_mapset(mapset);
+			g_mapped_file_unref(mf);
+			TRACE_END("mapset_from_index");
+			return NULL;
+		}
+
+		/* same as new_map(), the name is already relative to basedir */
+		map->filename = gmap_strdup(strings + im->filename);
+		map->mapset = mapset;
+		memcpy(map->GeoTransform, im->GeoTransform, sizeof(map->GeoTransform));
+		map->width = im->width;
+		map->height = im->height;
+		map->bpp = im->bpp;
+		map->Rect.x = im->x;
+		map->Rect.y = im->y;
+		map->Rect.w = im->w;
+		map->Rect.h = im->h;
+		/* as mapset_from_doc() has it, not what the view toggled */
+		map->visible = (map->Rect.w > 0 && map->Rect.h > 0);
+
+		map->n_calibration_points = im->n_cpoints;
+		if(im->n_cpoints > 0)
+			map->calibration_points = (struct cpoint *)g_memdup(&cpoints[nc], im->n_cpoints * sizeof(struct cpoint));
+		nc += im->n_cpoints;
+		map->CropPoints = im->n_crop;
+		if(im->n_crop > 0)
+			map->Crop = (struct MapPoint *)g_memdup(&crop[np], im->n_crop * sizeof(struct MapPoint));
+		np += im->n_crop;
+	}
+	g_mapped_file_unref(mf);
+	TRACE_END("mapset_from_index");
+
+	mapset->dirty = FALSE;
+	return mapset;
+}
+
+/* Append a string to the blob, its offset */
+static guint32
+add_string(GString *strings, const char *str) {
+	guint32 off = strings->len;
+
+	if(str == NULL)
+		return NO_STRING;
+	g_string_append_len(strings, str, strlen(str) + 1);
+	return off;
+}
+
+static bool
+write_all(FILE *f, const void *p, size_t size) {
+	return size == 0 || fwrite(p, size, 1, f) == 1;
+}
+
+/*
+ * Write the index of mapset, as read from or saved to filename. It is
+ * written to a temporary file and renamed, a reader never sees half of it.
+ */
+bool
+mapset_write_index(const struct MapSet *mapset, const char *filename) {
+	struct IndexHeader hdr;
+	struct IndexMap *imaps;
+	GString *strings;
+	char *idx, *tmp, *dir;
+	bool ok;
+	FILE *f;
+	int i, j;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = INDEX_VERSION;
+	hdr.byte_order = INDEX_BYTE_ORDER;
+	if(!xml_stat(filename, &hdr.xml_size, &hdr.xml_mtime))
+		return FALSE;
+
+	strings = g_string_new(NULL);
+	hdr.name = add_string(strings, mapset->name);
+	hdr.description = add_string(strings, mapset->description);
+	/* like the XML, the default basedir is where the file is */
+	dir = g_path_get_dirname(filename);
+	if(mapset->basedir != NULL && strcmp(dir, mapset->basedir))
+		hdr.basedir = add_string(strings, mapset->basedir);
+	else
+		hdr.basedir = NO_STRING;
+	g_free(dir);
+	hdr.wkt = add_string(strings, mapset->WKT);
+	hdr.left = mapset->left;
+	hdr.right = mapset->right;
+	hdr.top = mapset->top;
+	hdr.bottom = mapset->bottom;
+	hdr.preferred_scale = mapset->preferred_scale;
+	hdr.max_scale = mapset->max_scale;
+	hdr.min_scale = mapset->min_scale;
+
+	hdr.n_maps = mapset->count;
+	imaps = (struct IndexMap *)gmap_malloc0(mapset->count * sizeof(struct IndexMap));
+	for(i = 0; i < mapset->count; i++) {
+		const struct Map *map = &mapset->maps[i];
+		struct IndexMap *im = &imaps[i];
+
+		memcpy(im->GeoTransform, map->GeoTransform, sizeof(im->GeoTransform));
+		im->width = map->width;
+		im->height = map->height;
+		im->bpp = map->bpp;
+		im->x = map->Rect.x;
+		im->y = map->Rect.y;
+		im->w = map->Rect.w;
+		im->h = map->Rect.h;
+		im->filename = add_string(strings, map->filename);
+		im->n_cpoints = map->n_calibration_points;
+		im->n_crop = MAX(map->CropPoints, 0);
+		hdr.n_cpoints += im->n_cpoints;
+		hdr.n_crop += im->n_crop;
+	}
+	hdr.strings_size = strings->len;
+
+	idx = index_filename(filename);
+	tmp = g_strconcat(idx, ".tmp", NULL);
+	f = fopen(tmp, "wb");
+	ok = (f != NULL);
+	if(ok) {
+		ok = write_all(f, &hdr, sizeof(hdr)) && write_all(f, imaps, mapset->count * sizeof(struct IndexMap));
+		for(i = 0; ok && i < mapset->count; i++)
+			ok = write_all(f, mapset->maps[i].calibration_points,
+				mapset->maps[i].n_calibration_points * sizeof(struct cpoint));
+		for(i = 0; ok && i < mapset->count; i++) {
+			for(j = 0; ok && j < mapset->maps[i].CropPoints; j++)
+				ok = write_all(f, &mapset->maps[i].Crop[j], sizeof(struct MapPoint));
+		}
+		ok = ok && write_all(f, strings->str, strings->len);
+		ok = (fclose(f) == 0) && ok;
+		if(ok)
+			ok = (rename(tmp, idx) == 0);
+		if(!ok)
+			unlink(tmp);
+	}
+	if(!ok)
+		g_message("could not write %s: %s", idx, strerror(errno));
+
+	gmap_free(tmp);
+	gmap_free(idx);
+	gmap_free(imaps);
+	g_string_free(strings, TRUE);
+	return ok;
+}
+
+/*
+ * The XML at filename was written from memory, which has values it does
+ * not keep (rounded doubles among them): the index goes, and the next
+ * mapset_from_file() makes it again from what the XML has.
+ */
+void
+mapset_remove_index(const char *filename) {
+	char *idx = index_filename(filename);
+
+	if(unlink(idx) != 0 && errno != ENOENT)
+		g_message("could not remove %s: %s", idx, strerror(errno));
+	gmap_free(idx);
+}
+
+/* Worth an index: large, or it had one already */
+bool
+mapset_wants_index(const struct MapSet *mapset, const char *filename) {
+	char *idx;
+	bool exists;
+
+	if(mapset->count >= INDEX_MIN_MAPS)
+		return TRUE;
+	idx = index_filename(filename);
+	exists = g_file_test(idx, G_FILE_TEST_EXISTS);
+	gmap_free(idx);
+	return exists;
+}
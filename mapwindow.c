@@ -52,7 +52,7 @@ mapwindow_show_near_objects(struct MapView *mapview) {
 
 	destroy_near_objects_window(mapview);
 
-	str = get_near_object(mapview, mapview->last_x, mapview->last_y);
+	str = get_near_object(&mapview->rt, mapview->last_x, mapview->last_y);
 
 	if(str != NULL) {
 		//PangoAttrList *p = pango_attr_list_new();
@@ -196,118 +196,73 @@ mapview_get_center(struct MapView *mapview, double *geo_x, double *geo_y) {
 static void
 map_window_zoom_in(GtkAction *action, struct MapView *mapview)
 {
-	double zoom_scale = mapview->rt.scale / 1.5;
-
-	double dx = mapview->allocation_width / 2.0;
-	double dy = mapview->allocation_height / 2.0;
-	double x =  dx + gtk_adjustment_get_value(mapview->hadjustment);
-	double y =  dy + gtk_adjustment_get_value(mapview->vadjustment);
-	double geo_x, geo_y;
-	pixel_to_geo_xy(mapview->rt.GeoTransform, x, y, &geo_x, &geo_y);
-
-	gtk_widget_hide(mapview->layout);
-	mapview_set_scale(mapview, zoom_scale);
-	mapview_goto_xy(mapview, geo_x, geo_y, dx, dy);
-	gtk_widget_show(mapview->layout);
+	mapview_zoom_at(mapview, mapview_zoom_scale(mapview) / 1.5,
+		mapview->allocation_width / 2.0, mapview->allocation_height / 2.0);
 }
 
 static void
 map_window_zoom_out(GtkAction *action, struct MapView *mapview)
 {
-	double zoom_scale = mapview->rt.scale * 1.5;
-
-	double dx = mapview->allocation_width / 2.0;
-	double dy = mapview->allocation_height / 2.0;
-	double x =  dx + gtk_adjustment_get_value(mapview->hadjustment);
-	double y =  dy + gtk_adjustment_get_value(mapview->vadjustment);
-	double geo_x, geo_y;
-	pixel_to_geo_xy(mapview->rt.GeoTransform, x, y, &geo_x, &geo_y);
-
-	gtk_widget_hide(mapview->layout);
-	mapview_set_scale(mapview, zoom_scale);
-	mapview_goto_xy(mapview, geo_x, geo_y, dx, dy);
-	gtk_widget_show(mapview->layout);
+	mapview_zoom_at(mapview, mapview_zoom_scale(mapview) * 1.5,
+		mapview->allocation_width / 2.0, mapview->allocation_height / 2.0);
 }
 
 static void
 map_window_zoom_100(GtkAction *action, struct MapView *mapview)
 {
-	double zoom_scale = mapview->preferred_scale;
-
-	double dx = mapview->allocation_width / 2.0;
-	double dy = mapview->allocation_height / 2.0;
-	double x =  dx + gtk_adjustment_get_value(mapview->hadjustment);
-	double y =  dy + gtk_adjustment_get_value(mapview->vadjustment);
-	double geo_x, geo_y;
-	pixel_to_geo_xy(mapview->rt.GeoTransform, x, y, &geo_x, &geo_y);
-
-	gtk_widget_hide(mapview->layout);
-	mapview_set_scale(mapview, zoom_scale);
-	mapview_goto_xy(mapview, geo_x, geo_y, dx, dy);
-	gtk_widget_show(mapview->layout);
+	mapview_zoom_at(mapview, mapview->preferred_scale,
+		mapview->allocation_width / 2.0, mapview->allocation_height / 2.0);
 }
 
 void
-target_free_data(struct RenderTarget *target) {
-	int i;
-	gmap_free(target->WKT);
-	for(i = 0; i < target->n_layers; i++) {
-		/* must free layer private data */
-		if(target->layers[i].ops->free_target_data)
-			(*target->layers[i].ops->free_target_data)(&target->layers[i], target);
-	}
-	gmap_free(target->layers);
+mapview_close(struct MapView *mapview) {
+	playback_stop(mapview);
+	export_region_cancel(mapview);
+	gtk_widget_destroy(GTK_WIDGET(mapview->window)); /* XXX */
+	mapview_redraw_free(mapview);
+	target_free_data(&mapview->rt);
+	playback_free(mapview);
+	gmap_free(mapview);
 }
 
 static void
 map_window_close_window(GtkAction *action, struct MapView *mapview)
 {
-	gtk_widget_destroy(GTK_WIDGET(mapview->window)); /* XXX */
-	target_free_data(&mapview->rt);
-	gmap_free(mapview);
+	mapview_close(mapview);
 }
 
-struct Layer *
-target_add_layer(struct RenderTarget *target) {
-	struct Layer *layer;
-	target->layers = (struct Layer *)gmap_realloc(target->layers, (1+target->n_layers)*sizeof(struct Layer));
-	layer = &target->layers[target->n_layers];
-	target->n_layers++;
-	layer->type = LAYER_NONE;
-	layer->ops = NULL;
-	layer->flags = LAYER_FLAGS_NONE;
-	layer->data = NULL;
-	layer->priv = NULL;
-	return layer;
-};
-
 static void
 add_layers_from_gpx_file(struct MapView *mapview, char *filename) {
 	struct TrackSet *trackset;
 	struct RouteSet *routeset;
 	struct WayPointSet *waypointset;
 	struct Layer *layer;
+	int track_layer = -1;
 
 	if(load_from_gpx(filename, &trackset, &routeset, &waypointset)) {
+		/* the layers may move */
+		mapview_redraw_sync(mapview);
 		if(trackset != NULL) {
 			layer = target_add_layer(&mapview->rt);
 			trackset_init_layer(layer, LAYER_TRACKSET, trackset);
-			(*layer->ops->calc_target_data)(layer, &mapview->rt);
+			layer_calc_target_data(layer, &mapview->rt);
+			track_layer = layer - mapview->rt.layers;
 		}
 		if(routeset != NULL) {
 			layer = target_add_layer(&mapview->rt);
 			routeset_init_layer(layer, LAYER_ROUTESET, routeset);
-			(*layer->ops->calc_target_data)(layer, &mapview->rt);
+			layer_calc_target_data(layer, &mapview->rt);
 		}
 		if(waypointset != NULL) {
 			layer = target_add_layer(&mapview->rt);
 			waypointset_init_layer(layer, LAYER_WAYPOINTSET, waypointset);
-			(*layer->ops->calc_target_data)(layer, &mapview->rt);
+			layer_calc_target_data(layer, &mapview->rt);
 		}
 		struct GeoRect rect;
-		if(trackset != NULL && trackset_calc_extents(trackset, &mapview->rt, &rect))
+		/* the layers moved if more were added */
+		if(track_layer >= 0 && trackset_calc_extents(&mapview->rt.layers[track_layer], &rect))
 			mapview_center_map_region(mapview, rect.left, rect.right, rect.top, rect.bottom);
-		gtk_widget_queue_draw(mapview->layout);
+		mapview_layers_changed(mapview);
 	}
 	else {
 		GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(mapview->window),
@@ -398,6 +353,21 @@ mouse_button_press(GtkWidget *widget, GdkEventButton *event, struct MapView *map
 	return FALSE;
 }
 
+/* The wheel zooms around the pointer */
+static gboolean
+mouse_scroll(GtkWidget *widget, GdkEventScroll *event, struct MapView *mapview) {
+	double x = event->x - gtk_adjustment_get_value(mapview->hadjustment);
+	double y = event->y - gtk_adjustment_get_value(mapview->vadjustment);
+
+	if(event->direction == GDK_SCROLL_UP)
+		mapview_zoom_at(mapview, mapview_zoom_scale(mapview) / 1.25, x, y);
+	else if(event->direction == GDK_SCROLL_DOWN)
+		mapview_zoom_at(mapview, mapview_zoom_scale(mapview) * 1.25, x, y);
+	else
+		return FALSE;
+	return TRUE;
+}
+
 static gboolean
 mouse_button_release(GtkWidget *widget, GdkEventButton *event, struct MapView *mapview) {
 	g_message ("mouse_button_release %d %g %g", event->button, event->x_root, event->y_root);
@@ -434,98 +404,22 @@ size_allocation_changed(GtkWidget *widget, GtkAllocation *allocation, struct Map
 	return FALSE;
 }
 
-/* Redraw the screen from the backing pixmap */
+/* Redraw the screen from the frame, see redraw.c */
 static gboolean
 expose_event(GtkWidget *widget, GdkEventExpose *event, struct MapView *v)
 {
-	int i;
-	struct RenderContext rc;
-	cairo_t *tempx;
-
-	cairo_surface_t *temp_surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, event->area.width, event->area.height);
-	cairo_t *temp = cairo_create(temp_surface);
-
-	rc.rt = &v->rt;
-	rc.cs = temp_surface;
-	rc.ct = temp;
-	rc.x = event->area.x;
-	rc.y = event->area.y;
-	rc.w = event->area.width;
-	rc.h = event->area.height;
-
-	for(i = 0; i < v->rt.n_layers; i++) {
-		if(!(v->rt.layers[i].flags & LAYER_IS_VISIBLE))
-			continue;
-
-		(*v->rt.layers[i].ops->render_layer)(&v->rt.layers[i], &rc);
-	}
-
-	tempx = gdk_cairo_create(GTK_LAYOUT(widget)->bin_window);
-	cairo_set_source_surface(tempx, temp_surface, event->area.x, event->area.y);
-	cairo_paint(tempx);
-
-	cairo_destroy(tempx);
-	cairo_destroy(temp);
-	cairo_surface_destroy(temp_surface);
-
-	/* g_message ("expose_event %d x=%d, y=%d w=%d h=%d\n",
-				counter++,
-				event->area.x, event->area.y,
-				event->area.width, event->area.height); */
-	return TRUE;
-}
-
-void
-target_set_scale(struct RenderTarget *target, double scale) {
-	int i;
-	double hscale, vscale;
-	double sinrot, cosrot;
-
-	/* XXX must be fixed to allow rotated target */
-	/* To prevent view window from growing to a nngative size.
-	   Even for a world map, 31 bits give a fair resolution of
-	   about 2 cm/pixel. */
-
-#define MAXWINDOWSIZE ((double)0x7FFFFFFF)
-	scale = MAX(scale, fabs(target->right-target->left)/MAXWINDOWSIZE);
-	scale = MAX(scale, fabs(target->bottom-target->top)/MAXWINDOWSIZE);
-	// g_message("mapview_set_zoom: zoom_scale=%f", zoom_scale);
-
-	target->scale = scale;
-
-	sinrot = sin(target->rotation * M_PI/180);
-	cosrot = cos(target->rotation * M_PI/180);
-
-	hscale = (target->left <= target->right) ? scale : -scale;
-	vscale = (target->top <= target->bottom) ? scale : -scale;
-	vscale *= (target->x_resulution / target->y_resulution);
-
-	target->GeoTransform[0] = target->left;
-	target->GeoTransform[1] = hscale * cosrot;
-	target->GeoTransform[2] = vscale * sinrot;
-	target->GeoTransform[3] = target->top;
-	target->GeoTransform[4] = hscale * -sinrot;
-	target->GeoTransform[5] = vscale * cosrot;
-
-	/* Set the size for the viewport */
-	target->width = (int)ceil((target->right-target->left)/target->GeoTransform[1]);
-	target->height =  (int)ceil((target->bottom-target->top)/target->GeoTransform[5]);
-
-	for(i = 0; i < target->n_layers; i++) {
-		if(!(target->layers[i].flags & LAYER_IS_VISIBLE))
-			continue;
-
-		(*target->layers[i].ops->calc_target_data)(&target->layers[i], target);
-	}
+	return mapview_redraw_expose(v, event);
 }
 
 void
 mapview_set_scale(struct MapView *mapview, double scale) {
 	char str[100]; int l;
+	mapview_redraw_sync(mapview);
 	target_set_scale(&mapview->rt, scale);
 
 	// g_message("Set the layout size to %d X %d", mapview->width, mapview->height);
 	gtk_layout_set_size(GTK_LAYOUT(mapview->layout), mapview->rt.width, mapview->rt.height);
+	mapview_view_changed(mapview);
 	l = snprintf(str, sizeof(str), "Scale 1/%f",
 		mapview->rt.scale * (mapview->rt.x_resulution * 1000 / 25.4));
 	if(mapview->rt.rotation != 0.0)
@@ -533,6 +427,103 @@ mapview_set_scale(struct MapView *mapview, double scale) {
 	gtk_label_set_text(GTK_LABEL(mapview->MapXY), str);
 }
 
+/* Call after changing the WKT for a mapview. This will set-up
+a translator from the new CS to WGS84, and also set/clear
+a flag telling is the coordinates should be shown in
+degrees or not. */
+void
+mapview_changed_projection(struct MapView *mapview) {
+	OGRSpatialReferenceH osrsSrc, osrsDst;
+	/* The parameter that are calculated here are used when displaying coordinated on the
+	   statusbar (updated by mouse_move */
+	if(mapview->towgs84)
+		OCTDestroyCoordinateTransformation((OGRCoordinateTransformationH)(mapview->towgs84));
+
+	mapview->towgs84 = NULL;
+	mapview->geographic_ref = FALSE;
+
+	if(mapview->rt.WKT != NULL) {
+		osrsSrc = OSRNewSpatialReference(mapview->rt.WKT);
+		mapview->geographic_ref = OSRIsGeographic(osrsSrc);
+		osrsDst = OSRNewSpatialReference(NULL);
+		OSRSetWellKnownGeogCS(osrsDst, "WGS84");
+		mapview->towgs84 = (void *)OCTNewCoordinateTransformation(osrsSrc, osrsDst);
+		OSRDestroySpatialReference(osrsDst);
+		OSRDestroySpatialReference(osrsSrc);
+	}
+}
+
+/* XXX set mapview parameters from this mapset */
+void
+mapview_set_projection_and_scale_from_mapset(struct MapSet *mapset, struct MapView *mapview) {
+
+	/* first set the target */
+	mapview_redraw_sync(mapview);
+	target_set_projection_and_scale_from_mapset(mapset, &mapview->rt);
+
+	gtk_layout_set_size(GTK_LAYOUT(mapview->layout), mapview->rt.width, mapview->rt.height);
+	mapview_view_changed(mapview);
+
+	/* reset to this scale value when hitting '=' */
+	mapview->preferred_scale = mapview->rt.scale;
+
+	mapview_changed_projection(mapview);
+}
+
+/*
+ * Show text in the progress bar, with fraction done, or a pulse if
+ * fraction < 0. NULL text hides it.
+ */
+void
+mapview_set_progress(struct MapView *mapview, const char *text, double fraction) {
+	if(text == NULL) {
+		gtk_widget_hide(mapview->Progress);
+		return;
+	}
+	gtk_progress_bar_set_text(GTK_PROGRESS_BAR(mapview->Progress), text);
+	if(fraction < 0)
+		gtk_progress_bar_pulse(GTK_PROGRESS_BAR(mapview->Progress));
+	else
+		gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(mapview->Progress), MIN(fraction, 1.0));
+	gtk_widget_show(mapview->Progress);
+}
+
+/* Maps of the mapset layers that are still decoding */
+void
+mapview_update_progress(struct MapView *mapview) {
+	int i, done, total, all_done = 0, all_total = 0;
+	char str[100];
+
+	for(i = 0; i < mapview->rt.n_layers; i++) {
+		struct Layer *layer = &mapview->rt.layers[i];
+		if(layer->type == LAYER_MAPSET && layer->data != NULL &&
+		   mapset_loading((struct MapSet *)layer->data, &done, &total)) {
+			all_done += done;
+			all_total += total;
+		}
+	}
+	if(all_total == 0) {
+		mapview_set_progress(mapview, NULL, 0);
+		return;
+	}
+	snprintf(str, sizeof(str), "Loading maps %d/%d", all_done, all_total);
+	mapview_set_progress(mapview, str, (double)all_done / all_total);
+}
+
+void
+mapview_center_map_region(struct MapView *mapview, double xx0, double xx1, double yy0, double yy1) {
+	double scale;
+
+	/* scale that fits the rectangle into the alloctted rectangle */
+	scale = MAX(ABS(yy1-yy0)/mapview->allocation_height, ABS(xx1-xx0)/mapview->allocation_width);
+
+	/* center to region */
+	xx0 = (xx0 + xx1) / 2;
+	yy0 = (yy0 + yy1) / 2;
+
+	mapview_zoom_to(mapview, scale, xx0, yy0, mapview->allocation_width/2.0, mapview->allocation_height/2.0);
+}
+
 static void
 tool_select_callback(GtkRadioAction *action, GtkRadioAction *current, struct MapView *mapview) {
 	mapview->current_tool_num = gtk_radio_action_get_current_value(action);
@@ -562,6 +553,13 @@ map_window_print(GtkAction *action, struct MapView *mapview)
 	do_print(mapview);
 }
 
+static void
+map_window_export_region(GtkAction *action, struct MapView *mapview)
+{
+	g_message("export region");
+	do_export_region(mapview);
+}
+
 static void
 map_window_page_setup(GtkAction *action, struct MapView *mapview)
 {
@@ -649,12 +647,59 @@ map_window_copy_coords_wgs84dms(GtkAction *action, struct MapView *mapview)
 	gtk_clipboard_set_text(clipboard, str, strlen(str));
 }
 
+static void
+map_window_play_tracks(GtkToggleAction *action, struct MapView *mapview)
+{
+	if(gtk_toggle_action_get_active(action))
+		playback_start(mapview);
+	else
+		playback_stop(mapview);
+}
+
+static void
+map_window_smooth_zoom(GtkToggleAction *action, struct MapView *mapview)
+{
+	mapview->smooth_zoom = gtk_toggle_action_get_active(action);
+}
+
+static void
+map_window_layer_timings(GtkToggleAction *action, struct MapView *mapview)
+{
+	if(gtk_toggle_action_get_active(action))
+		gtk_widget_show(mapview->LayerTimes);
+	else
+		gtk_widget_hide(mapview->LayerTimes);
+}
+
+/* Values of the WarpError radio actions */
+static const double warp_errors[] = { 0, DEFAULT_WARP_ERROR, 0.5, 2.0 };
+
+static void
+map_window_warp_error(GtkAction *action, GtkRadioAction *current, struct MapView *mapview)
+{
+	mapview->rt.warp_error = warp_errors[gtk_radio_action_get_current_value(current)];
+	mapview_queue_redraw(mapview);
+}
+
+static void
+map_window_playback_faster(GtkAction *action, struct MapView *mapview)
+{
+	playback_set_speed(mapview, 2.0);
+}
+
+static void
+map_window_playback_slower(GtkAction *action, struct MapView *mapview)
+{
+	playback_set_speed(mapview, 0.5);
+}
+
 static GtkActionEntry ui_entries[] = {
 // { "ContextMenu", NULL,		"Menu", },
   { "FileMenu",			NULL,			"_File", },
   { "OpenGPX",			GTK_STOCK_OPEN,		NULL,				NULL,	NULL,  G_CALLBACK(map_window_open_gpx) },
   { "Print",			GTK_STOCK_PRINT,	NULL,				NULL,	NULL,  G_CALLBACK(map_window_print) },
   { "PageSetup",		NULL,			"Page Setup...",		NULL,	NULL,  G_CALLBACK(map_window_page_setup) },
+  { "ExportRegion",		NULL,			"Export Region...",		NULL,	NULL,  G_CALLBACK(map_window_export_region) },
   { "Close",			GTK_STOCK_CLOSE,	NULL,				NULL,	NULL, G_CALLBACK(map_window_close_window) },
   { "HelpMenu",			NULL,			"_Help", },
   { "ViewMenu",			NULL,			"_View", },
@@ -667,9 +712,26 @@ static GtkActionEntry ui_entries[] = {
   { "CopyCoordsMap",		NULL,			"117705/1045743",		NULL,	NULL,  G_CALLBACK(map_window_copy_coords_map) },
   { "CopyCoordsWGS84Dec",	NULL,			"34.671243°E  31.000776°N",	NULL,	NULL,  G_CALLBACK(map_window_copy_coords_wgs84dec) },
   { "CopyCoordsWGS84DMS",	NULL,			"34°40′16.47″E 31°00′3.07″N",	NULL,	NULL,  G_CALLBACK(map_window_copy_coords_wgs84dms) },
+  { "PlaybackFaster",		NULL,			"Playback Faster",		"bracketright",	NULL,  G_CALLBACK(map_window_playback_faster) },
+  { "PlaybackSlower",		NULL,			"Playback Slower",		"bracketleft",	NULL,  G_CALLBACK(map_window_playback_slower) },
 };
 static guint n_ui_entries = G_N_ELEMENTS (ui_entries);
 
+static GtkToggleActionEntry ui_toggle_entries[] = {
+  { "PlayTracks",		GTK_STOCK_MEDIA_PLAY,	"Play Tracks",			"space",	NULL,  G_CALLBACK(map_window_play_tracks), FALSE },
+  { "SmoothZoom",		NULL,			"Smooth Zoom",			NULL,		NULL,  G_CALLBACK(map_window_smooth_zoom), TRUE },
+  { "LayerTimings",		NULL,			"Layer Timings",		"<control>t",	NULL,  G_CALLBACK(map_window_layer_timings), FALSE },
+};
+static guint n_ui_toggle_entries = G_N_ELEMENTS (ui_toggle_entries);
+
+static GtkRadioActionEntry ui_warp_error_entries[] = {
+  { "WarpExact",		NULL,			"Exact Reprojection",		NULL,	NULL, 0 },
+  { "WarpEighth",		NULL,			"Reprojection Error 1/8 Pixel",	NULL,	NULL, 1 },
+  { "WarpHalf",			NULL,			"Reprojection Error 1/2 Pixel",	NULL,	NULL, 2 },
+  { "WarpTwo",			NULL,			"Reprojection Error 2 Pixels",	NULL,	NULL, 3 },
+};
+static guint n_ui_warp_error_entries = G_N_ELEMENTS (ui_warp_error_entries);
+
 /* These actions are not specific to this window */
 static GtkActionEntry ui_global_entries[] = {
   { "About",	   GTK_STOCK_ABOUT,	NULL,	NULL,	NULL, G_CALLBACK(show_about_dialog) },
@@ -692,14 +754,26 @@ static const gchar *ui_info =
 "      <separator />"
 "      <menuitem action='PageSetup'  />"
 "      <menuitem action='Print'  />"
+"      <menuitem action='ExportRegion'  />"
 "      <separator />"
 "      <menuitem action='Close'  />"
 "    </menu>"
 "    <menu action='ViewMenu'>"
 "      <menuitem action='ZoomIn'  />"
 "      <menuitem action='ZoomOut' />"
+"      <menuitem action='SmoothZoom' />"
 "      <separator/>"
 "      <menuitem action='SetProj'/>"
+"      <menuitem action='WarpExact'/>"
+"      <menuitem action='WarpEighth'/>"
+"      <menuitem action='WarpHalf'/>"
+"      <menuitem action='WarpTwo'/>"
+"      <separator/>"
+"      <menuitem action='PlayTracks'/>"
+"      <menuitem action='PlaybackFaster'/>"
+"      <menuitem action='PlaybackSlower'/>"
+"      <separator/>"
+"      <menuitem action='LayerTimings'/>"
 "    </menu>"
 "    <menu action='ToolMenu'>"
 "      <placeholder name='ToolsRadio'>"
@@ -825,7 +899,7 @@ mapview_register_copy_coord_tool(struct MapView *mapview) {
 }
 
 void
-mapview_set_name(struct MapView *mapview, char *name) {
+mapview_set_name(struct MapView *mapview, const char *name) {
 	gmap_free(mapview->name);	/* de-allocate old-name */
 	mapview->name = gmap_strdup(name);
 	gtk_window_set_title(GTK_WINDOW(mapview->window), mapview->name);
@@ -883,6 +957,9 @@ create_map_window(struct MainWindow *mainwindow) {
 	v->preferred_scale = 1;
 	v->rt.scale = v->preferred_scale;
 	v->rt.rotation = 0;
+	v->rt.warp_error = DEFAULT_WARP_ERROR;
+	mapview_redraw_init(v);
+	v->smooth_zoom = TRUE;
 
 	get_screen_resolution(v);
 
@@ -890,10 +967,15 @@ create_map_window(struct MainWindow *mainwindow) {
 
 	v->near_objects_window = NULL;
 	v->show_near_objects_proc = 0;
+	v->playback = NULL;
+	v->region = NULL;
 
 	/* Create actions (and popup_menu) */
 	v->actions = gtk_action_group_new ("Actions");
 	gtk_action_group_add_actions (v->actions, ui_entries, n_ui_entries, v);
+	gtk_action_group_add_toggle_actions (v->actions, ui_toggle_entries, n_ui_toggle_entries, v);
+	gtk_action_group_add_radio_actions (v->actions, ui_warp_error_entries, n_ui_warp_error_entries,
+					1, G_CALLBACK(map_window_warp_error), v);
 	gtk_action_group_add_actions (v->actions, ui_global_entries, n_ui_global_entries, v->mainwindow);
 
 	/* UI Manager */
@@ -939,6 +1021,7 @@ create_map_window(struct MainWindow *mainwindow) {
 				GDK_POINTER_MOTION_HINT_MASK |
 				GDK_BUTTON_PRESS_MASK |
 				GDK_BUTTON_RELEASE_MASK|
+				GDK_SCROLL_MASK |
 				GDK_LEAVE_NOTIFY_MASK);
 
 	gtk_widget_show(v->layout);
@@ -949,6 +1032,7 @@ create_map_window(struct MainWindow *mainwindow) {
 	g_signal_connect(G_OBJECT(v->layout), "leave_notify_event", G_CALLBACK(mouse_leave), v);
 	g_signal_connect(G_OBJECT(v->layout), "button_press_event", G_CALLBACK(mouse_button_press), v);
 	g_signal_connect(G_OBJECT(v->layout), "button_release_event", G_CALLBACK(mouse_button_release), v);
+	g_signal_connect(G_OBJECT(v->layout), "scroll_event", G_CALLBACK(mouse_scroll), v);
 	g_signal_connect(G_OBJECT(v->layout), "size-allocate", G_CALLBACK(size_allocation_changed), v);
 
 	gtk_paned_pack1(GTK_PANED(v->hpane), v->scrolledwindow, TRUE, TRUE);
@@ -968,11 +1052,18 @@ create_map_window(struct MainWindow *mainwindow) {
 	v->OtherXY = gtk_label_new("OtherXY");
 	gtk_widget_show(v->OtherXY);
 	gtk_box_pack_start(GTK_BOX(v->statusbar), v->OtherXY, FALSE, TRUE, 0);
+	/* shown by View/Layer Timings */
+	v->LayerTimes = gtk_label_new("");
+	gtk_box_pack_start(GTK_BOX(v->statusbar), v->LayerTimes, FALSE, TRUE, 0);
 
 	v->ToolName = gtk_label_new("No Tool");
 	gtk_widget_show(v->ToolName);
 	gtk_box_pack_end(GTK_BOX(v->statusbar), v->ToolName, FALSE, TRUE, 1);
 
+	/* shown while something loads */
+	v->Progress = gtk_progress_bar_new();
+	gtk_box_pack_end(GTK_BOX(v->statusbar), v->Progress, FALSE, TRUE, 1);
+
 	gtk_widget_show(v->statusbar);
 	gtk_widget_show(vbox);
 
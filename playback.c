@@ -0,0 +1,347 @@
+/*
+ * playback.c
+ * Copyright (C) 2007 Itai Nahshon
+ *
+ * Track playback: a cursor per track moves along the loaded tracks
+ * following their recorded time.
+ */
+#include "gmap.h"
+#include <ogr_api.h>
+
+#define PLAYBACK_TICK		100		/* ms between cursor updates */
+#define PLAYBACK_SPEED		60.0		/* default, track seconds per second */
+#define CURSOR_RADIUS		6
+
+struct Playback {
+	struct MapView	*mapview;
+	gint64		start, end;		/* time range of all tracks */
+	gint64		now;
+	double		speed;
+	guint		timer;
+	gint64		last_tick;
+	OGRCoordinateTransformationH xform;	/* WGS84 to target */
+
+	int		n_drawn;		/* cursor rects now on screen */
+	GdkRectangle	*drawn;
+	GtkWidget	*label;
+};
+
+static bool
+cursor_xy(const struct Playback *pb, const struct RenderTarget *rt, const struct Track *trk, double *x, double *y) {
+	struct Point pos;
+
+	if(!track_position_at_time(trk, pb->now, &pos, NULL))
+		return FALSE;
+
+	*x = pos.geo_lon;
+	*y = pos.geo_lat;
+	if(pb->xform != NULL && !OCTTransform(pb->xform, 1, x, y, NULL))
+		return FALSE;
+
+	return geo_to_pixel_xy(rt->GeoTransform, *x, *y, x, y);
+}
+
+static void
+playback_render_layer(const struct Layer *layer, const struct RenderContext *rc) {
+	struct Playback *pb = (struct Playback *)layer->data;
+	int i, j;
+
+	cairo_save(rc->ct);
+	cairo_set_antialias(rc->ct, CAIRO_ANTIALIAS_DEFAULT);
+	cairo_set_line_width(rc->ct, 2.0);
+
+	for(i = 0; i < rc->rt->n_layers; i++) {
+		const struct Layer *l = &rc->rt->layers[i];
+		struct TrackSet *trackset;
+
+		if(l->type != LAYER_TRACKSET || !(l->flags & LAYER_IS_VISIBLE))
+			continue;
+
+		trackset = (struct TrackSet *)l->data;
+		for(j = 0; j < trackset->count; j++) {
+			struct Track *trk = &trackset->tracks[j];
+			double x, y;
+
+			if(!cursor_xy(pb, rc->rt, trk, &x, &y))
+				continue;
+			x -= rc->x;
+			y -= rc->y;
+			if(x < -CURSOR_RADIUS || y < -CURSOR_RADIUS ||
+			   x > rc->w + CURSOR_RADIUS || y > rc->h + CURSOR_RADIUS)
+				continue;
+
+			cairo_arc(rc->ct, x, y, CURSOR_RADIUS, 0, 2 * M_PI);
+			cairo_set_source_rgb(rc->ct,
+				((trk->color >> 16) & 0xff) / 255.,
+				((trk->color >> 8) & 0xff) / 255.,
+				((trk->color >> 0) & 0xff) / 255.);
+			cairo_fill_preserve(rc->ct);
+			cairo_set_source_rgb(rc->ct, 0, 0, 0);
+			cairo_stroke(rc->ct);
+		}
+	}
+
+	cairo_restore(rc->ct);
+}
+
+static void
+playback_calc_target_data(struct Layer *layer, const struct RenderTarget *target) {
+	struct Playback *pb = (struct Playback *)layer->data;
+	OGRSpatialReferenceH osrsSrc, osrsDst;
+
+	if(pb->xform != NULL)
+		OCTDestroyCoordinateTransformation(pb->xform);
+
+	osrsSrc = OSRNewSpatialReference(NULL);
+	OSRSetWellKnownGeogCS(osrsSrc, "WGS84");
+	osrsDst = OSRNewSpatialReference(target->WKT);
+	pb->xform = OCTNewCoordinateTransformation(osrsSrc, osrsDst);
+	OSRDestroySpatialReference(osrsDst);
+	OSRDestroySpatialReference(osrsSrc);
+
+	/* Screen positions are no longer valid */
+	pb->n_drawn = 0;
+}
+
+static void
+playback_free_target_data(struct Layer *layer, const struct RenderTarget *target) {
+	struct Playback *pb = (struct Playback *)layer->data;
+
+	if(pb->xform != NULL)
+		OCTDestroyCoordinateTransformation(pb->xform);
+	pb->xform = NULL;
+}
+
+static const struct LayerOps playback_layer_ops = {
+	playback_render_layer,
+	playback_calc_target_data,
+	playback_free_target_data,
+	TRUE,
+};
+
+void
+playback_init_layer(struct Layer *layer, enum LayerType type, struct Playback *pb) {
+	layer->type = type;
+	layer->ops = &playback_layer_ops;
+	layer->flags = LAYER_IS_VISIBLE;
+	layer->data = pb;
+	layer->priv = NULL;
+}
+
+/* Time range of all timed tracks in the view */
+static bool
+playback_time_range(struct MapView *mapview, gint64 *start, gint64 *end) {
+	bool found = FALSE;
+	int i, j;
+
+	for(i = 0; i < mapview->rt.n_layers; i++) {
+		struct TrackSet *trackset;
+
+		if(mapview->rt.layers[i].type != LAYER_TRACKSET)
+			continue;
+		trackset = (struct TrackSet *)mapview->rt.layers[i].data;
+		for(j = 0; j < trackset->count; j++) {
+			gint64 t0, t1;
+			if(!track_time_range(&trackset->tracks[j], &t0, &t1))
+				continue;
+			if(!found || t0 < *start)
+				*start = t0;
+			if(!found || t1 > *end)
+				*end = t1;
+			found = TRUE;
+		}
+	}
+	return found;
+}
+
+static void
+playback_update_label(struct Playback *pb) {
+	GTimeVal tv;
+	gchar *ts, *str;
+
+	tv.tv_sec = pb->now / G_USEC_PER_SEC;
+	tv.tv_usec = pb->now % G_USEC_PER_SEC;
+	ts = g_time_val_to_iso8601(&tv);
+	str = g_strdup_printf("%s x%g", ts ? ts : "", pb->speed);
+	gtk_label_set_text(GTK_LABEL(pb->label), str);
+	g_free(str);
+	g_free(ts);
+}
+
+static struct Layer *
+playback_layer(struct Playback *pb) {
+	struct RenderTarget *rt = &pb->mapview->rt;
+	int i;
+
+	for(i = 0; i < rt->n_layers; i++) {
+		if(rt->layers[i].type == LAYER_PLAYBACK && rt->layers[i].data == pb)
+			return &rt->layers[i];
+	}
+	return NULL;
+}
+
+/* Invalidate the old and the new cursor positions only */
+static void
+playback_move_cursors(struct Playback *pb) {
+	struct MapView *mapview = pb->mapview;
+	struct Layer *layer = playback_layer(pb);
+	bool follow = TRUE;
+	int i, j, n;
+
+	for(i = 0; i < pb->n_drawn; i++)
+		layer_invalidate(&mapview->rt, layer, pb->drawn[i].x, pb->drawn[i].y,
+			pb->drawn[i].width, pb->drawn[i].height);
+
+	n = 0;
+	for(i = 0; i < mapview->rt.n_layers; i++) {
+		struct TrackSet *trackset;
+
+		if(mapview->rt.layers[i].type != LAYER_TRACKSET ||
+		   !(mapview->rt.layers[i].flags & LAYER_IS_VISIBLE))
+			continue;
+		trackset = (struct TrackSet *)mapview->rt.layers[i].data;
+		for(j = 0; j < trackset->count; j++) {
+			GdkRectangle rect;
+			double x, y;
+
+			if(!cursor_xy(pb, &mapview->rt, &trackset->tracks[j], &x, &y))
+				continue;
+
+			/* Keep the first cursor on the screen */
+			if(follow) {
+				double geo_x, geo_y;
+				pixel_to_geo_xy(mapview->rt.GeoTransform, x, y, &geo_x, &geo_y);
+				mapview_point_to_view(mapview, geo_x, geo_y);
+				follow = FALSE;
+			}
+
+			rect.x = (int)x - CURSOR_RADIUS - 2;
+			rect.y = (int)y - CURSOR_RADIUS - 2;
+			rect.width = 2 * CURSOR_RADIUS + 5;
+			rect.height = 2 * CURSOR_RADIUS + 5;
+			layer_invalidate(&mapview->rt, layer, rect.x, rect.y, rect.width, rect.height);
+
+			pb->drawn = (GdkRectangle *)gmap_realloc(pb->drawn, (n+1) * sizeof(GdkRectangle));
+			pb->drawn[n++] = rect;
+		}
+	}
+	pb->n_drawn = n;
+
+	playback_update_label(pb);
+}
+
+static gboolean
+playback_tick(struct Playback *pb) {
+	gint64 now = g_get_monotonic_time();
+
+	pb->now += (gint64)((now - pb->last_tick) * pb->speed);
+	pb->last_tick = now;
+
+	if(pb->now >= pb->end) {
+		pb->now = pb->end;
+		playback_move_cursors(pb);
+		/* will call playback_stop() */
+		gtk_toggle_action_set_active(GTK_TOGGLE_ACTION(
+			gtk_action_group_get_action(pb->mapview->actions, "PlayTracks")), FALSE);
+		return FALSE;
+	}
+
+	playback_move_cursors(pb);
+	return TRUE;
+}
+
+static struct Playback *
+new_playback(struct MapView *mapview) {
+	struct Playback *pb;
+	struct Layer *layer;
+	const char *env;
+
+	pb = (struct Playback *)gmap_malloc(sizeof(struct Playback));
+	pb->mapview = mapview;
+	pb->start = pb->end = pb->now = 0;
+	pb->speed = PLAYBACK_SPEED;
+	if((env = getenv("GMAP_PLAYBACK_SPEED")) != NULL && atof(env) > 0)
+		pb->speed = atof(env);
+	pb->timer = 0;
+	pb->last_tick = 0;
+	pb->xform = NULL;
+	pb->n_drawn = 0;
+	pb->drawn = NULL;
+
+	pb->label = gtk_label_new("");
+	gtk_widget_show(pb->label);
+	gtk_box_pack_end(GTK_BOX(mapview->statusbar), pb->label, FALSE, TRUE, 1);
+
+	mapview_redraw_sync(mapview);
+	layer = target_add_layer(&mapview->rt);
+	playback_init_layer(layer, LAYER_PLAYBACK, pb);
+	layer_calc_target_data(layer, &mapview->rt);
+
+	return pb;
+}
+
+void
+playback_start(struct MapView *mapview) {
+	struct Playback *pb;
+	gint64 start, end;
+
+	if(!playback_time_range(mapview, &start, &end)) {
+		GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(mapview->window),
+						0, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE,
+						"No tracks with time stamps are loaded");
+		gtk_dialog_run(GTK_DIALOG(dialog));
+		gtk_widget_destroy(dialog);
+		gtk_toggle_action_set_active(GTK_TOGGLE_ACTION(
+			gtk_action_group_get_action(mapview->actions, "PlayTracks")), FALSE);
+		return;
+	}
+
+	if(mapview->playback == NULL)
+		mapview->playback = new_playback(mapview);
+	pb = mapview->playback;
+
+	/* Tracks may have been added since last time */
+	pb->start = start;
+	pb->end = end;
+	if(pb->now < start || pb->now >= end)
+		pb->now = start;
+
+	if(pb->timer == 0) {
+		pb->last_tick = g_get_monotonic_time();
+		pb->timer = g_timeout_add(PLAYBACK_TICK, (GSourceFunc)playback_tick, pb);
+	}
+	playback_move_cursors(pb);
+}
+
+void
+playback_stop(struct MapView *mapview) {
+	struct Playback *pb = mapview->playback;
+
+	if(pb == NULL || pb->timer == 0)
+		return;
+	g_source_remove(pb->timer);
+	pb->timer = 0;
+}
+
+void
+playback_set_speed(struct MapView *mapview, double factor) {
+	struct Playback *pb = mapview->playback;
+
+	if(pb == NULL)
+		return;
+	pb->speed = CLAMP(pb->speed * factor, 1.0, 100000.0);
+	playback_update_label(pb);
+}
+
+/* Call after the view's layers were freed */
+void
+playback_free(struct MapView *mapview) {
+	struct Playback *pb = mapview->playback;
+
+	if(pb == NULL)
+		return;
+	playback_stop(mapview);
+	gmap_free(pb->drawn);
+	gmap_free(pb);
+	mapview->playback = NULL;
+}
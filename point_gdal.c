@@ -7,8 +7,22 @@
 #include <ogr_api.h>
 #include <cpl_conv.h>
 
+/* layer->priv of a trackset */
+struct TracksetTargetdata {
+	struct TreeNode	*tree;
+	bool		has_extents;
+	struct GeoRect	extents;	/* of the points, in target coordinates */
+};
+
+static const struct LayerOps trackset_layer_ops;
+
+/*
+ * The point in target pixels. *in_target is set if it could be put in
+ * the target projection, even where it has no pixel.
+ */
 static bool
-point_calc_mapview_data(struct Point *point, const struct RenderTarget *target, OGRCoordinateTransformationH xform, int *x, int *y) {
+point_calc_mapview_data(struct Point *point, const struct RenderTarget *target, OGRCoordinateTransformationH xform, int *x, int *y,
+	bool *in_target, double *target_x, double *target_y) {
 	double geo_x, geo_y;
 	double screen_x, screen_y;
 
@@ -20,6 +34,11 @@ point_calc_mapview_data(struct Point *point, const struct RenderTarget *target,
 	if(xform != NULL && !OCTTransform(xform, 1, &geo_x, &geo_y, NULL)) {
 		return FALSE;
 	}
+	if(in_target != NULL) {
+		*in_target = TRUE;
+		*target_x = geo_x;
+		*target_y = geo_y;
+	}
 
 	if(!geo_to_pixel_xy(target->GeoTransform, geo_x, geo_y, &screen_x, &screen_y)) {
 	 	return FALSE;
@@ -31,15 +50,49 @@ point_calc_mapview_data(struct Point *point, const struct RenderTarget *target,
 	return TRUE;
 }
 
+/* Grow the extents by a point in target coordinates */
+static void
+extents_add(struct TracksetTargetdata *priv, double x, double y) {
+	if(!priv->has_extents) {
+		priv->has_extents = TRUE;
+		priv->extents.left = priv->extents.right = x;
+		priv->extents.top = priv->extents.bottom = y;
+		return;
+	}
+	priv->extents.left = MIN(priv->extents.left, x);
+	priv->extents.right = MAX(priv->extents.right, x);
+	priv->extents.top = MIN(priv->extents.top, y);
+	priv->extents.bottom = MAX(priv->extents.bottom, y);
+}
+
+static void
+trackset_free_target_data(struct Layer *layer, const struct RenderTarget *target) {
+	struct TracksetTargetdata *priv = (struct TracksetTargetdata *)layer->priv;
+
+	if(priv == NULL)
+		return;
+	free_tree(priv->tree);
+	gmap_free(priv);
+	layer->priv = NULL;
+}
+
+/*
+ * The segment tree, and the extents of the points on the way: every
+ * point counts, the extremes on the target need not be on the lon/lat
+ * bounding box (180 meridian, azimuthal projections)
+ */
 void
 trackset_calc_target_data(struct Layer *layer, const struct RenderTarget *target) {
 	int i, j, k;
-	bool t1, t2;
+	bool t1, t2, in_target;
 	int x1, x2, y1, y2;
-	struct TrackPoint *p1, *p2;
+	int i1;
+	double tx, ty;
+	struct Point p2;
 	OGRSpatialReferenceH osrsSrc, osrsDst;
 	OGRCoordinateTransformationH xform;
 	struct TrackSet *trackset = (struct TrackSet *)layer->data;
+	struct TracksetTargetdata *priv;
 
 	osrsSrc = OSRNewSpatialReference(NULL);
 	OSRSetWellKnownGeogCS(osrsSrc, "WGS84");
@@ -48,32 +101,39 @@ trackset_calc_target_data(struct Layer *layer, const struct RenderTarget *target
 	OSRDestroySpatialReference(osrsDst);
 	OSRDestroySpatialReference(osrsSrc);
 
-	free_tree(layer->priv);
+	trackset_free_target_data(layer, target);
 
-	layer->priv = new_branch(0, target->height, 0, target->width);
+	priv = layer->priv = (struct TracksetTargetdata *)gmap_malloc0(sizeof(struct TracksetTargetdata));
+	priv->tree = new_branch(0, target->height, 0, target->width);
 
 	for(i = 0; i < trackset->count; i++) {
 		for(j = 0; j < trackset->tracks[i].count; j++) {
+			struct TrackSeg *seg = &trackset->tracks[i].tracksegments[j];
+
 			t1 = t2 = FALSE;
-			p1 = p2 = NULL;
-			for(k = 0; k < trackset->tracks[i].tracksegments[j].count; k++) {
+			i1 = -1;
+			for(k = 0; k < seg->count; k++) {
 
-				p2 = &trackset->tracks[i].tracksegments[j].trackpoints[k];
-				t2 = point_calc_mapview_data(&p2->point, target, xform, &x2, &y2);
+				trackseg_get_latlon(seg, k, &p2.geo_lat, &p2.geo_lon);
+				in_target = FALSE;
+				t2 = point_calc_mapview_data(&p2, target, xform, &x2, &y2, &in_target, &tx, &ty);
+				if(in_target)
+					extents_add(priv, tx, ty);
 
 				if(t1 && t2) {
 					if(x1 == x2 && y1 == y2)
 						continue;
 					tree_add_segment(
-						layer->priv,
+						priv->tree,
 						&trackset->tracks[i],
+						seg,
 						x1, y1, x2, y2,
-						p1, p2);
+						i1, k);
 				}
 				x1 = x2;
 				y1 = y2;
 				t1 = t2;
-				p1 = p2;
+				i1 = k;
 			}
 		}
 	}
@@ -83,57 +143,23 @@ trackset_calc_target_data(struct Layer *layer, const struct RenderTarget *target
 	OCTDestroyCoordinateTransformation(xform);
 }
 
+/* The extents of the points of a trackset layer, in target coordinates, from its target data */
 bool
-trackset_calc_extents(struct TrackSet *trackset, const struct RenderTarget *target, struct GeoRect *rect) {
-	int i, j, k;
-	struct TrackPoint *p;
-	OGRSpatialReferenceH osrsSrc, osrsDst;
-	OGRCoordinateTransformationH xform;
-	double geo_x, geo_y;
-
-	bool first = TRUE;
-
-	osrsSrc = OSRNewSpatialReference(NULL);
-	OSRSetWellKnownGeogCS(osrsSrc, "WGS84");
-	osrsDst = OSRNewSpatialReference(target->WKT);
-	xform = OCTNewCoordinateTransformation(osrsSrc, osrsDst);
-	OSRDestroySpatialReference(osrsDst);
-	OSRDestroySpatialReference(osrsSrc);
+trackset_calc_extents(const struct Layer *layer, struct GeoRect *rect) {
+	const struct TracksetTargetdata *priv = (const struct TracksetTargetdata *)layer->priv;
 
-	rect->left = rect->right = rect->top = rect->bottom = 0.0;
-	for(i = 0; i < trackset->count; i++) {
-		for(j = 0; j < trackset->tracks[i].count; j++) {
-			for(k = 0; k < trackset->tracks[i].tracksegments[j].count; k++) {
-				p = &trackset->tracks[i].tracksegments[j].trackpoints[k];
-				/* The point is in geographic lon/lat coordinates */
-				geo_x = p->point.geo_lon;
-				geo_y = p->point.geo_lat;
-				/* Transfom it to screen projection */
-				if(xform != NULL && !OCTTransform(xform, 1, &geo_x, &geo_y, NULL)) {
-					continue;
-				}
-				if(first) {
-					first = FALSE;
-					rect->left = rect->right = geo_x;
-					rect->top = rect->bottom = geo_y;
-				}
-				else {
-					if(rect->left > geo_x)
-						rect->left = geo_x;
-					if(rect->right < geo_x)
-						rect->right = geo_x;
-					if(rect->top > geo_y)
-						rect->top = geo_y;
-					if(rect->bottom < geo_y)
-						rect->bottom = geo_y;
-				}
-			}
-		}
-	}
-
-	OCTDestroyCoordinateTransformation(xform);
+	if(priv == NULL || !priv->has_extents)
+		return FALSE;
+	*rect = priv->extents;
+	return TRUE;
+}
 
-	return !first;
+/* The tree of a LAYER_IS_TREE_SEARCHABLE layer */
+struct TreeNode *
+pointset_tree(const struct Layer *layer) {
+	if(layer->ops == &trackset_layer_ops)
+		return ((const struct TracksetTargetdata *)layer->priv)->tree;
+	return (struct TreeNode *)layer->priv;
 }
 
 static void
@@ -161,7 +187,7 @@ waypointset_calc_target_data(struct Layer *layer, const struct RenderTarget *tar
 
 	for(i = 0; i < waypointset->count; i++) {
 		bool t1;
-		t1 = point_calc_mapview_data(&waypointset->waypoints[i].point, target, xform, &x1, &y1);
+		t1 = point_calc_mapview_data(&waypointset->waypoints[i].point, target, xform, &x1, &y1, NULL, NULL, NULL);
 				
 		if(t1) {
 			tree_add_waypoint(layer->priv,
@@ -178,7 +204,7 @@ waypointset_calc_target_data(struct Layer *layer, const struct RenderTarget *tar
 static void
 trackset_render_layer(const struct Layer *layer, const struct RenderContext *rc) {
 	// struct TrackSet *trackset = (struct TrackSet *)layer->data;
-	tree_to_pixmap(layer->priv, rc->rt, rc->ct, rc->x, rc->y, rc->w, rc->h);
+	RENDER_COUNT_OBJECTS(rc, tree_to_pixmap(pointset_tree(layer), rc));
 }
 
 static void
@@ -187,7 +213,7 @@ routeset_render_layer(const struct Layer *layer, const struct RenderContext *rc)
 static void
 waypointset_render_layer(const struct Layer *layer, const struct RenderContext *rc) {
 	// struct WayPointSet *waypointset = (struct WayPointSet *)layer->data;
-	tree_to_pixmap(layer->priv, rc->rt, rc->ct, rc->x, rc->y, rc->w, rc->h);
+	RENDER_COUNT_OBJECTS(rc, tree_to_pixmap(layer->priv, rc));
 }
 
 static void
@@ -199,7 +225,9 @@ XXset_free_target_data(struct Layer *layer, const struct RenderTarget *target) {
 static const struct LayerOps trackset_layer_ops = {
 	trackset_render_layer,
 	trackset_calc_target_data,
-	XXset_free_target_data,
+	trackset_free_target_data,
+	TRUE,
+	TRUE,
 };
 
 void
@@ -215,6 +243,8 @@ static const struct LayerOps routeset_layer_ops = {
 	routeset_render_layer,
 	routeset_calc_target_data,
 	XXset_free_target_data,
+	TRUE,
+	TRUE,
 };
 
 void
@@ -230,6 +260,8 @@ static const struct LayerOps waypointset_layer_ops = {
 	waypointset_render_layer,
 	waypointset_calc_target_data,
 	XXset_free_target_data,
+	TRUE,
+	TRUE,
 };
 
 void
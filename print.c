@@ -1,8 +1,105 @@
 #include "gmap.h"
 
+#define PRINT_BAND_HEIGHT	256	/* printer pixels rendered at a time */
+
+/*
+ * A page is rendered in horizontal bands by a pool of threads. Bands
+ * are queued in page order, at most max_ahead of them beyond the one
+ * being painted, so memory stays at a few bands whatever the page
+ * size, and the next page is being rendered while this one is spooled.
+ *
+ * Only the layers up to the last raster one go through the bands;
+ * vector layers above it draw directly on the print context, which
+ * keeps them sharp and the spool file small.
+ *
+ * If some layer in the bands is not thread safe there is no pool, each
+ * band is rendered by the printing thread when it is needed.
+ */
+struct PrintBand {
+	int		page;
+	int		y, h;		/* rows of the page */
+	cairo_surface_t *cs;		/* NULL until rendered */
+};
+
+struct PrintJob {
+	struct RenderTarget *target;
+	int		n_raster;	/* layers rendered in bands */
+	double		width, height;	/* page size in target pixels */
+	int		page_w, page_h;
+	int		ncols, npages;
+	int		bands_per_page;
+	int		next;		/* next band to queue, from the first page */
+	guint		max_ahead;
+	GQueue		*queue;		/* bands queued, in order */
+	GThreadPool	*pool;		/* NULL to render the bands here */
+	GMutex		lock;
+	GCond		band_done;
+};
+
+static void
+render_band(gpointer data, gpointer user_data) {
+	struct PrintBand *band = (struct PrintBand *)data;
+	struct PrintJob *job = (struct PrintJob *)user_data;
+	int col = band->page % job->ncols;
+	int row = band->page / job->ncols;
+	cairo_surface_t *cs;
+	cairo_t *ct;
+
+	cs = cairo_image_surface_create(CAIRO_FORMAT_RGB24, job->page_w, band->h);
+	ct = cairo_create(cs);
+	target_render_layers(job->target, ct,
+		(int)(col * job->width), (int)(row * job->height) + band->y,
+		job->page_w, band->h, 0, job->n_raster);
+	cairo_destroy(ct);
+	cairo_surface_flush(cs);
+
+	g_mutex_lock(&job->lock);
+	band->cs = cs;
+	g_cond_broadcast(&job->band_done);
+	g_mutex_unlock(&job->lock);
+}
+
+/* job->lock must be held */
+static void
+queue_bands(struct PrintJob *job) {
+	struct PrintBand *band;
+
+	while(g_queue_get_length(job->queue) < job->max_ahead &&
+	      job->next < job->npages * job->bands_per_page) {
+		band = (struct PrintBand *)gmap_malloc(sizeof(struct PrintBand));
+		band->page = job->next / job->bands_per_page;
+		band->y = (job->next % job->bands_per_page) * PRINT_BAND_HEIGHT;
+		band->h = MIN(PRINT_BAND_HEIGHT, job->page_h - band->y);
+		band->cs = NULL;
+		g_queue_push_tail(job->queue, band);
+		if(job->pool != NULL)
+			g_thread_pool_push(job->pool, band, NULL);
+		job->next++;
+	}
+}
+
+/* job->lock must be held */
 static void
-begin_print_callback(GtkPrintOperation *op, GtkPrintContext *context, struct RenderTarget *target) {
-	int ncols, nrows;
+wait_band(struct PrintJob *job, struct PrintBand *band) {
+	if(job->pool == NULL && band->cs == NULL) {
+		g_mutex_unlock(&job->lock);
+		render_band(band, job);
+		g_mutex_lock(&job->lock);
+	}
+	while(band->cs == NULL)
+		g_cond_wait(&job->band_done, &job->lock);
+}
+
+static void
+free_band(struct PrintBand *band) {
+	cairo_surface_destroy(band->cs);
+	gmap_free(band);
+}
+
+static void
+begin_print_callback(GtkPrintOperation *op, GtkPrintContext *context, struct PrintJob *job) {
+	struct RenderTarget *target = job->target;
+	int nrows;
 
 	gdouble width = gtk_print_context_get_width (context);
 	gdouble height = gtk_print_context_get_height(context);
@@ -11,69 +108,108 @@ begin_print_callback(GtkPrintOperation *op, GtkPrintContext *context, struct Ren
 
 	g_message("begin_print_callback w=%f h=%f dpi_x=%f dpi_y=%f", width, height, dpi_x, dpi_y);
 
-	ncols = (int)ceil(target->width/width);
+	job->width = width;
+	job->height = height;
+	job->page_w = (int)ceil(width);
+	job->page_h = (int)ceil(height);
+	job->ncols = (int)ceil(target->width/width);
 	nrows = (int)ceil(target->height/height);
+	job->npages = nrows*job->ncols;
+
+	job->n_raster = target_raster_layers(target);
+	/* No bands at all if everything is vector */
+	job->bands_per_page = job->n_raster ?
+		(job->page_h + PRINT_BAND_HEIGHT - 1) / PRINT_BAND_HEIGHT : 0;
+	job->next = 0;
+	job->queue = g_queue_new();
+	if(target_layers_thread_safe(target, 0, job->n_raster)) {
+		job->max_ahead = 2 * g_get_num_processors();
+		job->pool = g_thread_pool_new(render_band, job, g_get_num_processors(), TRUE, NULL);
+	}
+	else {
+		job->max_ahead = 1;
+		job->pool = NULL;
+	}
 
-	gtk_print_operation_set_n_pages(op, nrows*ncols);
+	gtk_print_operation_set_n_pages(op, job->npages);
 }
 
 static void
-draw_page_callback(GtkPrintOperation *op, GtkPrintContext *context, gint page_nr, struct RenderTarget *target) {
+draw_page_callback(GtkPrintOperation *op, GtkPrintContext *context, gint page_nr, struct PrintJob *job) {
 	cairo_t *cr;
-	int ncols, col, row;
+	struct PrintBand *band;
+	int col = page_nr % job->ncols;
+	int row = page_nr / job->ncols;
 	int i;
-	struct RenderContext rc;
-	cairo_surface_t *temp_surface;
-	cairo_t *temp;
 
-	gdouble width = gtk_print_context_get_width (context);
-	gdouble height = gtk_print_context_get_height(context);
-	//gdouble dpi_x = gtk_print_context_get_dpi_x(context);
-	//gdouble dpi_y = gtk_print_context_get_dpi_y(context);
-
-	ncols = (int)ceil(target->width/width);
-
-	col = page_nr % ncols;
-	row = page_nr / ncols;
-  
 	// g_message("draw_page_callback page=%d col=%d row=%d", page_nr, col, row);
 
 	cr = gtk_print_context_get_cairo_context (context);
 
-	temp_surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, (int)ceil(width), (int)ceil(height));
-	temp = cairo_create(temp_surface);
+	g_mutex_lock(&job->lock);
 
-	rc.rt = target;
-	rc.cs = temp_surface;
-	rc.ct = temp;
-	rc.x = (int)(col * width);
-	rc.y = (int)(row * height);
-	rc.w = (int)ceil(width);
-	rc.h = (int)ceil(height);
+	/* Pages need not come in order (page ranges, reverse, copies) */
+	while(!g_queue_is_empty(job->queue) &&
+	      ((struct PrintBand *)g_queue_peek_head(job->queue))->page != page_nr) {
+		band = (struct PrintBand *)g_queue_pop_head(job->queue);
+		if(job->pool != NULL)
+			wait_band(job, band);	/* a thread has it */
+		free_band(band);
+	}
+	if(g_queue_is_empty(job->queue))
+		job->next = page_nr * job->bands_per_page;
 
-	for(i = 0; i < target->n_layers; i++) {
-		if(!(target->layers[i].flags & LAYER_IS_VISIBLE))
-			continue;
+	for(i = 0; i < job->bands_per_page; i++) {
+		queue_bands(job);
+		band = (struct PrintBand *)g_queue_pop_head(job->queue);
+		wait_band(job, band);
+		g_mutex_unlock(&job->lock);
 
-		(*target->layers[i].ops->render_layer)(&target->layers[i], &rc);
-	}
+		cairo_set_source_surface(cr, band->cs, 0, band->y);
+		cairo_paint(cr);
+		free_band(band);
 
-	// char fname[100];
-	// sprintf(fname, "tmp_map_%03d_%03d_%03d.png", page_nr, col, row);
-	// cairo_surface_write_to_png(temp_surface, fname);
+		g_mutex_lock(&job->lock);
+	}
 
-	cairo_set_source_surface(cr, temp_surface, 0, 0);
-	cairo_paint(cr);
+	/* Start on the next page while this one is spooled */
+	queue_bands(job);
+	g_mutex_unlock(&job->lock);
+
+	if(job->n_raster < job->target->n_layers) {
+		cairo_save(cr);
+		cairo_rectangle(cr, 0, 0, job->page_w, job->page_h);
+		cairo_clip(cr);
+		target_render_layers(job->target, cr,
+			(int)(col * job->width), (int)(row * job->height),
+			job->page_w, job->page_h, job->n_raster, job->target->n_layers);
+		cairo_restore(cr);
+	}
+}
 
-	// cairo_destroy(cr);
-	cairo_destroy(temp);
-	cairo_surface_destroy(temp_surface);
+static void
+end_print_callback(GtkPrintOperation *op, GtkPrintContext *context, struct PrintJob *job) {
+	struct PrintBand *band;
+
+	/* Let the threads finish whatever was queued */
+	if(job->pool != NULL)
+		g_thread_pool_free(job->pool, FALSE, TRUE);
+	while((band = (struct PrintBand *)g_queue_pop_head(job->queue)) != NULL)
+		free_band(band);
+	g_queue_free(job->queue);
+	job->pool = NULL;
+	job->queue = NULL;
 }
 
 static GtkPrintSettings *settings = NULL;
 static GtkPageSetup *page_setup = NULL;
 
-void
+/*
+ * The copy shares the view's per-target layer data instead of
+ * computing it again; it must be freed with FreeTarget(), and the
+ * view must not change while the copy is in use.
+ */
+static void
 CopyTarget(struct RenderTarget *dest, struct RenderTarget *src) {
 	int i;
 
@@ -81,10 +217,17 @@ CopyTarget(struct RenderTarget *dest, struct RenderTarget *src) {
 	dest->right = src->right;
 	dest->top = src->top;
 	dest->bottom = src->bottom;
+	dest->width = src->width;
+	dest->height = src->height;
+	memcpy(dest->GeoTransform, src->GeoTransform, sizeof(dest->GeoTransform));
 	dest->WKT = gmap_strdup(src->WKT);
+	dest->scale = src->scale;
 	dest->rotation = src->rotation;
 	dest->x_resulution = src->x_resulution;
-	dest->y_resulution = src->x_resulution;
+	dest->y_resulution = src->y_resulution;
+	dest->warp_error = src->warp_error;
+	dest->layer_changed = NULL;
+	dest->layer_changed_data = NULL;
 	dest->n_layers = 0;
 	dest->layers = NULL;
 
@@ -96,10 +239,19 @@ CopyTarget(struct RenderTarget *dest, struct RenderTarget *src) {
 		ld->type = ls->type;
 		ld->flags = ls->flags;
 		ld->data = ls->data;
-		ld->priv = NULL;
+		ld->priv = ls->priv;
 	}
+}
+
+/* Free a CopyTarget() copy, the layer data belongs to the view */
+static void
+FreeTarget(struct RenderTarget *target) {
+	int i;
 
-	target_set_scale(dest, src->scale);
+	gmap_free(target->WKT);
+	for(i = 0; i < target->n_layers; i++)
+		layer_free_stats(&target->layers[i]);
+	gmap_free(target->layers);
 }
 
 void
@@ -108,24 +260,43 @@ do_print(struct MapView *mapview) {
 	//GtkPrintOperationResult res;
 	GError *err = NULL;
 	struct RenderTarget rt;
+	struct PrintJob job;
 
 	CopyTarget(&rt, &mapview->rt);
 
+	job.target = &rt;
+	job.pool = NULL;
+	job.queue = NULL;
+	g_mutex_init(&job.lock);
+	g_cond_init(&job.band_done);
+
 	op = gtk_print_operation_new();
 
 	gtk_print_operation_set_print_settings(op, settings);
 	gtk_print_operation_set_default_page_setup(op, page_setup);
 	gtk_print_operation_set_show_progress(op, TRUE);
 
-	g_signal_connect(op, "begin-print", G_CALLBACK(begin_print_callback), &rt);
-	g_signal_connect(op, "draw-page", G_CALLBACK(draw_page_callback), &rt);
+	g_signal_connect(op, "begin-print", G_CALLBACK(begin_print_callback), &job);
+	g_signal_connect(op, "draw-page", G_CALLBACK(draw_page_callback), &job);
+	g_signal_connect(op, "end-print", G_CALLBACK(end_print_callback), &job);
+
+	/* The view's layer data is in use until printing is done */
+	gtk_widget_set_sensitive(mapview->window, FALSE);
 
 	/*res =*/ gtk_print_operation_run(op, GTK_PRINT_OPERATION_ACTION_PRINT_DIALOG, 
 					GTK_WINDOW(mapview->window), &err);
 
 	/* DO not allow background-printing! */
 
-	target_free_data(&rt);
+	gtk_widget_set_sensitive(mapview->window, TRUE);
+
+	if(job.pool != NULL)
+		end_print_callback(op, NULL, &job);
+	g_object_unref(op);
+	g_mutex_clear(&job.lock);
+	g_cond_clear(&job.band_done);
+
+	FreeTarget(&rt);
 } 
 
 void
@@ -1444,6 +1444,7 @@ set_mapview_projection(struct ProjectionData *p, struct MapView *mapview) {
 
 	g_message("GDAL suggested: w=%d h=%d ext=%f %f %f %f)", width, height, extents[0], extents[1], extents[2], extents[3]);
 
+	mapview_redraw_sync(mapview);
 	if(mapview->rt.WKT)
 		gmap_free(mapview->rt.WKT);
 
@@ -1456,7 +1457,7 @@ set_mapview_projection(struct ProjectionData *p, struct MapView *mapview) {
 
 	mapview_set_scale(mapview, GeoTransform[1] / factor);
 	mapview_changed_projection(mapview);
-	gtk_widget_queue_draw(mapview->layout);
+	mapview_queue_redraw(mapview);
 
 	GDALDestroyGenImgProjTransformer(hTransformArg);
 	GDALClose(fakeds);
@@ -0,0 +1,993 @@
+/*
+ * redraw.c
+ * Copyright (C) 2007 Itai Nahshon
+ *
+ * Frame scheduler of the map view. Exposes are painted from a frame
+ * surface that holds the composited layers of the visible area and a
+ * margin around it, so small scrolls and exposes after a popup closes
+ * only copy pixels that were rendered already. Changes
+ * are only recorded as damage; the damage is rendered at most once per
+ * frame interval, tile by tile, from the main loop. When the damage can
+ * not be rendered before the frame deadline the rest is left for the
+ * next frame, so input is still handled while a slow render goes on.
+ * Visible damage is rendered first, the margin when nothing else is left.
+ *
+ * The layers are cached in groups over the frame area: the layers up to
+ * the last raster one render together into an opaque surface, and each
+ * vector layer above them into a transparent surface of its own. The
+ * frame is the composite of the groups, so showing or hiding a vector
+ * layer, or changing one, leaves the other groups alone.
+ *
+ * Groups whose layers are all thread safe render on a pool of threads;
+ * the tile is composited when the result is back on the main loop.
+ * A render that goes stale before it is done, because its part of the
+ * layer changed again or the frame moved away, is cancelled and stops
+ * at the next object it would draw. Before layer data is changed on
+ * the main thread, mapview_redraw_sync() waits for the renders in flight.
+ *
+ * Zooming does not render anything until the zoom settles: meanwhile
+ * the frame as it was when the zoom started is shown scaled, animated
+ * from the old scale to the new one.
+ */
+
+#include "gmap.h"
+
+#define FRAME_INTERVAL	16666	/* usec */
+#define REDRAW_TILE	128	/* pixels, tiles are aligned to the layout */
+#define REDRAW_MARGIN	256	/* pixels rendered around the visible area */
+#define ZOOM_TIME	150000	/* usec, animation of one zoom step */
+#define ZOOM_SETTLE	250000	/* usec after the last zoom step to render */
+
+struct LayerCache {
+	int		first, last;	/* layers first..last-1 */
+	bool		opaque;		/* has raster layers, RGB24 */
+	bool		shown;		/* some layer was visible at the last sync */
+	cairo_surface_t	*cs;		/* same area as the frame */
+	GdkRegion	*damage;	/* part of the area to render again */
+};
+
+/* A group of layers rendering a tile on the pool */
+struct RenderJob {
+	struct MapView	*mapview;	/* NULL once cancelled */
+	struct RenderTarget *rt;
+	int		first, last;	/* the group */
+	bool		opaque;
+	GdkRectangle	tile;
+	gint		cancel;
+	bool		done;		/* rendered to the end */
+	cairo_surface_t	*cs;		/* tile sized */
+};
+
+struct Redraw {
+	cairo_surface_t	*frame;		/* composited layers, RGB24 */
+	GdkRectangle	view;		/* visible part of the layout */
+	GdkRectangle	area;		/* part of the layout held in frame, has view */
+	GdkRegion	*damage;	/* part of area still to composite */
+	struct LayerCache *caches;	/* bottom to top */
+	int		n_caches;
+	guint		tick;		/* pending frame source */
+	gint64		last_frame;	/* when the last frame started */
+	int		frames;		/* frames that rendered something */
+	int		missed;		/* frames that ran past their deadline */
+	int		dropped;	/* damage replaced before it rendered */
+	gint64		reused;		/* pixels kept when the frame moved */
+	int		cancelled;	/* renders that went stale in flight */
+
+	/* Renders off the main thread */
+	GThreadPool	*pool;
+	GList		*jobs;		/* in flight, main thread only */
+	GMutex		lock;
+	GCond		idle;
+	int		running;	/* jobs the pool did not finish */
+
+	/* Zoom in progress, rt still has the scale of the snapshot */
+	cairo_surface_t	*snapshot;	/* the frame when the zoom started */
+	GdkRectangle	snapshot_area;
+	double		zoom_from;	/* shown scale when the last step started */
+	double		zoom_to;	/* scale asked for */
+	double		anchor_x;	/* this snapshot pixel */
+	double		anchor_y;
+	double		dpy_x;		/* is shown at this viewport pixel */
+	double		dpy_y;
+	gint64		zoom_start;	/* of the last step */
+	guint		zoom_tick;
+};
+
+static gboolean redraw_tick(gpointer data);
+static void layer_changed(struct RenderTarget *target, int layer, int x, int y, int w, int h, void *data);
+static void render_job(gpointer data, gpointer user_data);
+static void schedule_frame(struct MapView *mapview);
+
+static void
+free_cache(struct LayerCache *c) {
+	cairo_surface_destroy(c->cs);
+	gdk_region_destroy(c->damage);
+}
+
+void
+mapview_redraw_init(struct MapView *mapview) {
+	struct Redraw *r;
+
+	r = mapview->redraw = (struct Redraw *)gmap_malloc0(sizeof(struct Redraw));
+	r->damage = gdk_region_new();
+	g_mutex_init(&r->lock);
+	g_cond_init(&r->idle);
+	/* without threads everything renders on the main loop */
+	r->pool = g_thread_pool_new(render_job, r, g_get_num_processors(), FALSE, NULL);
+	mapview->rt.layer_changed = layer_changed;
+	mapview->rt.layer_changed_data = mapview;
+}
+
+static void
+free_job(struct RenderJob *job) {
+	if(job->cs != NULL)
+		cairo_surface_destroy(job->cs);
+	gmap_free(job);
+}
+
+/* The job was rendered, or cancelled, in the pool */
+static gboolean
+job_done(gpointer data) {
+	struct RenderJob *job = (struct RenderJob *)data;
+	struct MapView *mapview = job->mapview;
+	struct Redraw *r;
+	GdkRegion *done;
+	cairo_t *ct;
+	int i;
+
+	if(mapview == NULL) {
+		free_job(job);
+		return FALSE;
+	}
+	r = mapview->redraw;
+	r->jobs = g_list_remove(r->jobs, job);
+
+	/* the groups may have changed since */
+	for(i = 0; i < r->n_caches && job->done; i++) {
+		struct LayerCache *c = &r->caches[i];
+		if(c->first != job->first || c->last != job->last || c->opaque != job->opaque)
+			continue;
+
+		ct = cairo_create(c->cs);
+		cairo_set_operator(ct, CAIRO_OPERATOR_SOURCE);
+		cairo_set_source_surface(ct, job->cs, job->tile.x - r->area.x, job->tile.y - r->area.y);
+		cairo_rectangle(ct, job->tile.x - r->area.x, job->tile.y - r->area.y, job->tile.width, job->tile.height);
+		cairo_fill(ct);
+		cairo_destroy(ct);
+
+		done = gdk_region_rectangle(&job->tile);
+		gdk_region_subtract(c->damage, done);
+		gdk_region_destroy(done);
+		break;
+	}
+	free_job(job);
+
+	/* the frame damage of the tile is still there */
+	schedule_frame(mapview);
+	return FALSE;
+}
+
+static void
+render_job(gpointer data, gpointer user_data) {
+	struct RenderJob *job = (struct RenderJob *)data;
+	struct Redraw *r = (struct Redraw *)user_data;
+	cairo_t *ct;
+
+	/* The view is not touched here; the main thread waits for the pool
+	   before it changes the target or the layers */
+	if(!g_atomic_int_get(&job->cancel)) {
+		TRACE_BEGIN("redraw_job", NULL);
+		job->cs = cairo_image_surface_create(job->opaque ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32,
+			job->tile.width, job->tile.height);
+		ct = cairo_create(job->cs);
+		job->done = target_render_layers_cancellable(job->rt, ct,
+			job->tile.x, job->tile.y, job->tile.width, job->tile.height,
+			job->first, job->last, &job->cancel, 0);
+		cairo_destroy(ct);
+		cairo_surface_flush(job->cs);
+		TRACE_END("redraw_job");
+	}
+
+	g_idle_add(job_done, job);
+
+	g_mutex_lock(&r->lock);
+	r->running--;
+	g_cond_broadcast(&r->idle);
+	g_mutex_unlock(&r->lock);
+}
+
+static void
+cancel_job(struct Redraw *r, struct RenderJob *job) {
+	g_atomic_int_set(&job->cancel, 1);
+	job->mapview = NULL;
+	r->jobs = g_list_remove(r->jobs, job);
+	r->cancelled++;
+}
+
+/*
+ * Cancel the jobs of the groups that have any of the layers first..last-1
+ * and a tile that meets rect, or all of them if rect is NULL
+ */
+static void
+cancel_jobs(struct Redraw *r, int first, int last, const GdkRectangle *rect) {
+	GList *l, *next;
+	GdkRectangle box;
+
+	for(l = r->jobs; l != NULL; l = next) {
+		struct RenderJob *job = (struct RenderJob *)l->data;
+
+		next = l->next;
+		if(job->last <= first || job->first >= last)
+			continue;
+		if(rect == NULL || gdk_rectangle_intersect(&job->tile, rect, &box))
+			cancel_job(r, job);
+	}
+}
+
+/*
+ * Wait until nothing of the view renders off the main thread. Must be
+ * called before the target or the data of its layers change.
+ */
+void
+mapview_redraw_sync(struct MapView *mapview) {
+	struct Redraw *r = mapview->redraw;
+
+	if(r == NULL)
+		return;
+	cancel_jobs(r, 0, G_MAXINT, NULL);
+	g_mutex_lock(&r->lock);
+	while(r->running > 0)
+		g_cond_wait(&r->idle, &r->lock);
+	g_mutex_unlock(&r->lock);
+}
+
+void
+mapview_redraw_free(struct MapView *mapview) {
+	struct Redraw *r = mapview->redraw;
+	int i;
+
+	/* jobs that are done wait for the main loop, they are only freed */
+	mapview_redraw_sync(mapview);
+	if(r->pool != NULL)
+		g_thread_pool_free(r->pool, FALSE, TRUE);
+	g_mutex_clear(&r->lock);
+	g_cond_clear(&r->idle);
+
+	if(r->tick)
+		g_source_remove(r->tick);
+	if(r->zoom_tick)
+		g_source_remove(r->zoom_tick);
+	if(r->snapshot)
+		cairo_surface_destroy(r->snapshot);
+	if(r->frame)
+		cairo_surface_destroy(r->frame);
+	for(i = 0; i < r->n_caches; i++)
+		free_cache(&r->caches[i]);
+	gmap_free(r->caches);
+	gdk_region_destroy(r->damage);
+	gmap_free(r);
+	mapview->redraw = NULL;
+}
+
+/* Tiles that wait for the pool */
+static GdkRegion *
+pending_region(const struct Redraw *r) {
+	GdkRegion *pending = gdk_region_new();
+	GList *l;
+
+	for(l = r->jobs; l != NULL; l = l->next)
+		gdk_region_union_with_rect(pending, &((struct RenderJob *)l->data)->tile);
+	return pending;
+}
+
+static void
+schedule_frame(struct MapView *mapview) {
+	struct Redraw *r = mapview->redraw;
+	GdkRegion *todo, *pending;
+	gint64 delay;
+	bool idle;
+
+	if(r->tick || gdk_region_empty(r->damage))
+		return;
+	/* the pool schedules the frame when the rest is back */
+	pending = pending_region(r);
+	todo = gdk_region_copy(r->damage);
+	gdk_region_subtract(todo, pending);
+	idle = gdk_region_empty(todo);
+	gdk_region_destroy(todo);
+	gdk_region_destroy(pending);
+	if(idle)
+		return;
+	delay = r->last_frame + FRAME_INTERVAL - g_get_monotonic_time();
+	r->tick = g_timeout_add(MAX(delay, 0) / 1000, redraw_tick, mapview);
+}
+
+static void
+fill_background(cairo_t *ct, const GdkRegion *region) {
+	gdk_cairo_region(ct, region);
+	cairo_set_source_rgb(ct, 1, 1, 1);
+	cairo_fill(ct);
+}
+
+static bool
+rect_contains(const GdkRectangle *outer, const GdkRectangle *inner) {
+	return inner->x >= outer->x && inner->y >= outer->y &&
+		inner->x + inner->width <= outer->x + outer->width &&
+		inner->y + inner->height <= outer->y + outer->height;
+}
+
+/*
+ * A surface like cs over area to, with the pixels it had over from.
+ * The pixels that are new are added to damage.
+ */
+static cairo_surface_t *
+move_surface(cairo_surface_t *cs, const GdkRectangle *from, const GdkRectangle *to, GdkRegion *damage) {
+	cairo_surface_t *moved;
+	GdkRegion *fresh, *kept;
+	cairo_t *ct;
+
+	moved = cairo_image_surface_create(cairo_image_surface_get_format(cs), to->width, to->height);
+	ct = cairo_create(moved);
+	cairo_translate(ct, -to->x, -to->y);
+
+	fresh = gdk_region_rectangle(to);
+	kept = gdk_region_rectangle(from);
+	gdk_region_intersect(kept, fresh);
+	gdk_region_subtract(fresh, kept);
+
+	cairo_save(ct);
+	gdk_cairo_region(ct, kept);
+	cairo_clip(ct);
+	cairo_set_operator(ct, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_surface(ct, cs, from->x, from->y);
+	cairo_paint(ct);
+	cairo_restore(ct);
+	if(cairo_image_surface_get_format(cs) == CAIRO_FORMAT_RGB24)
+		fill_background(ct, fresh);
+	cairo_destroy(ct);
+	cairo_surface_destroy(cs);
+
+	/* old damage that is still there is still damage */
+	gdk_region_intersect(damage, kept);
+	gdk_region_union(damage, fresh);
+	gdk_region_destroy(kept);
+	gdk_region_destroy(fresh);
+	return moved;
+}
+
+/*
+ * Keep the frame over the visible part of the layout. While the view
+ * stays inside the frame nothing changes; when it leaves, the frame is
+ * centered on it again and the pixels that are still in it are moved.
+ */
+static void
+follow_viewport(struct MapView *mapview) {
+	struct Redraw *r = mapview->redraw;
+	GdkRectangle view, area, box;
+	GList *l, *next;
+	cairo_t *ct;
+	int right, bottom, i;
+
+	view.x = (int)gtk_adjustment_get_value(mapview->hadjustment);
+	view.y = (int)gtk_adjustment_get_value(mapview->vadjustment);
+	view.width = mapview->allocation_width;
+	view.height = mapview->allocation_height;
+	if(view.width <= 0 || view.height <= 0)
+		return;
+	r->view = view;
+	if(r->frame != NULL && rect_contains(&r->area, &view))
+		return;
+
+	/* The margin is not needed past the edges of the layout */
+	area.x = MAX(view.x - REDRAW_MARGIN, 0);
+	area.y = MAX(view.y - REDRAW_MARGIN, 0);
+	right = MIN(view.x + view.width + REDRAW_MARGIN, MAX(mapview->rt.width, view.x + view.width));
+	bottom = MIN(view.y + view.height + REDRAW_MARGIN, MAX(mapview->rt.height, view.y + view.height));
+	area.width = right - area.x;
+	area.height = bottom - area.y;
+
+	if(r->frame == NULL) {
+		r->frame = cairo_image_surface_create(CAIRO_FORMAT_RGB24, area.width, area.height);
+		ct = cairo_create(r->frame);
+		cairo_set_source_rgb(ct, 1, 1, 1);
+		cairo_paint(ct);
+		cairo_destroy(ct);
+		gdk_region_union_with_rect(r->damage, &area);
+	}
+	else {
+		if(gdk_rectangle_intersect(&r->area, &area, &box))
+			r->reused += (gint64)box.width * box.height;
+
+		for(l = r->jobs; l != NULL; l = next) {
+			next = l->next;
+			if(!rect_contains(&area, &((struct RenderJob *)l->data)->tile))
+				cancel_job(r, (struct RenderJob *)l->data);
+		}
+		r->frame = move_surface(r->frame, &r->area, &area, r->damage);
+		for(i = 0; i < r->n_caches; i++)
+			r->caches[i].cs = move_surface(r->caches[i].cs, &r->area, &area, r->caches[i].damage);
+	}
+	r->area = area;
+}
+
+/* Layer contents changed, the whole view must be rendered again */
+void
+mapview_queue_redraw(struct MapView *mapview) {
+	struct Redraw *r = mapview->redraw;
+
+	int i;
+
+	cancel_jobs(r, 0, G_MAXINT, NULL);
+	if(!gdk_region_empty(r->damage))
+		r->dropped++;
+	gdk_region_destroy(r->damage);
+	r->damage = gdk_region_rectangle(&r->area);
+	for(i = 0; i < r->n_caches; i++) {
+		gdk_region_destroy(r->caches[i].damage);
+		r->caches[i].damage = gdk_region_rectangle(&r->area);
+	}
+	schedule_frame(mapview);
+}
+
+/* Layer i changed in rect, only its group is rendered again */
+static void
+damage_layer(struct MapView *mapview, int i, const GdkRectangle *rect) {
+	struct Redraw *r = mapview->redraw;
+	GdkRectangle visible;
+	int j;
+
+	if(!gdk_rectangle_intersect(rect, &r->area, &visible))
+		return;
+	cancel_jobs(r, i, i+1, &visible);
+	for(j = 0; j < r->n_caches; j++) {
+		if(i >= r->caches[j].first && i < r->caches[j].last)
+			gdk_region_union_with_rect(r->caches[j].damage, &visible);
+	}
+	gdk_region_union_with_rect(r->damage, &visible);
+	schedule_frame(mapview);
+}
+
+void
+mapview_queue_redraw_layer(struct MapView *mapview, int i) {
+	damage_layer(mapview, i, &mapview->redraw->area);
+}
+
+/* rt.layer_changed of the view */
+static void
+layer_changed(struct RenderTarget *target, int layer, int x, int y, int w, int h, void *data) {
+	struct MapView *mapview = (struct MapView *)data;
+	GdkRectangle rect;
+
+	/* maps that finished loading say so */
+	mapview_update_progress(mapview);
+	if(w <= 0 || h <= 0) {
+		mapview_queue_redraw_layer(mapview, layer);
+		return;
+	}
+	rect.x = x;
+	rect.y = y;
+	rect.width = w;
+	rect.height = h;
+	damage_layer(mapview, layer, &rect);
+}
+
+/* Only this part of the layout changed */
+void
+mapview_queue_redraw_area(struct MapView *mapview, int x, int y, int w, int h) {
+	struct Redraw *r = mapview->redraw;
+	GdkRectangle rect, visible;
+	int i;
+
+	rect.x = x;
+	rect.y = y;
+	rect.width = w;
+	rect.height = h;
+	if(!gdk_rectangle_intersect(&rect, &r->area, &visible))
+		return;
+	cancel_jobs(r, 0, G_MAXINT, &visible);
+	gdk_region_union_with_rect(r->damage, &visible);
+	for(i = 0; i < r->n_caches; i++)
+		gdk_region_union_with_rect(r->caches[i].damage, &visible);
+	schedule_frame(mapview);
+}
+
+static bool
+group_visible(const struct RenderTarget *rt, int first, int last) {
+	int i;
+
+	for(i = first; i < last; i++) {
+		if(rt->layers[i].flags & LAYER_IS_VISIBLE)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Match the caches to the layers. Groups that did not change keep their
+ * pixels; when anything changed the frame is composited again.
+ */
+static void
+sync_caches(struct MapView *mapview) {
+	struct Redraw *r = mapview->redraw;
+	struct RenderTarget *rt = &mapview->rt;
+	int base = target_raster_layers(rt);
+	int n = (base > 0) + rt->n_layers - base;
+	struct LayerCache *caches;
+	bool changed = (n != r->n_caches);
+	int i, j, first;
+
+	if(r->frame == NULL)
+		return;
+	caches = (struct LayerCache *)gmap_malloc0(n * sizeof(struct LayerCache));
+	for(i = 0, first = 0; i < n; i++) {
+		struct LayerCache *c = &caches[i];
+
+		c->first = first;
+		c->last = (i == 0 && base > 0) ? base : first+1;
+		first = c->last;
+		c->opaque = (c->first == 0 && base > 0);
+		c->shown = group_visible(rt, c->first, c->last);
+
+		for(j = 0; j < r->n_caches; j++) {
+			struct LayerCache *old = &r->caches[j];
+			if(old->cs != NULL && old->first == c->first && old->last == c->last) {
+				changed |= (old->shown != c->shown);
+				c->cs = old->cs;
+				c->damage = old->damage;
+				old->cs = NULL;
+				break;
+			}
+		}
+		if(c->cs == NULL) {
+			c->cs = cairo_image_surface_create(c->opaque ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32,
+				r->area.width, r->area.height);
+			c->damage = gdk_region_rectangle(&r->area);
+			changed = TRUE;
+		}
+	}
+	for(j = 0; j < r->n_caches; j++) {
+		if(r->caches[j].cs != NULL)
+			free_cache(&r->caches[j]);
+	}
+	gmap_free(r->caches);
+	r->caches = caches;
+	r->n_caches = n;
+
+	if(changed)
+		gdk_region_union_with_rect(r->damage, &r->area);
+}
+
+/*
+ * Layers were added, or shown or hidden. Only groups that are new need
+ * to render, the others are composited again.
+ */
+void
+mapview_layers_changed(struct MapView *mapview) {
+	sync_caches(mapview);
+	schedule_frame(mapview);
+}
+
+void
+mapview_show_layer(struct MapView *mapview, int i, bool visible) {
+	struct Layer *layer = &mapview->rt.layers[i];
+
+	if(visible == !!(layer->flags & LAYER_IS_VISIBLE))
+		return;
+	mapview_redraw_sync(mapview);
+	if(visible) {
+		layer->flags |= LAYER_IS_VISIBLE;
+		/* hidden layers miss target changes */
+		layer_calc_target_data(layer, &mapview->rt);
+	}
+	else
+		layer->flags &= ~LAYER_IS_VISIBLE;
+	mapview_layers_changed(mapview);
+	/* the other layers of its group stay, but the group changed */
+	mapview_queue_redraw_layer(mapview, i);
+}
+
+/*
+ * Scale or projection changed. Nothing in the frame is right anymore,
+ * it is cleared so old pixels do not show at the wrong place.
+ */
+void
+mapview_view_changed(struct MapView *mapview) {
+	struct Redraw *r = mapview->redraw;
+	cairo_t *ct;
+
+	if(r->frame != NULL) {
+		ct = cairo_create(r->frame);
+		cairo_set_source_rgb(ct, 1, 1, 1);
+		cairo_paint(ct);
+		cairo_destroy(ct);
+	}
+	mapview_queue_redraw(mapview);
+	if(GTK_WIDGET_REALIZED(mapview->layout))
+		gdk_window_invalidate_rect(GTK_LAYOUT(mapview->layout)->bin_window, &r->view, FALSE);
+}
+
+/* Scale shown at time now */
+static double
+zoom_scale(const struct Redraw *r, gint64 now) {
+	double t = (double)(now - r->zoom_start) / ZOOM_TIME;
+
+	if(t >= 1)
+		return r->zoom_to;
+	/* constant speed on a log scale looks smooth */
+	return r->zoom_from * pow(r->zoom_to / r->zoom_from, t);
+}
+
+/* The snapshot magnified by factor around the anchor, on a viewport sized ct */
+static void
+paint_zoomed(cairo_t *ct, const struct Redraw *r, double factor) {
+	cairo_save(ct);
+	cairo_set_source_rgb(ct, 1, 1, 1);
+	cairo_paint(ct);
+	cairo_translate(ct, r->dpy_x, r->dpy_y);
+	cairo_scale(ct, factor, factor);
+	cairo_translate(ct, -r->anchor_x, -r->anchor_y);
+	cairo_set_source_surface(ct, r->snapshot, 0, 0);
+	cairo_pattern_set_filter(cairo_get_source(ct), CAIRO_FILTER_GOOD);
+	cairo_paint(ct);
+	cairo_restore(ct);
+}
+
+/* Paint the exposed area from the frame, render what is missing later */
+gboolean
+mapview_redraw_expose(struct MapView *mapview, GdkEventExpose *event) {
+	struct Redraw *r = mapview->redraw;
+	cairo_t *ct;
+
+	follow_viewport(mapview);
+	if(r->frame == NULL)
+		return TRUE;
+
+	ct = gdk_cairo_create(GTK_LAYOUT(mapview->layout)->bin_window);
+	gdk_cairo_region(ct, event->region);
+	cairo_clip(ct);
+	if(r->snapshot != NULL) {
+		cairo_translate(ct, r->view.x, r->view.y);
+		paint_zoomed(ct, r, mapview->rt.scale / zoom_scale(r, g_get_monotonic_time()));
+	}
+	else {
+		cairo_set_source_surface(ct, r->frame, r->area.x, r->area.y);
+		cairo_paint(ct);
+	}
+	cairo_destroy(ct);
+
+	schedule_frame(mapview);
+	return TRUE;
+}
+
+static void
+render_group(struct MapView *mapview, struct LayerCache *c, const GdkRectangle *tile) {
+	struct Redraw *r = mapview->redraw;
+	GdkRegion *done = gdk_region_rectangle(tile);
+	cairo_surface_t *cs;
+	cairo_t *ct, *tct;
+
+	ct = cairo_create(c->cs);
+	cairo_translate(ct, tile->x - r->area.x, tile->y - r->area.y);
+	cairo_rectangle(ct, 0, 0, tile->width, tile->height);
+	cairo_clip(ct);
+	if(c->opaque) {
+		/* raster layers draw on an image of the tile */
+		cs = cairo_image_surface_create(CAIRO_FORMAT_RGB24, tile->width, tile->height);
+		tct = cairo_create(cs);
+		target_render_layers(&mapview->rt, tct, tile->x, tile->y, tile->width, tile->height, c->first, c->last);
+		cairo_destroy(tct);
+		cairo_set_source_surface(ct, cs, 0, 0);
+		cairo_paint(ct);
+		cairo_surface_destroy(cs);
+	}
+	else {
+		cairo_set_operator(ct, CAIRO_OPERATOR_CLEAR);
+		cairo_paint(ct);
+		cairo_set_operator(ct, CAIRO_OPERATOR_OVER);
+		target_render_layers(&mapview->rt, ct, tile->x, tile->y, tile->width, tile->height, c->first, c->last);
+	}
+	cairo_destroy(ct);
+
+	gdk_region_subtract(c->damage, done);
+	gdk_region_destroy(done);
+}
+
+/* Render the group's part of the tile on the pool, unless it is there already */
+static void
+queue_job(struct MapView *mapview, const struct LayerCache *c, const GdkRectangle *tile) {
+	struct Redraw *r = mapview->redraw;
+	struct RenderJob *job;
+	GList *l;
+
+	for(l = r->jobs; l != NULL; l = l->next) {
+		job = (struct RenderJob *)l->data;
+		if(job->first == c->first && job->last == c->last && rect_contains(&job->tile, tile))
+			return;
+	}
+
+	job = (struct RenderJob *)gmap_malloc0(sizeof(struct RenderJob));
+	job->mapview = mapview;
+	job->rt = &mapview->rt;
+	job->first = c->first;
+	job->last = c->last;
+	job->opaque = c->opaque;
+	job->tile = *tile;
+	r->jobs = g_list_prepend(r->jobs, job);
+
+	g_mutex_lock(&r->lock);
+	r->running++;
+	g_mutex_unlock(&r->lock);
+	g_thread_pool_push(r->pool, job, NULL);
+}
+
+/*
+ * Render the damaged groups of the tile, and composite them to the frame.
+ * Returns FALSE if some group renders on the pool; the tile is composited
+ * when it is back.
+ */
+static bool
+render_tile(struct MapView *mapview, const GdkRectangle *tile) {
+	struct Redraw *r = mapview->redraw;
+	GdkRegion *done;
+	bool ready = TRUE;
+	cairo_t *ct;
+	int i;
+
+	TRACE_BEGIN("redraw_tile", NULL);
+	for(i = 0; i < r->n_caches; i++) {
+		struct LayerCache *c = &r->caches[i];
+		if(!c->shown || gdk_region_rect_in(c->damage, tile) == GDK_OVERLAP_RECTANGLE_OUT)
+			continue;
+		if(r->pool != NULL && target_layers_thread_safe(&mapview->rt, c->first, c->last)) {
+			queue_job(mapview, c, tile);
+			ready = FALSE;
+		}
+		else
+			render_group(mapview, c, tile);
+	}
+	if(!ready) {
+		TRACE_END("redraw_tile");
+		return FALSE;
+	}
+
+	ct = cairo_create(r->frame);
+	cairo_translate(ct, -r->area.x, -r->area.y);
+	cairo_rectangle(ct, tile->x, tile->y, tile->width, tile->height);
+	cairo_clip(ct);
+	if(r->n_caches == 0 || !r->caches[0].opaque || !r->caches[0].shown)
+		cairo_set_source_rgb(ct, 1, 1, 1);
+	else
+		cairo_set_source_surface(ct, r->caches[0].cs, r->area.x, r->area.y);
+	cairo_paint(ct);
+	for(i = 0; i < r->n_caches; i++) {
+		if(r->caches[i].opaque || !r->caches[i].shown)
+			continue;
+		cairo_set_source_surface(ct, r->caches[i].cs, r->area.x, r->area.y);
+		cairo_paint(ct);
+	}
+	cairo_destroy(ct);
+	TRACE_END("redraw_tile");
+
+	done = gdk_region_rectangle(tile);
+	gdk_region_subtract(r->damage, done);
+	gdk_region_destroy(done);
+	gdk_window_invalidate_rect(GTK_LAYOUT(mapview->layout)->bin_window, tile, FALSE);
+	return TRUE;
+}
+
+/* Next tile with damage, the part of it that is damaged */
+static bool
+next_tile(const GdkRegion *damage, GdkRectangle *tile) {
+	GdkRectangle box, cell;
+	GdkRegion *part;
+	int x, y;
+
+	gdk_region_get_clipbox(damage, &box);
+	for(y = box.y - box.y % REDRAW_TILE; y < box.y + box.height; y += REDRAW_TILE) {
+		for(x = box.x - box.x % REDRAW_TILE; x < box.x + box.width; x += REDRAW_TILE) {
+			cell.x = x;
+			cell.y = y;
+			cell.width = REDRAW_TILE;
+			cell.height = REDRAW_TILE;
+			if(gdk_region_rect_in(damage, &cell) == GDK_OVERLAP_RECTANGLE_OUT)
+				continue;
+			part = gdk_region_rectangle(&cell);
+			gdk_region_intersect(part, damage);
+			gdk_region_get_clipbox(part, tile);
+			gdk_region_destroy(part);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static void
+update_stats_label(struct MapView *mapview) {
+	struct Redraw *r = mapview->redraw;
+	char str[400];
+	int l;
+
+	if(!GTK_WIDGET_VISIBLE(mapview->LayerTimes))
+		return;
+	l = format_layer_stats(str, sizeof(str), &mapview->rt);
+	snprintf(str+l, sizeof(str)-l, "%sframes %d missed %d dropped %d cancelled %d reused %.1fMpx",
+		l ? "  " : "", r->frames, r->missed, r->dropped, r->cancelled, r->reused / 1e6);
+	gtk_label_set_text(GTK_LABEL(mapview->LayerTimes), str);
+}
+
+/* One frame: render damaged tiles until the deadline */
+static gboolean
+redraw_tick(gpointer data) {
+	struct MapView *mapview = (struct MapView *)data;
+	struct Redraw *r = mapview->redraw;
+	gint64 deadline;
+	GdkRectangle tile;
+	GdkRegion *pending;
+
+	r->tick = 0;
+	r->last_frame = g_get_monotonic_time();
+	deadline = r->last_frame + FRAME_INTERVAL;
+
+	follow_viewport(mapview);
+	if(r->frame == NULL || r->snapshot != NULL || !GTK_WIDGET_REALIZED(mapview->layout))
+		return FALSE;	/* a settling zoom will queue it again */
+	sync_caches(mapview);
+
+	pending = pending_region(r);
+	TRACE_BEGIN("frame", NULL);
+	/* At least one tile per frame, or a slow layer would never finish */
+	for(;;) {
+		GdkRegion *todo = gdk_region_copy(r->damage);
+		GdkRegion *visible = gdk_region_rectangle(&r->view);
+		bool found;
+
+		gdk_region_subtract(todo, pending);
+		gdk_region_intersect(visible, todo);
+		found = next_tile(visible, &tile) || next_tile(todo, &tile);
+		gdk_region_destroy(visible);
+		gdk_region_destroy(todo);
+		if(!found)
+			break;
+		if(!render_tile(mapview, &tile))
+			gdk_region_union_with_rect(pending, &tile);
+		if(g_get_monotonic_time() >= deadline)
+			break;
+	}
+	TRACE_END("frame");
+	gdk_region_destroy(pending);
+
+	r->frames++;
+	if(g_get_monotonic_time() > deadline)
+		r->missed++;
+	update_stats_label(mapview);
+	mapview_update_progress(mapview);
+
+	schedule_frame(mapview);
+	return FALSE;
+}
+
+/*
+ * The zoom settled. Only now the scale of the target is changed; the
+ * last zoomed picture stays in the frame until the tiles replace it.
+ */
+static void
+zoom_settle(struct MapView *mapview) {
+	struct Redraw *r = mapview->redraw;
+	cairo_surface_t *snapshot = r->snapshot;
+	double factor = mapview->rt.scale / r->zoom_to;
+	double geo_x, geo_y;
+	cairo_t *ct;
+
+	pixel_to_geo_xy(mapview->rt.GeoTransform, r->snapshot_area.x + r->anchor_x,
+		r->snapshot_area.y + r->anchor_y, &geo_x, &geo_y);
+
+	r->snapshot = NULL;
+	mapview_set_scale(mapview, r->zoom_to);
+	mapview_goto_xy(mapview, geo_x, geo_y, r->dpy_x, r->dpy_y);
+	follow_viewport(mapview);
+
+	r->snapshot = snapshot;
+	ct = cairo_create(r->frame);
+	cairo_translate(ct, r->view.x - r->area.x, r->view.y - r->area.y);
+	paint_zoomed(ct, r, factor);
+	cairo_destroy(ct);
+	cairo_surface_destroy(snapshot);
+	r->snapshot = NULL;
+
+	gdk_window_invalidate_rect(GTK_LAYOUT(mapview->layout)->bin_window, &r->view, FALSE);
+	schedule_frame(mapview);
+}
+
+static gboolean
+zoom_tick(gpointer data) {
+	struct MapView *mapview = (struct MapView *)data;
+	struct Redraw *r = mapview->redraw;
+	gint64 now = g_get_monotonic_time();
+
+	if(now - r->zoom_start >= ZOOM_SETTLE) {
+		r->zoom_tick = 0;
+		zoom_settle(mapview);
+		return FALSE;
+	}
+	/* once the animation is over the picture does not change */
+	if(now - r->zoom_start < ZOOM_TIME + FRAME_INTERVAL)
+		gdk_window_invalidate_rect(GTK_LAYOUT(mapview->layout)->bin_window, &r->view, FALSE);
+	return TRUE;
+}
+
+/*
+ * Change the scale, showing geo_x, geo_y at viewport pixel dpy_x, dpy_y.
+ * With smooth zoom the change is animated and rendered when no other
+ * zoom follows it.
+ */
+void
+mapview_zoom_to(struct MapView *mapview, double scale, double geo_x, double geo_y, double dpy_x, double dpy_y) {
+	struct Redraw *r = mapview->redraw;
+	gint64 now = g_get_monotonic_time();
+	cairo_t *ct;
+	double x, y;
+
+	if(!mapview->smooth_zoom || r->frame == NULL || !GTK_WIDGET_REALIZED(mapview->layout) ||
+	   !geo_to_pixel_xy(mapview->rt.GeoTransform, geo_x, geo_y, &x, &y)) {
+		if(r->snapshot != NULL) {
+			g_source_remove(r->zoom_tick);
+			r->zoom_tick = 0;
+			cairo_surface_destroy(r->snapshot);
+			r->snapshot = NULL;
+		}
+		gtk_widget_hide(mapview->layout);
+		mapview_set_scale(mapview, scale);
+		mapview_goto_xy(mapview, geo_x, geo_y, dpy_x, dpy_y);
+		gtk_widget_show(mapview->layout);
+		return;
+	}
+
+	if(r->snapshot == NULL) {
+		r->snapshot = cairo_image_surface_create(CAIRO_FORMAT_RGB24, r->area.width, r->area.height);
+		r->snapshot_area = r->area;
+		ct = cairo_create(r->snapshot);
+		cairo_set_source_surface(ct, r->frame, 0, 0);
+		cairo_paint(ct);
+		cairo_destroy(ct);
+		r->zoom_from = mapview->rt.scale;
+	}
+	else
+		r->zoom_from = zoom_scale(r, now);
+
+	r->zoom_to = scale;
+	r->anchor_x = x - r->snapshot_area.x;
+	r->anchor_y = y - r->snapshot_area.y;
+	r->dpy_x = dpy_x;
+	r->dpy_y = dpy_y;
+	r->zoom_start = now;
+	if(r->zoom_tick == 0)
+		r->zoom_tick = g_timeout_add(FRAME_INTERVAL / 1000, zoom_tick, mapview);
+}
+
+/* The scale of the view, or the one it is zooming to */
+double
+mapview_zoom_scale(struct MapView *mapview) {
+	return mapview->redraw->snapshot != NULL ? mapview->redraw->zoom_to : mapview->rt.scale;
+}
+
+/* Zoom to scale, the point at viewport pixel dpy_x, dpy_y stays there */
+void
+mapview_zoom_at(struct MapView *mapview, double scale, double dpy_x, double dpy_y) {
+	struct Redraw *r = mapview->redraw;
+	double x, y, geo_x, geo_y;
+
+	if(r->snapshot != NULL) {
+		/* the pixel of the snapshot shown there now */
+		double shown = mapview->rt.scale / zoom_scale(r, g_get_monotonic_time());
+		x = r->snapshot_area.x + r->anchor_x + (dpy_x - r->dpy_x) / shown;
+		y = r->snapshot_area.y + r->anchor_y + (dpy_y - r->dpy_y) / shown;
+		pixel_to_geo_xy(mapview->rt.GeoTransform, x, y, &geo_x, &geo_y);
+		mapview_zoom_to(mapview, scale, geo_x, geo_y, dpy_x, dpy_y);
+	}
+	else {
+		x = gtk_adjustment_get_value(mapview->hadjustment) + dpy_x;
+		y = gtk_adjustment_get_value(mapview->vadjustment) + dpy_y;
+		pixel_to_geo_xy(mapview->rt.GeoTransform, x, y, &geo_x, &geo_y);
+		mapview_zoom_to(mapview, scale, geo_x, geo_y, dpy_x, dpy_y);
+	}
+}
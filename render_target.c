@@ -0,0 +1,172 @@
+/*
+ * render_target.c
+ * Copyright (C) 2007 Itai Nahshon
+ *
+ * RenderTarget handling that does not depend on a window. Used by
+ * the map views and by the headless renderer.
+ */
+
+#include "gmap.h"
+
+void
+target_free_data(struct RenderTarget *target) {
+	int i;
+	gmap_free(target->WKT);
+	for(i = 0; i < target->n_layers; i++) {
+		/* must free layer private data */
+		if(target->layers[i].ops->free_target_data)
+			(*target->layers[i].ops->free_target_data)(&target->layers[i], target);
+		layer_free_stats(&target->layers[i]);
+	}
+	gmap_free(target->layers);
+}
+
+struct Layer *
+target_add_layer(struct RenderTarget *target) {
+	struct Layer *layer;
+	target->layers = (struct Layer *)gmap_realloc(target->layers, (1+target->n_layers)*sizeof(struct Layer));
+	layer = &target->layers[target->n_layers];
+	target->n_layers++;
+	layer->type = LAYER_NONE;
+	layer->ops = NULL;
+	layer->flags = LAYER_FLAGS_NONE;
+	layer->data = NULL;
+	layer->priv = NULL;
+	layer->stats = NULL;
+	return layer;
+};
+
+void
+target_set_scale(struct RenderTarget *target, double scale) {
+	int i;
+	double hscale, vscale;
+	double sinrot, cosrot;
+
+	/* XXX must be fixed to allow rotated target */
+	/* To prevent view window from growing to a nngative size.
+	   Even for a world map, 31 bits give a fair resolution of
+	   about 2 cm/pixel. */
+
+#define MAXWINDOWSIZE ((double)0x7FFFFFFF)
+	scale = MAX(scale, fabs(target->right-target->left)/MAXWINDOWSIZE);
+	scale = MAX(scale, fabs(target->bottom-target->top)/MAXWINDOWSIZE);
+	// g_message("mapview_set_zoom: zoom_scale=%f", zoom_scale);
+
+	target->scale = scale;
+
+	sinrot = sin(target->rotation * M_PI/180);
+	cosrot = cos(target->rotation * M_PI/180);
+
+	hscale = (target->left <= target->right) ? scale : -scale;
+	vscale = (target->top <= target->bottom) ? scale : -scale;
+	vscale *= (target->x_resulution / target->y_resulution);
+
+	target->GeoTransform[0] = target->left;
+	target->GeoTransform[1] = hscale * cosrot;
+	target->GeoTransform[2] = vscale * sinrot;
+	target->GeoTransform[3] = target->top;
+	target->GeoTransform[4] = hscale * -sinrot;
+	target->GeoTransform[5] = vscale * cosrot;
+
+	/* Set the size for the viewport */
+	target->width = (int)ceil((target->right-target->left)/target->GeoTransform[1]);
+	target->height =  (int)ceil((target->bottom-target->top)/target->GeoTransform[5]);
+
+	for(i = 0; i < target->n_layers; i++) {
+		if(!(target->layers[i].flags & LAYER_IS_VISIBLE))
+			continue;
+
+		layer_calc_target_data(&target->layers[i], target);
+	}
+}
+
+/*
+ * Render the visible layers first..last-1 for the target area at (x, y)
+ * on ct, whose origin is the top left corner of the area. Layers that
+ * are not vector need an image surface under ct.
+ */
+void
+target_render_layers(struct RenderTarget *target, cairo_t *ct, int x, int y, int w, int h, int first, int last) {
+	target_render_layers_cancellable(target, ct, x, y, w, h, first, last, NULL, 0);
+}
+
+/*
+ * Same, but stop when *cancel is set or the deadline passed. Returns
+ * FALSE if it stopped; what is on ct then is of no use.
+ */
+bool
+target_render_layers_cancellable(struct RenderTarget *target, cairo_t *ct, int x, int y, int w, int h,
+	int first, int last, const gint *cancel, gint64 deadline) {
+	struct RenderContext rc;
+	int i;
+
+	rc.rt = target;
+	rc.cs = cairo_get_target(ct);
+	rc.ct = ct;
+	rc.x = x;
+	rc.y = y;
+	rc.w = w;
+	rc.h = h;
+	rc.objects = NULL;
+	rc.cancel = cancel;
+	rc.deadline = deadline;
+
+	for(i = first; i < last; i++) {
+		if(!(target->layers[i].flags & LAYER_IS_VISIBLE))
+			continue;
+		if(RENDER_CANCELLED(&rc))
+			return FALSE;
+
+		/* some layers leave a clip behind */
+		cairo_save(ct);
+		layer_render(&target->layers[i], &rc);
+		cairo_restore(ct);
+	}
+	return !RENDER_CANCELLED(&rc);
+}
+
+/* The visible layers first..last-1 may all render off the main thread */
+bool
+target_layers_thread_safe(const struct RenderTarget *target, int first, int last) {
+	int i;
+
+	for(i = first; i < last; i++) {
+		if((target->layers[i].flags & LAYER_IS_VISIBLE) && !target->layers[i].ops->thread_safe)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Render all visible layers for the target area at (x, y) into cs,
+ * which must be at least w X h pixels.
+ */
+void
+target_render_area(struct RenderTarget *target, cairo_surface_t *cs, int x, int y, int w, int h) {
+	cairo_t *ct = cairo_create(cs);
+
+	target_render_layers(target, ct, x, y, w, h, 0, target->n_layers);
+	cairo_destroy(ct);
+}
+
+/* Number of layers up to the last visible one that is not vector */
+int
+target_raster_layers(const struct RenderTarget *target) {
+	int i, n = 0;
+
+	for(i = 0; i < target->n_layers; i++) {
+		if((target->layers[i].flags & LAYER_IS_VISIBLE) && !target->layers[i].ops->vector)
+			n = i+1;
+	}
+	return n;
+}
+
+/*
+ * The layer changed in the target pixels x, y, w, h, or everywhere if
+ * w <= 0. Whoever shows the target renders that part again.
+ */
+void
+layer_invalidate(struct RenderTarget *target, struct Layer *layer, int x, int y, int w, int h) {
+	if(target->layer_changed != NULL)
+		(*target->layer_changed)(target, layer - target->layers, x, y, w, h, target->layer_changed_data);
+}
@@ -0,0 +1,278 @@
+/*
+ * render_tiles.c
+ * Copyright (C) 2007 Itai Nahshon
+ *
+ * Render a whole RenderTarget to an image file. The target is cut in
+ * tiles which are rendered by a pool of threads; each tile is written
+ * to the output dataset as soon as it is done, so memory stays at one
+ * tile per thread (except for formats GDAL can only CreateCopy, which
+ * go through an in-memory dataset).
+ *
+ * PDF and SVG output is the same, but only the layers up to the last
+ * raster one are rendered in tiles, which are placed as images; the
+ * vector layers above them are drawn as vectors.
+ *
+ * If some layer is not thread safe, or no threads are asked for, the
+ * tiles are rendered one by one by the calling thread.
+ */
+
+#include "gmap.h"
+#include <gdal.h>
+#include <cpl_string.h>
+#include <cairo-pdf.h>
+#include <cairo-svg.h>
+
+struct TileJob {
+	struct RenderTarget *target;
+	int		n_layers;	/* render layers 0..n_layers-1 */
+	GDALDatasetH	ds;		/* write the tiles there, */
+	cairo_t		*cr;		/* or paint them there */
+	const gint	*cancel;	/* stop when set */
+	bool		failed;
+};
+
+struct Tile {
+	int		x, y, w, h;
+};
+
+/* GDAL datasets and cairo contexts are not thread safe */
+G_LOCK_DEFINE_STATIC(tile_write);
+
+static CPLErr
+write_tile(GDALDatasetH ds, cairo_surface_t *cs, const struct Tile *tile) {
+	unsigned char *data = cairo_image_surface_get_data(cs);
+	int stride = cairo_image_surface_get_stride(cs);
+	/* RGB24 pixels are native 32 bit words 0x00RRGGBB */
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+	int bands[3] = { 3, 2, 1 };	/* bytes are B G R x */
+#else
+	int bands[3] = { 1, 2, 3 };	/* bytes are x R G B */
+	data += 1;
+#endif
+
+	return GDALDatasetRasterIO(ds, GF_Write, tile->x, tile->y, tile->w, tile->h,
+		data, tile->w, tile->h, GDT_Byte, 3, bands, 4, stride, 1);
+}
+
+static void
+render_tile(gpointer data, gpointer user_data) {
+	struct Tile *tile = (struct Tile *)data;
+	struct TileJob *job = (struct TileJob *)user_data;
+	cairo_surface_t *cs = NULL;
+	cairo_t *ct;
+	bool done = FALSE;
+
+	TRACE_BEGIN("tile", NULL);
+	if(job->cancel == NULL || !g_atomic_int_get(job->cancel)) {
+		cs = cairo_image_surface_create(CAIRO_FORMAT_RGB24, tile->w, tile->h);
+		ct = cairo_create(cs);
+		done = target_render_layers_cancellable(job->target, ct, tile->x, tile->y, tile->w, tile->h,
+			0, job->n_layers, job->cancel, 0);
+		cairo_destroy(ct);
+		cairo_surface_flush(cs);
+	}
+
+	G_LOCK(tile_write);
+	if(!done)
+		job->failed = TRUE;	/* cancelled */
+	else if(job->cr != NULL) {
+		cairo_set_source_surface(job->cr, cs, tile->x, tile->y);
+		cairo_paint(job->cr);
+	}
+	else if(write_tile(job->ds, cs, tile) != CE_None)
+		job->failed = TRUE;
+	G_UNLOCK(tile_write);
+	TRACE_END("tile");
+
+	if(cs != NULL)
+		cairo_surface_destroy(cs);
+	gmap_free(tile);
+}
+
+/* Render all tiles of the target and wait for them */
+static bool
+render_tiles(struct TileJob *job, int tile_size, int threads) {
+	struct RenderTarget *target = job->target;
+	GThreadPool *pool = NULL;
+	GError *err = NULL;
+	int x, y;
+
+	if(!target_layers_thread_safe(target, 0, job->n_layers))
+		threads = 0;
+	if(threads > 0)
+		pool = g_thread_pool_new(render_tile, job, threads, TRUE, &err);
+	if(threads > 0 && pool == NULL) {
+		fprintf(stderr, "could not start threads: %s\n", err->message);
+		g_error_free(err);
+		return FALSE;
+	}
+
+	for(y = 0; y < target->height; y += tile_size) {
+		for(x = 0; x < target->width; x += tile_size) {
+			struct Tile *tile = (struct Tile *)gmap_malloc(sizeof(struct Tile));
+			tile->x = x;
+			tile->y = y;
+			tile->w = MIN(tile_size, target->width - x);
+			tile->h = MIN(tile_size, target->height - y);
+			if(pool != NULL)
+				g_thread_pool_push(pool, tile, NULL);
+			else
+				render_tile(tile, job);
+		}
+	}
+
+	/* wait for all tiles */
+	if(pool != NULL)
+		g_thread_pool_free(pool, FALSE, TRUE);
+	return TRUE;
+}
+
+static bool
+render_target_to_vector(struct RenderTarget *target, const char *filename, bool svg,
+	int tile_size, int threads, const gint *cancel) {
+	cairo_surface_t *surface;
+	struct TileJob job;
+	double sx = 72.0 / target->x_resulution;
+	double sy = 72.0 / target->y_resulution;
+
+	/* sizes are in points */
+	if(svg)
+		surface = cairo_svg_surface_create(filename, target->width * sx, target->height * sy);
+	else
+		surface = cairo_pdf_surface_create(filename, target->width * sx, target->height * sy);
+
+	job.target = target;
+	job.n_layers = target_raster_layers(target);
+	job.ds = NULL;
+	job.cr = cairo_create(surface);
+	job.cancel = cancel;
+	job.failed = FALSE;
+	cairo_scale(job.cr, sx, sy);
+
+	if(job.n_layers > 0 && !render_tiles(&job, tile_size, threads))
+		job.failed = TRUE;
+
+	cairo_rectangle(job.cr, 0, 0, target->width, target->height);
+	cairo_clip(job.cr);
+	if(!job.failed && !target_render_layers_cancellable(target, job.cr, 0, 0, target->width, target->height,
+	   job.n_layers, target->n_layers, cancel, 0))
+		job.failed = TRUE;
+
+	cairo_destroy(job.cr);
+	cairo_surface_finish(surface);
+	if(cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS)
+		job.failed = TRUE;
+	cairo_surface_destroy(surface);
+
+	if(job.failed)
+		fprintf(stderr, "%s: write failed\n", filename);
+	return !job.failed;
+}
+
+static const char *
+format_from_filename(const char *filename) {
+	if(g_str_has_suffix(filename, ".png") || g_str_has_suffix(filename, ".PNG"))
+		return "PNG";
+	if(g_str_has_suffix(filename, ".pdf") || g_str_has_suffix(filename, ".PDF"))
+		return "PDF";
+	if(g_str_has_suffix(filename, ".svg") || g_str_has_suffix(filename, ".SVG"))
+		return "SVG";
+	return "GTiff";
+}
+
+bool
+render_target_to_file(struct RenderTarget *target, const char *filename, const char *format,
+	int tile_size, int threads) {
+	return render_target_to_file_cancellable(target, filename, format, tile_size, threads, NULL);
+}
+
+/* Same, but stop when *cancel is set; the file is then of no use */
+bool
+render_target_to_file_cancellable(struct RenderTarget *target, const char *filename, const char *format,
+	int tile_size, int threads, const gint *cancel) {
+	GDALDriverH driver;
+	GDALDatasetH ds, out;
+	struct TileJob job;
+	char **options = NULL;
+	bool direct;
+
+	if(format == NULL)
+		format = format_from_filename(filename);
+	if(target->width <= 0 || target->height <= 0) {
+		fprintf(stderr, "nothing to render\n");
+		return FALSE;
+	}
+
+	tile_size = MAX(tile_size, 16);
+
+	/* Rendered by cairo, not GDAL */
+	if(!strcmp(format, "PDF") || !strcmp(format, "SVG"))
+		return render_target_to_vector(target, filename, !strcmp(format, "SVG"), tile_size, threads, cancel);
+
+	driver = GDALGetDriverByName(format);
+	if(driver == NULL) {
+		fprintf(stderr, "%s: unknown output format\n", format);
+		return FALSE;
+	}
+
+	/* Formats without Create() (PNG) are rendered to memory first */
+	direct = GDALGetMetadataItem(driver, GDAL_DCAP_CREATE, NULL) != NULL;
+	if(direct) {
+		if(!strcmp(format, "GTiff")) {
+			options = CSLSetNameValue(options, "TILED", "YES");
+			if(tile_size % 16 == 0) {
+				char size[20];
+				snprintf(size, sizeof(size), "%d", tile_size);
+				options = CSLSetNameValue(options, "BLOCKXSIZE", size);
+				options = CSLSetNameValue(options, "BLOCKYSIZE", size);
+			}
+			options = CSLSetNameValue(options, "COMPRESS", "DEFLATE");
+			options = CSLSetNameValue(options, "PHOTOMETRIC", "RGB");
+			options = CSLSetNameValue(options, "BIGTIFF", "IF_SAFER");
+		}
+		ds = GDALCreate(driver, filename, target->width, target->height, 3, GDT_Byte, options);
+		CSLDestroy(options);
+	}
+	else
+		ds = GDALCreate(GDALGetDriverByName("MEM"), "", target->width, target->height, 3, GDT_Byte, NULL);
+	if(ds == NULL) {
+		fprintf(stderr, "%s: could not create\n", filename);
+		return FALSE;
+	}
+	GDALSetGeoTransform(ds, target->GeoTransform);
+	if(target->WKT != NULL)
+		GDALSetProjection(ds, target->WKT);
+	if(!strcmp(format, "GTiff") && target->x_resulution > 0) {
+		char res[40];
+		snprintf(res, sizeof(res), "%g", target->x_resulution);
+		GDALSetMetadataItem(ds, "TIFFTAG_XRESOLUTION", res, NULL);
+		snprintf(res, sizeof(res), "%g", target->y_resulution);
+		GDALSetMetadataItem(ds, "TIFFTAG_YRESOLUTION", res, NULL);
+		GDALSetMetadataItem(ds, "TIFFTAG_RESOLUTIONUNIT", "2", NULL);	/* inch */
+	}
+
+	job.target = target;
+	job.n_layers = target->n_layers;
+	job.ds = ds;
+	job.cr = NULL;
+	job.cancel = cancel;
+	job.failed = FALSE;
+
+	if(!render_tiles(&job, tile_size, threads)) {
+		GDALClose(ds);
+		return FALSE;
+	}
+
+	if(!direct && !job.failed) {
+		out = GDALCreateCopy(driver, filename, ds, FALSE, NULL, NULL, NULL);
+		if(out == NULL)
+			job.failed = TRUE;
+		else
+			GDALClose(out);
+	}
+	GDALClose(ds);
+
+	if(job.failed)
+		fprintf(stderr, "%s: write failed\n", filename);
+	return !job.failed;
+}
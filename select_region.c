@@ -14,11 +14,14 @@ enum GrabLocation {
 
 struct SelectRegion {
 	struct MapView *mapview;
+	int layer;		/* index in mapview->rt.layers */
 	double r, g, b, a;
 	double top, bottom, right, left;
+	bool placed;
 	bool active;
 	enum GrabLocation loc;
 	double GeoTransform[6];
+	GSList *exports;	/* struct RegionExport running */
 };
 
 /* copied from tree.c */
@@ -99,8 +102,6 @@ select_region_tool_button_release(struct MapView *mapview, int x, int y, int but
 	g_message("top %f bot %f rig %f lef %f",
 		r->top, r->bottom, r->right, r->left);
 
-	gtk_widget_queue_draw(mapview->layout);
-
 	r->active = FALSE;
 }
 
@@ -108,9 +109,14 @@ static void
 select_region_tool_mouse_move(struct MapView *mapview, int x, int y, void *tooldata) {
 	struct SelectRegion *r = (struct SelectRegion *)tooldata;
 	double geo_x, geo_y;
+	double corners[16];
+	double left, top, right, bottom;
+	int i;
+
 	if(!r->active)
 		return;
 
+	get_corners(r, corners);
 	pixel_to_geo_xy(mapview->rt.GeoTransform, x, y, &geo_x, &geo_y);
 	geo_to_pixel_xy(r->GeoTransform, geo_x, geo_y, &geo_x, &geo_y);
 
@@ -146,7 +152,19 @@ select_region_tool_mouse_move(struct MapView *mapview, int x, int y, void *toold
 	default:
 		;
 	}
-	gtk_widget_queue_draw(mapview->layout);
+
+	/* Only between the old and the new outline */
+	get_corners(r, corners+8);
+	left = right = corners[0];
+	top = bottom = corners[1];
+	for(i = 2; i < 16; i += 2) {
+		left = MIN(left, corners[i]);
+		right = MAX(right, corners[i]);
+		top = MIN(top, corners[i+1]);
+		bottom = MAX(bottom, corners[i+1]);
+	}
+	layer_invalidate(&mapview->rt, &mapview->rt.layers[r->layer], (int)floor(left) - 2, (int)floor(top) - 2,
+		(int)ceil(right - left) + 5, (int)ceil(bottom - top) + 5);
 }
 
 static void
@@ -195,6 +213,7 @@ static const struct LayerOps select_region_layer_ops = {
 	select_region_render_layer,
 	select_region_calc_target_data,
 	NULL,
+	TRUE,
 };
 
 void
@@ -206,12 +225,49 @@ select_region_init_layer(struct Layer *layer, enum LayerType type, struct Select
 	layer->priv = NULL;
 }
 
+/* First time: a region in the middle of the window */
+static void
+place_region(struct MapView *mapview, struct SelectRegion *r) {
+	double x, y, dx, dy;
+
+	x = gtk_adjustment_get_value(mapview->hadjustment) + mapview->allocation_width / 2;
+	y = gtk_adjustment_get_value(mapview->vadjustment) + mapview->allocation_height / 2;
+	pixel_to_geo_xy(mapview->rt.GeoTransform, x, y, &x, &y);
+	geo_to_pixel_xy(r->GeoTransform, x, y, &x, &y);
+
+	dx = mapview->allocation_width * mapview->rt.scale / 4;
+	dy = mapview->allocation_height * mapview->rt.scale / 4;
+	r->left = x - dx;
+	r->right = x + dx;
+	r->top = y + dy;
+	r->bottom = y - dy;
+	r->placed = TRUE;
+}
+
+/* The region is shown only while the tool is selected */
+static void
+select_region_tool_select(struct MapView *mapview, void *tooldata) {
+	struct SelectRegion *r = (struct SelectRegion *)tooldata;
+
+	if(!r->placed)
+		place_region(mapview, r);
+	mapview_show_layer(mapview, r->layer, TRUE);
+}
+
+static void
+select_region_tool_unselect(struct MapView *mapview, void *tooldata) {
+	struct SelectRegion *r = (struct SelectRegion *)tooldata;
+
+	mapview_show_layer(mapview, r->layer, FALSE);
+}
+
 static struct Tool select_region_tool = {
 	"SelectRegion", GTK_STOCK_ZOOM_IN, "Select a region", "<CTRL>R", "Select a region on the map",
 	select_region_tool_button_press,
 	select_region_tool_button_release,
 	select_region_tool_mouse_move,
-	NULL, NULL,
+	select_region_tool_select,
+	select_region_tool_unselect,
 };
 
 void
@@ -220,17 +276,242 @@ select_region_tool_start(struct MapView *mapview) {
 	r->mapview = mapview;
 	r->r = r->g = r->b = 0.0;
 	r->a = 0.5;
-	r->top = mapview->rt.top - 2000;
-	r->bottom = mapview->rt.bottom + 2000;
-	r->right = mapview->rt.right - 2000;
-	r->left = mapview->rt.left + 2000;
+	r->placed = FALSE;
 	r->active = FALSE;
+	r->exports = NULL;
 	set_unity_geotransform(r->GeoTransform);
 
 	r->GeoTransform[2]=0.1;
 	r->GeoTransform[4]=-0.1;
 
+	r->layer = mapview->rt.n_layers;
 	select_region_init_layer(target_add_layer(&mapview->rt), 999, r);
+	mapview->rt.layers[r->layer].flags = LAYER_FLAGS_NONE;
+	mapview->region = r;
+
+	mapwindow_register_tool(mapview, &select_region_tool, r, TRUE, TRUE, FALSE);
+}
+
+/*
+ * Export of the selected region to a tiled GeoTIFF. The export has its
+ * own RenderTarget whose pixel grid follows the (possibly rotated)
+ * region, and is rendered tile by tile on a worker thread, so the view
+ * stays usable and the size of the export is not limited by memory.
+ * Layers that are not thread safe are rendered on the main thread
+ * instead. The layer data belongs to the view: closing it cancels the
+ * export and waits for the thread.
+ */
+struct RegionExport {
+	struct MapView *mapview;	/* NULL once the window is gone */
+	struct SelectRegion *region;
+	struct RenderTarget rt;
+	char *filename;
+	GThread *thread;		/* NULL if rendered on the main thread */
+	gint cancel;
+	bool ok;
+};
+
+static void
+export_window_destroyed(GtkWidget *widget, struct RegionExport *ex) {
+	ex->mapview = NULL;
+	g_atomic_int_set(&ex->cancel, 1);
+}
+
+static void
+export_free(struct RegionExport *ex) {
+	if(ex->mapview != NULL)
+		g_signal_handlers_disconnect_by_func(ex->mapview->window, G_CALLBACK(export_window_destroyed), ex);
+	ex->region->exports = g_slist_remove(ex->region->exports, ex);
+	target_free_data(&ex->rt);
+	g_free(ex->filename);
+	gmap_free(ex);
+}
+
+/* Main thread: the export is written, failed or was cancelled */
+static gboolean
+export_done(gpointer data) {
+	struct RegionExport *ex = (struct RegionExport *)data;
+	GtkWidget *dialog;
+
+	if(ex->thread != NULL)
+		g_thread_join(ex->thread);
+
+	if(!g_atomic_int_get(&ex->cancel)) {
+		dialog = gtk_message_dialog_new(ex->mapview ? GTK_WINDOW(ex->mapview->window) : NULL,
+						0, ex->ok ? GTK_MESSAGE_INFO : GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE,
+						ex->ok ? "Exported %s (%d X %d)" : "Could not export %s",
+						ex->filename, ex->rt.width, ex->rt.height);
+		gtk_dialog_run(GTK_DIALOG(dialog));
+		gtk_widget_destroy(dialog);
+	}
+
+	export_free(ex);
+	return FALSE;
+}
+
+static void
+export_render(struct RegionExport *ex, int threads) {
+	int i;
+
+	for(i = 0; i < ex->rt.n_layers; i++)
+		layer_calc_target_data(&ex->rt.layers[i], &ex->rt);
+	ex->ok = render_target_to_file_cancellable(&ex->rt, ex->filename, "GTiff", 256, threads, &ex->cancel);
+}
+
+static gpointer
+export_thread(gpointer data) {
+	struct RegionExport *ex = (struct RegionExport *)data;
 
-	mapwindow_register_tool(mapview, &select_region_tool, r, TRUE, TRUE, TRUE);
+	export_render(ex, g_get_num_processors());
+	g_idle_add(export_done, ex);
+	return NULL;
+}
+
+/* The view is closing: stop its exports and wait for them */
+void
+export_region_cancel(struct MapView *mapview) {
+	struct SelectRegion *r = mapview->region;
+
+	while(r != NULL && r->exports != NULL) {
+		struct RegionExport *ex = (struct RegionExport *)r->exports->data;
+
+		g_atomic_int_set(&ex->cancel, 1);
+		if(ex->thread != NULL) {
+			g_thread_join(ex->thread);
+			ex->thread = NULL;
+		}
+		g_idle_remove_by_data(ex);
+		export_free(ex);
+	}
+}
+
+/* scale is in target units per pixel */
+static void
+export_region(struct MapView *mapview, struct SelectRegion *r, char *filename, double scale, double dpi) {
+	struct RegionExport *ex;
+	struct RenderTarget *rt;
+	const double *G = r->GeoTransform;
+	double hs, vs;
+	int i;
+
+	ex = (struct RegionExport *)gmap_malloc(sizeof(struct RegionExport));
+	ex->mapview = mapview;
+	ex->region = r;
+	ex->filename = filename;
+	ex->thread = NULL;
+	ex->cancel = 0;
+	ex->ok = FALSE;
+	rt = &ex->rt;
+
+	/* export pixel (i, j) is region point (left + i*hs, top + j*vs) */
+	hs = (r->left <= r->right) ? scale : -scale;
+	vs = (r->bottom <= r->top) ? -scale : scale;
+	rt->GeoTransform[0] = G[0] + r->left * G[1] + r->top * G[2];
+	rt->GeoTransform[1] = hs * G[1];
+	rt->GeoTransform[2] = vs * G[2];
+	rt->GeoTransform[3] = G[3] + r->left * G[4] + r->top * G[5];
+	rt->GeoTransform[4] = hs * G[4];
+	rt->GeoTransform[5] = vs * G[5];
+	rt->width = (int)ceil(fabs(r->right - r->left) / scale);
+	rt->height = (int)ceil(fabs(r->top - r->bottom) / scale);
+
+	rt->left = r->left;
+	rt->right = r->right;
+	rt->top = r->top;
+	rt->bottom = r->bottom;
+	rt->WKT = gmap_strdup(mapview->rt.WKT);
+	rt->scale = scale;
+	rt->rotation = 0;
+	rt->x_resulution = rt->y_resulution = dpi;
+	rt->warp_error = mapview->rt.warp_error;
+	rt->layer_changed = NULL;
+	rt->layer_changed_data = NULL;
+	rt->n_layers = 0;
+	rt->layers = NULL;
+
+	/* The map content only, not the view's overlays */
+	for(i = 0; i < mapview->rt.n_layers; i++) {
+		struct Layer *ls = &mapview->rt.layers[i];
+		struct Layer *ld;
+
+		if(!(ls->flags & LAYER_IS_VISIBLE) || ls->type == LAYER_NONE ||
+		   ls->type == LAYER_CALIBRATE || ls->type >= LAYER_PLAYBACK)
+			continue;
+		ld = target_add_layer(rt);
+		ld->ops = ls->ops;
+		ld->type = ls->type;
+		ld->flags = LAYER_IS_VISIBLE;
+		/* shared, lives as long as the view; close waits for the export */
+		ld->data = ls->data;
+	}
+
+	g_message("export %s: %d X %d pixels", filename, rt->width, rt->height);
+	r->exports = g_slist_prepend(r->exports, ex);
+	g_signal_connect(G_OBJECT(mapview->window), "destroy", G_CALLBACK(export_window_destroyed), ex);
+	if(target_layers_thread_safe(rt, 0, rt->n_layers))
+		ex->thread = g_thread_new("export", export_thread, ex);
+	else {
+		/* The main thread changes them, render them here */
+		export_render(ex, 0);
+		export_done(ex);
+	}
+}
+
+static GtkWidget *
+labeled_spin(GtkWidget *box, const char *label, double value, double min, double max) {
+	GtkWidget *spin;
+
+	gtk_box_pack_start(GTK_BOX(box), gtk_label_new(label), FALSE, FALSE, 0);
+	spin = gtk_spin_button_new_with_range(min, max, 1);
+	gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin), value);
+	gtk_box_pack_start(GTK_BOX(box), spin, FALSE, FALSE, 0);
+	return spin;
+}
+
+void
+do_export_region(struct MapView *mapview) {
+	struct SelectRegion *r = mapview->region;
+	GtkWidget *dialog, *hbox, *scale_spin, *dpi_spin;
+	GtkFileFilter *filter;
+	double ppm;
+
+	if(r == NULL || !r->placed) {
+		dialog = gtk_message_dialog_new(GTK_WINDOW(mapview->window),
+						0, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE,
+						"Select a region first (Tools/Select a region)");
+		gtk_dialog_run(GTK_DIALOG(dialog));
+		gtk_widget_destroy(dialog);
+		return;
+	}
+
+	dialog = gtk_file_chooser_dialog_new ("Export Region",
+					GTK_WINDOW(mapview->window),
+					GTK_FILE_CHOOSER_ACTION_SAVE,
+					GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+					GTK_STOCK_SAVE, GTK_RESPONSE_ACCEPT,
+					NULL);
+	gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog), TRUE);
+	gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(dialog), "region.tif");
+
+	filter = gtk_file_filter_new();
+	gtk_file_filter_set_name(filter, "GeoTIFF files");
+	gtk_file_filter_add_pattern(filter, "*.tif");
+	gtk_file_filter_add_pattern(filter, "*.tiff");
+	gtk_file_chooser_add_filter(GTK_FILE_CHOOSER(dialog), filter);
+
+	/* Scale as 1:N at the DPI, like the status bar */
+	ppm = mapview->rt.x_resulution * 1000 / 25.4;	/* pixels per meter */
+	hbox = gtk_hbox_new(FALSE, 6);
+	scale_spin = labeled_spin(hbox, "Scale 1:", floor(mapview->rt.scale * ppm + 0.5), 1, 1e9);
+	dpi_spin = labeled_spin(hbox, "DPI", mapview->rt.x_resulution, 10, 2400);
+	gtk_widget_show_all(hbox);
+	gtk_file_chooser_set_extra_widget(GTK_FILE_CHOOSER(dialog), hbox);
+
+	if (gtk_dialog_run (GTK_DIALOG (dialog)) == GTK_RESPONSE_ACCEPT) {
+		double dpi = gtk_spin_button_get_value(GTK_SPIN_BUTTON(dpi_spin));
+		double scale = gtk_spin_button_get_value(GTK_SPIN_BUTTON(scale_spin)) / (dpi * 1000 / 25.4);
+
+		export_region(mapview, r, gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog)), scale, dpi);
+	}
+	gtk_widget_destroy(dialog);
 }
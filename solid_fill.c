@@ -41,6 +41,8 @@ static const struct LayerOps solid_fill_layer_ops = {
 	solid_fill_render_layer,
 	solid_fill_calc_target_data,
 	NULL,
+	TRUE,
+	TRUE,
 };
 
 void
@@ -0,0 +1,91 @@
+/*
+ * trace.c
+ * Copyright (C) 2007 Itai Nahshon
+ *
+ * Event tracing in the Chrome trace format, viewable in chrome://tracing
+ * or Perfetto. Enabled when GMAP_TRACE names the output file. Events
+ * are written as they happen; the format allows the closing bracket
+ * to be missing, so a trace of a crashed session is still readable.
+ */
+
+#include "gmap.h"
+#include <unistd.h>
+
+FILE *trace_file = NULL;
+
+static gint64 trace_start;
+static gint next_tid = 0;
+static GPrivate trace_tid = G_PRIVATE_INIT(NULL);
+
+G_LOCK_DEFINE_STATIC(trace);
+
+static void
+trace_close() {
+	G_LOCK(trace);
+	fprintf(trace_file, "{}]\n");
+	fclose(trace_file);
+	trace_file = NULL;
+	G_UNLOCK(trace);
+}
+
+void
+trace_init() {
+	const char *filename = getenv("GMAP_TRACE");
+
+	if(filename == NULL || trace_file != NULL)
+		return;
+	if((trace_file = fopen(filename, "w")) == NULL) {
+		perror(filename);
+		return;
+	}
+	trace_start = g_get_monotonic_time();
+	fprintf(trace_file, "[\n");
+	atexit(trace_close);
+}
+
+/* Small sequential thread ids read better than pointers */
+static int
+thread_id() {
+	int tid = GPOINTER_TO_INT(g_private_get(&trace_tid));
+
+	if(tid == 0) {
+		tid = g_atomic_int_add(&next_tid, 1) + 1;
+		g_private_set(&trace_tid, GINT_TO_POINTER(tid));
+	}
+	return tid;
+}
+
+static void
+print_json_string(FILE *fp, const char *str) {
+	fputc('"', fp);
+	for(; *str; str++) {
+		if(*str == '"' || *str == '\\')
+			fprintf(fp, "\\%c", *str);
+		else if((unsigned char)*str < 0x20)
+			fprintf(fp, "\\u%04x", *str);
+		else
+			fputc(*str, fp);
+	}
+	fputc('"', fp);
+}
+
+/* ph is 'B' (begin) or 'E' (end), detail may be NULL */
+void
+trace_event(char ph, const char *name, const char *detail) {
+	gint64 ts = g_get_monotonic_time() - trace_start;
+	int tid = thread_id();
+
+	G_LOCK(trace);
+	if(trace_file != NULL) {
+		fprintf(trace_file, "{\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,\"ts\":%" G_GINT64_FORMAT ",\"name\":",
+			ph, (int)getpid(), tid, ts);
+		print_json_string(trace_file, name);
+		if(detail != NULL) {
+			fprintf(trace_file, ",\"args\":{\"detail\":");
+			print_json_string(trace_file, detail);
+			fputc('}', trace_file);
+		}
+		fprintf(trace_file, "},\n");
+	}
+	G_UNLOCK(trace);
+}
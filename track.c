@@ -30,6 +30,8 @@ new_track(char *name, struct TrackSet *trackset) {
 	ret->dashes = NULL;
 	ret->name = gmap_strdup(name);
 	ret->number = 0;
+	ret->timeindex = NULL;
+	memset(&ret->stats, 0, sizeof(ret->stats));
 	ret->color = g_random_int() & 0x00FFFFFF;
 	return ret;
 }
@@ -42,6 +44,11 @@ new_trackseg(struct Track *track) {
 	track->count++;
 	ret->count = 0;
 	ret->trackpoints = NULL;
+	ret->compact = NULL;
+	ret->base_time = 0;
+	ret->checkpoints = NULL;
+	memset(&ret->stats, 0, sizeof(ret->stats));
+	ret->prefix = NULL;
 	return ret;
 }
 
@@ -53,6 +60,7 @@ new_trackpoint(struct TrackSeg *trackseg) {
 	ret = &trackseg->trackpoints[trackseg->count];
 	trackseg->count++;
 	ret->time.tv_sec = ret->time.tv_usec = 0;
+	ret->point.elevation = NAN;	/* no <ele> */
 	// ret->serial = point_serial++;
 	return ret;
 }
@@ -68,8 +76,8 @@ GetName(xmlDocPtr doc, xmlNodePtr cur) {
 	return NULL;
 }
 
-bool
-load_from_gpx(char *filename, struct TrackSet **trkset, struct RouteSet **routeset, struct WayPointSet **waypointset) {
+static bool
+parse_gpx(char *filename, struct TrackSet **trkset, struct RouteSet **routeset, struct WayPointSet **waypointset) {
 	xmlDocPtr doc;
 	xmlNodePtr root;
 	xmlNodePtr cur;
@@ -109,7 +117,7 @@ load_from_gpx(char *filename, struct TrackSet **trkset, struct RouteSet **routes
 			struct TrackSeg *trkseg;
 			struct TrackPoint *trkpt;
 			double dist = 0;
-			double	last_lon, last_lat;
+			struct Point last;
 			bool first = TRUE;
 
 			if(*trkset == NULL)
@@ -150,13 +158,6 @@ load_from_gpx(char *filename, struct TrackSet **trkset, struct RouteSet **routes
 					trkpt->point.geo_lon = atof((char *)lon);
 					trkpt->point.geo_lat = atof((char *)lat);
 
-					if(!first)
-						dist += Distance(last_lat, last_lon, trkpt->point.geo_lat, trkpt->point.geo_lon);
-					trkpt->distance = dist;
-					first = FALSE;
-					last_lat = trkpt->point.geo_lat;
-					last_lon = trkpt->point.geo_lon;
-
 					param = curtrkpt->xmlChildrenNode;
 					while(param != NULL) {
 						if(!xmlStrcmp(param->name, BAD_CAST "ele")) {
@@ -176,8 +177,22 @@ load_from_gpx(char *filename, struct TrackSet **trkset, struct RouteSet **routes
 
 					curtrkpt = curtrkpt->next;
 				}
+				/* Distance accumulates along the track, across segments */
+				if(trkseg->count > 0) {
+					struct TrackPoint tp;
+
+					trackseg_calc_distance(trkseg, first ? NULL : &last, dist);
+					if(compact_tracks_enabled())
+						trackseg_compact(trkseg);
+					trackseg_get_point(trkseg, trkseg->count - 1, &tp);
+					dist = tp.distance;
+					last = tp.point;
+					first = FALSE;
+				}
 				curtrkseg = curtrkseg->next;
 			}
+			track_build_time_index(trk);
+			track_update_stats(trk);
 		}
 		else if (!xmlStrcmp(cur->name, BAD_CAST "wpt")) {
 			xmlNodePtr param;
@@ -269,3 +284,13 @@ load_from_gpx(char *filename, struct TrackSet **trkset, struct RouteSet **routes
 	xmlFreeDoc(doc);
 	return TRUE;
 }
+
+bool
+load_from_gpx(char *filename, struct TrackSet **trkset, struct RouteSet **routeset, struct WayPointSet **waypointset) {
+	bool ret;
+
+	TRACE_BEGIN("load_from_gpx", filename);
+	ret = parse_gpx(filename, trkset, routeset, waypointset);
+	TRACE_END("load_from_gpx");
+	return ret;
+}
@@ -0,0 +1,215 @@
+/*
+ * track_compact.c
+ * Copyright (C) 2007 Itai Nahshon
+ *
+ * Compact storage for track segments. A point takes 16 bytes instead
+ * of the 48 of struct TrackPoint:
+ *	lat/lon		int32, 1e-7 degree (about 1 cm)
+ *	time		uint32 ms after the segment base time
+ *	elevation	int16 decimetres
+ * The distance is rebuilt from a checkpoint every COMPACT_CHECKPOINT
+ * points plus the hops that follow it.
+ *
+ * Everything outside this file reads points through the accessors,
+ * which work for both full and compact segments.
+ */
+#include "gmap.h"
+
+#define COMPACT_DEG		1e7
+#define COMPACT_NO_TIME		0xFFFFFFFFU
+#define COMPACT_NO_ELE		(-32768)
+#define COMPACT_CHECKPOINT	64
+
+bool
+compact_tracks_enabled() {
+	static int enabled = -1;
+
+	if(enabled < 0)
+		enabled = getenv("GMAP_COMPACT_TRACKS") != NULL;
+	return enabled;
+}
+
+/* Can the segment be stored compact without losing time or elevation? */
+static bool
+trackseg_can_compact(const struct TrackSeg *seg, gint64 *base) {
+	gint64 tmin = 0, tmax = 0;
+	bool timed = FALSE;
+	int i;
+
+	for(i = 0; i < seg->count; i++) {
+		const struct TrackPoint *p = &seg->trackpoints[i];
+
+		if(!isnan(p->point.elevation) &&
+		   fabs(p->point.elevation) * 10 > 32767)
+			return FALSE;
+		if(p->time.tv_sec == 0 && p->time.tv_usec == 0)
+			continue;
+		if(p->time.tv_usec % 1000 != 0)
+			return FALSE;
+		if(!timed || trackpoint_time(p) < tmin)
+			tmin = trackpoint_time(p);
+		if(!timed || trackpoint_time(p) > tmax)
+			tmax = trackpoint_time(p);
+		timed = TRUE;
+	}
+	if(timed && (tmax - tmin) / 1000 >= COMPACT_NO_TIME)
+		return FALSE;
+
+	*base = tmin / 1000;
+	return TRUE;
+}
+
+static void
+compact_latlon(const struct CompactPoint *c, double *lat, double *lon) {
+	*lat = c->lat / COMPACT_DEG;
+	*lon = c->lon / COMPACT_DEG;
+}
+
+/*
+ * Convert a loaded segment to compact storage. Distances are rebuilt
+ * from the stored (rounded) positions so they agree with what the
+ * accessors return. Returns FALSE if the segment stays in full mode.
+ */
+bool
+trackseg_compact(struct TrackSeg *seg) {
+	struct CompactPoint *c;
+	gint64 base;
+	double dist = 0, lat0 = 0, lon0 = 0;
+	int i;
+
+	if(seg->compact != NULL || seg->count == 0)
+		return seg->compact != NULL;
+	if(!trackseg_can_compact(seg, &base))
+		return FALSE;
+
+	c = (struct CompactPoint *)gmap_malloc(seg->count * sizeof(struct CompactPoint));
+	seg->checkpoints = (double *)gmap_malloc(
+		((seg->count + COMPACT_CHECKPOINT - 1) / COMPACT_CHECKPOINT) * sizeof(double));
+
+	for(i = 0; i < seg->count; i++) {
+		const struct TrackPoint *p = &seg->trackpoints[i];
+		double lat, lon;
+
+		c[i].lat = (gint32)floor(p->point.geo_lat * COMPACT_DEG + 0.5);
+		c[i].lon = (gint32)floor(p->point.geo_lon * COMPACT_DEG + 0.5);
+		if(p->time.tv_sec == 0 && p->time.tv_usec == 0)
+			c[i].dt = COMPACT_NO_TIME;
+		else
+			c[i].dt = (guint32)(trackpoint_time(p) / 1000 - base);
+		if(isnan(p->point.elevation))
+			c[i].ele = COMPACT_NO_ELE;
+		else
+			c[i].ele = (gint16)floor(p->point.elevation * 10 + 0.5);
+
+		compact_latlon(&c[i], &lat, &lon);
+		if(i == 0)
+			dist = p->distance;
+		else
+			dist += hop_distance(lat0, lon0, lat, lon);
+		if(i % COMPACT_CHECKPOINT == 0)
+			seg->checkpoints[i / COMPACT_CHECKPOINT] = dist;
+		lat0 = lat;
+		lon0 = lon;
+	}
+
+	gmap_free(seg->trackpoints);
+	seg->trackpoints = NULL;
+	seg->compact = c;
+	seg->base_time = base;
+	return TRUE;
+}
+
+void
+trackseg_get_latlon(const struct TrackSeg *seg, int i, double *lat, double *lon) {
+	if(seg->compact == NULL) {
+		*lat = seg->trackpoints[i].point.geo_lat;
+		*lon = seg->trackpoints[i].point.geo_lon;
+	}
+	else
+		compact_latlon(&seg->compact[i], lat, lon);
+}
+
+/* usec since epoch, 0 if the point has no time */
+gint64
+trackseg_point_time(const struct TrackSeg *seg, int i) {
+	if(seg->compact == NULL)
+		return trackpoint_time(&seg->trackpoints[i]);
+	if(seg->compact[i].dt == COMPACT_NO_TIME)
+		return 0;
+	return (seg->base_time + seg->compact[i].dt) * 1000;
+}
+
+double
+trackseg_point_distance(const struct TrackSeg *seg, int i) {
+	double d, lat0, lon0, lat, lon;
+	int k;
+
+	if(seg->compact == NULL)
+		return seg->trackpoints[i].distance;
+
+	k = i - i % COMPACT_CHECKPOINT;
+	d = seg->checkpoints[k / COMPACT_CHECKPOINT];
+	compact_latlon(&seg->compact[k], &lat0, &lon0);
+	for(k++; k <= i; k++) {
+		compact_latlon(&seg->compact[k], &lat, &lon);
+		d += hop_distance(lat0, lon0, lat, lon);
+		lat0 = lat;
+		lon0 = lon;
+	}
+	return d;
+}
+
+/* Decode point i into *tp */
+void
+trackseg_get_point(const struct TrackSeg *seg, int i, struct TrackPoint *tp) {
+	const struct CompactPoint *c;
+	gint64 t;
+
+	if(seg->compact == NULL) {
+		*tp = seg->trackpoints[i];
+		return;
+	}
+
+	c = &seg->compact[i];
+	compact_latlon(c, &tp->point.geo_lat, &tp->point.geo_lon);
+	tp->point.elevation = (c->ele == COMPACT_NO_ELE) ? NAN : c->ele / 10.0;
+	t = trackseg_point_time(seg, i);
+	tp->time.tv_sec = t / G_USEC_PER_SEC;
+	tp->time.tv_usec = t % G_USEC_PER_SEC;
+	tp->distance = trackseg_point_distance(seg, i);
+}
+
+/*
+ * Decode n points starting at first. Cheaper than calling
+ * trackseg_get_point() for each: the distance runs on from one point
+ * to the next instead of restarting at a checkpoint.
+ */
+void
+trackseg_get_points(const struct TrackSeg *seg, int first, int n, struct TrackPoint *tp) {
+	int i;
+
+	if(n <= 0)
+		return;
+	if(seg->compact == NULL) {
+		memcpy(tp, &seg->trackpoints[first], n * sizeof(struct TrackPoint));
+		return;
+	}
+
+	trackseg_get_point(seg, first, &tp[0]);
+	for(i = 1; i < n; i++) {
+		const struct CompactPoint *c = &seg->compact[first+i];
+		gint64 t;
+
+		compact_latlon(c, &tp[i].point.geo_lat, &tp[i].point.geo_lon);
+		tp[i].point.elevation = (c->ele == COMPACT_NO_ELE) ? NAN : c->ele / 10.0;
+		t = trackseg_point_time(seg, first+i);
+		tp[i].time.tv_sec = t / G_USEC_PER_SEC;
+		tp[i].time.tv_usec = t % G_USEC_PER_SEC;
+		if((first+i) % COMPACT_CHECKPOINT == 0)
+			tp[i].distance = seg->checkpoints[(first+i) / COMPACT_CHECKPOINT];
+		else
+			tp[i].distance = tp[i-1].distance + hop_distance(
+				tp[i-1].point.geo_lat, tp[i-1].point.geo_lon,
+				tp[i].point.geo_lat, tp[i].point.geo_lon);
+	}
+}
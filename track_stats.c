@@ -0,0 +1,254 @@
+/*
+ * track_stats.c
+ * Copyright (C) 2007 Itai Nahshon
+ *
+ * Track statistics. Totals are cached on every segment and track.
+ * Each segment also keeps per-point prefix sums so the statistics
+ * between any two of its points are found in O(1).
+ */
+#include "gmap.h"
+
+#define ELE_THRESHOLD	3.0	/* m, ignore elevation noise below this */
+#define MOVING_SPEED	0.5	/* m/s, slower than this is standing */
+#define MIN_SPEED_DT	1.0	/* s, shortest hop used for max speed */
+
+#define STATS_CHUNK	256	/* points decoded at a time */
+
+/* float is plenty for differences and halves the memory */
+struct TrackSegPrefix {
+	int		count;		/* points processed so far */
+	int		alloc;
+	float		*gain;		/* accumulated from segment start */
+	float		*loss;
+	float		*moving;	/* moving time, s */
+	double		ref_ele;	/* last elevation that counted */
+	bool		timed;		/* a point with time was seen */
+	double		last_t;		/* time and distance of that point */
+	double		last_d;
+	double		first_d;	/* distance of point 0 */
+};
+
+static void
+stats_clear(struct TrackStats *s) {
+	s->count = 0;
+	s->distance = 0;
+	s->gain = s->loss = 0;
+	s->moving_time = s->total_time = 0;
+	s->max_speed = s->avg_speed = 0;
+	s->min_lat = s->max_lat = s->min_lon = s->max_lon = 0;
+}
+
+static double
+point_seconds(const struct TrackPoint *p) {
+	return p->time.tv_sec + p->time.tv_usec / 1e6;
+}
+
+static bool
+point_has_time(const struct TrackPoint *p) {
+	return p->time.tv_sec != 0 || p->time.tv_usec != 0;
+}
+
+/*
+ * Bring the segment statistics up to date. Only points added since the
+ * last call are scanned, so it may be called after every append.
+ * Relies on trkpt->distance (see trackseg_calc_distance).
+ */
+void
+trackseg_update_stats(struct TrackSeg *seg) {
+	struct TrackSegPrefix *pf = seg->prefix;
+	struct TrackStats *s = &seg->stats;
+	struct TrackPoint pts[STATS_CHUNK];
+	double gain, loss, moving, last_d = 0;
+	int i, k, n;
+
+	if(pf == NULL) {
+		pf = (struct TrackSegPrefix *)gmap_malloc(sizeof(struct TrackSegPrefix));
+		pf->count = 0;
+		pf->alloc = 0;
+		pf->gain = pf->loss = pf->moving = NULL;
+		pf->ref_ele = NAN;
+		pf->timed = FALSE;
+		pf->last_t = pf->last_d = pf->first_d = 0;
+		seg->prefix = pf;
+		stats_clear(s);
+	}
+
+	if(pf->count >= seg->count)
+		return;
+
+	if(pf->alloc < seg->count) {
+		pf->alloc = seg->count;
+		pf->gain = (float *)gmap_realloc(pf->gain, pf->alloc * sizeof(float));
+		pf->loss = (float *)gmap_realloc(pf->loss, pf->alloc * sizeof(float));
+		pf->moving = (float *)gmap_realloc(pf->moving, pf->alloc * sizeof(float));
+	}
+
+	gain = s->gain;
+	loss = s->loss;
+	moving = s->moving_time;
+
+	for(k = pf->count; k < seg->count; k += n) {
+		n = MIN(STATS_CHUNK, seg->count - k);
+		trackseg_get_points(seg, k, n, pts);
+
+		for(i = 0; i < n; i++) {
+			struct TrackPoint *p = &pts[i];
+
+			if(k + i == 0)
+				pf->first_d = p->distance;
+
+			/* Elevation with hysteresis, points without <ele> are NAN */
+			if(!isnan(p->point.elevation)) {
+				if(isnan(pf->ref_ele))
+					pf->ref_ele = p->point.elevation;
+				else if(p->point.elevation - pf->ref_ele >= ELE_THRESHOLD) {
+					gain += p->point.elevation - pf->ref_ele;
+					pf->ref_ele = p->point.elevation;
+				}
+				else if(pf->ref_ele - p->point.elevation >= ELE_THRESHOLD) {
+					loss += pf->ref_ele - p->point.elevation;
+					pf->ref_ele = p->point.elevation;
+				}
+			}
+
+			if(point_has_time(p)) {
+				if(pf->timed) {
+					double dt = point_seconds(p) - pf->last_t;
+					double dd = p->distance - pf->last_d;
+
+					if(dt > 0) {
+						s->total_time += dt;
+						if(dd / dt >= MOVING_SPEED)
+							moving += dt;
+						if(dt >= MIN_SPEED_DT && dd / dt > s->max_speed)
+							s->max_speed = dd / dt;
+					}
+				}
+				pf->timed = TRUE;
+				pf->last_t = point_seconds(p);
+				pf->last_d = p->distance;
+			}
+
+			if(s->count == 0) {
+				s->min_lat = s->max_lat = p->point.geo_lat;
+				s->min_lon = s->max_lon = p->point.geo_lon;
+			}
+			else {
+				s->min_lat = MIN(s->min_lat, p->point.geo_lat);
+				s->max_lat = MAX(s->max_lat, p->point.geo_lat);
+				s->min_lon = MIN(s->min_lon, p->point.geo_lon);
+				s->max_lon = MAX(s->max_lon, p->point.geo_lon);
+			}
+			s->count++;
+
+			pf->gain[k+i] = gain;
+			pf->loss[k+i] = loss;
+			pf->moving[k+i] = moving;
+			last_d = p->distance;
+		}
+	}
+	pf->count = seg->count;
+
+	s->distance = last_d - pf->first_d;
+	s->gain = gain;
+	s->loss = loss;
+	s->moving_time = moving;
+	s->avg_speed = s->moving_time > 0 ? s->distance / s->moving_time : 0;
+}
+
+/*
+ * Track totals from the segment totals. The distance includes the gaps
+ * between segments, as trkpt->distance does: it is that of the last point.
+ */
+void
+track_update_stats(struct Track *track) {
+	struct TrackStats *s = &track->stats;
+	double first_d = 0, last_d = 0;
+	int i;
+
+	stats_clear(s);
+	for(i = 0; i < track->count; i++) {
+		struct TrackSeg *seg = &track->tracksegments[i];
+		struct TrackStats *ss = &seg->stats;
+
+		trackseg_update_stats(seg);
+		if(ss->count == 0)
+			continue;
+
+		if(s->count == 0) {
+			first_d = seg->prefix->first_d;
+			s->min_lat = ss->min_lat;
+			s->max_lat = ss->max_lat;
+			s->min_lon = ss->min_lon;
+			s->max_lon = ss->max_lon;
+		}
+		else {
+			s->min_lat = MIN(s->min_lat, ss->min_lat);
+			s->max_lat = MAX(s->max_lat, ss->max_lat);
+			s->min_lon = MIN(s->min_lon, ss->min_lon);
+			s->max_lon = MAX(s->max_lon, ss->max_lon);
+		}
+		s->count += ss->count;
+		last_d = seg->prefix->first_d + ss->distance;
+		s->gain += ss->gain;
+		s->loss += ss->loss;
+		s->moving_time += ss->moving_time;
+		s->total_time += ss->total_time;
+		s->max_speed = MAX(s->max_speed, ss->max_speed);
+	}
+	s->distance = last_d - first_d;
+	s->avg_speed = s->moving_time > 0 ? s->distance / s->moving_time : 0;
+}
+
+/*
+ * Statistics between points i and j (i <= j) of a segment, in O(1).
+ * max_speed and the bounding box are kept only for whole segments and
+ * tracks, here they are left 0.
+ */
+bool
+trackseg_range_stats(const struct TrackSeg *seg, int i, int j, struct TrackStats *s) {
+	const struct TrackSegPrefix *pf = seg->prefix;
+	struct TrackPoint p1, p2;
+
+	stats_clear(s);
+	if(pf == NULL || i < 0 || j >= pf->count || i > j)
+		return FALSE;
+
+	trackseg_get_point(seg, i, &p1);
+	trackseg_get_point(seg, j, &p2);
+	s->count = j - i + 1;
+	s->distance = p2.distance - p1.distance;
+	s->gain = pf->gain[j] - pf->gain[i];
+	s->loss = pf->loss[j] - pf->loss[i];
+	s->moving_time = pf->moving[j] - pf->moving[i];
+	if(point_has_time(&p1) && point_has_time(&p2))
+		s->total_time = point_seconds(&p2) - point_seconds(&p1);
+	s->avg_speed = s->moving_time > 0 ? s->distance / s->moving_time : 0;
+	return TRUE;
+}
+
+static int
+format_duration(char *ptr, int left, double t) {
+	int s = (int)(t + 0.5);
+	return snprintf(ptr, left, "%d:%02d:%02d", s / 3600, (s / 60) % 60, s % 60);
+}
+
+/* One line of text for the hover tooltip */
+int
+format_track_stats(char *ptr, int left, const struct TrackStats *s) {
+	int filled = 0;
+
+	filled += snprintf(ptr+filled, left-filled, "%.3f Km", s->distance / 1000);
+	if(filled < left && (s->gain > 0 || s->loss > 0))
+		filled += snprintf(ptr+filled, left-filled, " +%.0fm -%.0fm", s->gain, s->loss);
+	if(filled < left && s->moving_time > 0) {
+		filled += snprintf(ptr+filled, left-filled, " moving ");
+		if(filled < left)
+			filled += format_duration(ptr+filled, left-filled, s->moving_time);
+		if(filled < left)
+			filled += snprintf(ptr+filled, left-filled, " avg %.1f Km/h", s->avg_speed * 3.6);
+	}
+	if(filled < left && s->max_speed > 0)
+		filled += snprintf(ptr+filled, left-filled, " max %.1f Km/h", s->max_speed * 3.6);
+	return filled;
+}
@@ -0,0 +1,195 @@
+/*
+ * track_time.c
+ * Copyright (C) 2007 Itai Nahshon
+ *
+ * Per-track time index. All points of a track that carry a time stamp
+ * are kept in one array sorted by time, so position-at-time and
+ * time-window queries are a binary search.
+ */
+#include "gmap.h"
+
+struct TrackTimeIndex {
+	int		count;
+	struct TrackPointRef *refs;	/* sorted by time */
+};
+
+struct time_entry {
+	gint64		t;
+	int		order;		/* keeps the sort stable */
+	struct TrackPointRef ref;
+};
+
+gint64
+trackpoint_time(const struct TrackPoint *p) {
+	return (gint64)p->time.tv_sec * G_USEC_PER_SEC + p->time.tv_usec;
+}
+
+static int
+time_entry_cmp(const void *a, const void *b) {
+	const struct time_entry *e1 = a;
+	const struct time_entry *e2 = b;
+
+	if(e1->t != e2->t)
+		return e1->t < e2->t ? -1 : 1;
+	return e1->order - e2->order;
+}
+
+void
+track_free_time_index(struct Track *track) {
+	struct TrackTimeIndex *ti = track->timeindex;
+
+	if(ti == NULL)
+		return;
+	gmap_free(ti->refs);
+	gmap_free(ti);
+	track->timeindex = NULL;
+}
+
+void
+track_build_time_index(struct Track *track) {
+	struct TrackTimeIndex *ti;
+	struct time_entry *e;
+	bool sorted = TRUE;
+	int i, j, n;
+
+	track_free_time_index(track);
+
+	n = 0;
+	for(i = 0; i < track->count; i++)
+		n += track->tracksegments[i].count;
+
+	e = (struct time_entry *)gmap_malloc((n ? n : 1) * sizeof(struct time_entry));
+
+	/* Points without a time stamp are left out */
+	n = 0;
+	for(i = 0; i < track->count; i++) {
+		struct TrackSeg *seg = &track->tracksegments[i];
+		for(j = 0; j < seg->count; j++) {
+			gint64 t = trackseg_point_time(seg, j);
+			if(t == 0)
+				continue;
+			e[n].t = t;
+			e[n].order = n;
+			e[n].ref.seg = i;
+			e[n].ref.idx = j;
+			if(n > 0 && e[n].t < e[n-1].t)
+				sorted = FALSE;
+			n++;
+		}
+	}
+
+	/* Recorded tracks are normally in order, merged ones may not be */
+	if(!sorted)
+		qsort(e, n, sizeof(struct time_entry), time_entry_cmp);
+
+	/* Only the refs are kept, times are read back through them */
+	ti = (struct TrackTimeIndex *)gmap_malloc(sizeof(struct TrackTimeIndex));
+	ti->count = n;
+	ti->refs = (struct TrackPointRef *)gmap_malloc((n ? n : 1) * sizeof(struct TrackPointRef));
+	for(i = 0; i < n; i++)
+		ti->refs[i] = e[i].ref;
+	gmap_free(e);
+
+	track->timeindex = ti;
+}
+
+static gint64
+ref_time(const struct Track *track, const struct TrackPointRef *ref) {
+	return trackseg_point_time(&track->tracksegments[ref->seg], ref->idx);
+}
+
+static void
+ref_point(const struct Track *track, const struct TrackPointRef *ref, struct TrackPoint *tp) {
+	trackseg_get_point(&track->tracksegments[ref->seg], ref->idx, tp);
+}
+
+/* Index of the first entry with time >= t */
+static int
+lower_bound(const struct Track *track, gint64 t) {
+	const struct TrackTimeIndex *ti = track->timeindex;
+	int lo = 0, hi = ti->count;
+
+	while(lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if(ref_time(track, &ti->refs[mid]) < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+bool
+track_time_range(const struct Track *track, gint64 *t0, gint64 *t1) {
+	const struct TrackTimeIndex *ti = track->timeindex;
+
+	if(ti == NULL || ti->count == 0)
+		return FALSE;
+	*t0 = ref_time(track, &ti->refs[0]);
+	*t1 = ref_time(track, &ti->refs[ti->count-1]);
+	return TRUE;
+}
+
+/*
+ * Position of the track at time t. Between two points of the same
+ * segment the position is interpolated. In a gap between segments
+ * the position stays at the last point before the gap.
+ * Returns FALSE when t is outside the recorded time of the track.
+ */
+bool
+track_position_at_time(const struct Track *track, gint64 t, struct Point *pos, double *distance) {
+	const struct TrackTimeIndex *ti = track->timeindex;
+	struct TrackPoint p1, p2;
+	gint64 t0, t1, t2;
+	double u;
+	int i;
+
+	if(!track_time_range(track, &t0, &t1) || t < t0 || t > t1)
+		return FALSE;
+
+	i = lower_bound(track, t);
+	ref_point(track, &ti->refs[i], &p2);
+	t2 = ref_time(track, &ti->refs[i]);
+	if(t2 == t || i == 0) {
+		*pos = p2.point;
+		if(distance)
+			*distance = p2.distance;
+		return TRUE;
+	}
+
+	ref_point(track, &ti->refs[i-1], &p1);
+	if(ti->refs[i].seg != ti->refs[i-1].seg) {
+		*pos = p1.point;
+		if(distance)
+			*distance = p1.distance;
+		return TRUE;
+	}
+
+	t1 = ref_time(track, &ti->refs[i-1]);
+	u = (double)(t - t1) / (double)(t2 - t1);
+	pos->geo_lat = (1-u) * p1.point.geo_lat + u * p2.point.geo_lat;
+	pos->geo_lon = (1-u) * p1.point.geo_lon + u * p2.point.geo_lon;
+	pos->elevation = (1-u) * p1.point.elevation + u * p2.point.elevation;
+	if(distance)
+		*distance = (1-u) * p1.distance + u * p2.distance;
+	return TRUE;
+}
+
+/*
+ * Points with time in [t0, t1], in time order. Returns a pointer into
+ * the index (do not free) and sets *count.
+ */
+const struct TrackPointRef *
+track_points_in_window(const struct Track *track, gint64 t0, gint64 t1, int *count) {
+	const struct TrackTimeIndex *ti = track->timeindex;
+	int first, last;
+
+	*count = 0;
+	if(ti == NULL || ti->count == 0 || t1 < t0)
+		return NULL;
+
+	first = lower_bound(track, t0);
+	last = lower_bound(track, t1 + 1);
+	*count = last - first;
+	return *count > 0 ? &ti->refs[first] : NULL;
+}
@@ -23,8 +23,9 @@ struct TreeObject {
 	union {
 		struct {
 			struct Track *trk;
+			struct TrackSeg *seg;
 			int x0, y0, x1, y1;
-			struct TrackPoint *p1, *p2;
+			int i1, i2;		/* point indexes in seg */
 		} seg;
 		struct {
 			struct WayPoint *wpt;
@@ -37,7 +38,7 @@ struct  TreeSearchResult {
 	struct TreeObject *obj;
 	double dist;
 	double u;
-	struct TrackPoint *p1, *p2;
+	int i1, i2;
 };
 
 struct TreeNode {
@@ -140,16 +141,17 @@ tree_add_object(struct TreeNode *t, struct TreeObject *o, int left, int right, i
 }
 
 void
-tree_add_segment(struct TreeNode *t, struct Track *trk, int x0, int y0, int x1, int y1, struct TrackPoint *p1, struct TrackPoint *p2) {
+tree_add_segment(struct TreeNode *t, struct Track *trk, struct TrackSeg *seg, int x0, int y0, int x1, int y1, int i1, int i2) {
 	struct TreeObject obj;
 	obj.type = SEGMENT;
 	obj.u.seg.trk = trk;
+	obj.u.seg.seg = seg;
 	obj.u.seg.x0 = x0;
 	obj.u.seg.y0 = y0;
 	obj.u.seg.x1 = x1;
 	obj.u.seg.y1 = y1;
-	obj.u.seg.p1 = p1;
-	obj.u.seg.p2 = p2;
+	obj.u.seg.i1 = i1;
+	obj.u.seg.i2 = i2;
 	tree_add_object(t, &obj, MIN(x0, x1), MAX(x0, x1), MIN(y0, y1), MAX(y0, y1));
 }
 
@@ -177,6 +179,7 @@ struct tree_to_pixmap_s {
 	int count;
 	double length;
 	int rects;
+	const struct RenderContext *rc;
 };
 
 static void
@@ -195,8 +198,10 @@ tree_to_pixmap_r(struct TreeNode *t, cairo_t *ct, int x, int y, int w, int h, st
 		return;
 	if(t->top > y+h)
 		return;
+	if(RENDER_CANCELLED(s->rc))
+		return;
 
-	//s->rects++;
+	s->rects++;
 
 	for(i = 0; i < t->count; i++) {
 		struct TreeObject *obj = &t->objects[i];
@@ -221,7 +226,7 @@ tree_to_pixmap_r(struct TreeNode *t, cairo_t *ct, int x, int y, int w, int h, st
 			cairo_line_to(ct, (double)(obj->u.seg.x1-x), (double)(obj->u.seg.y1-y));
 			cairo_stroke(ct);
 			//g_message("tree_to_pixmap: %d %d %d %d", t->segments[i].x0, t->segments[i].y0, t->segments[i].x1, t->segments[i].y1);
-			//s->count++;
+			s->count++;
 			//s->length += linelength(t->segments[i].x1-t->segments[i].x0, t->segments[i].y1-t->segments[i].y0);
 			break;
 		case WAYPOINT:
@@ -235,6 +240,7 @@ tree_to_pixmap_r(struct TreeNode *t, cairo_t *ct, int x, int y, int w, int h, st
 				cairo_move_to(ct, obj->u.wpt.x-x, obj->u.wpt.y-y);
 				cairo_show_text(ct, obj->u.wpt.wpt->name);
 			}
+			s->count++;
 			break;
 		default:
 			g_message("tree_to_pixmap_r: cannot draw an object of type %d", obj->type);
@@ -246,16 +252,19 @@ tree_to_pixmap_r(struct TreeNode *t, cairo_t *ct, int x, int y, int w, int h, st
 	tree_to_pixmap_r(t->p2, ct, x, y, w, h, s);
 }
 
-void
-tree_to_pixmap(struct TreeNode *t, struct RenderTarget *target, cairo_t *ct, int x, int y, int w, int h) {
+/* Returns the number of objects drawn */
+int
+tree_to_pixmap(struct TreeNode *t, const struct RenderContext *rc) {
 	struct tree_to_pixmap_s s;
 	s.count = 0;
 	s.rects = 0;
 	s.length = 0;
-	cairo_set_line_width(ct, 7.0);
-	cairo_set_antialias(ct, CAIRO_ANTIALIAS_NONE);
-	tree_to_pixmap_r(t, ct, x, y, w, h, &s);
+	s.rc = rc;
+	cairo_set_line_width(rc->ct, 7.0);
+	cairo_set_antialias(rc->ct, CAIRO_ANTIALIAS_NONE);
+	tree_to_pixmap_r(t, rc->ct, rc->x, rc->y, rc->w, rc->h, &s);
 	//g_message("Called to render %d segments in %d rects %g length\n", s.count, s.rects, s.length);
+	return s.count;
 }
 
 static double
@@ -322,16 +331,14 @@ find_objects_xy(struct TreeNode *t, int x, int y, int n, int maxdist, struct Tre
 
 			/* If it's a segment of the same track, unite it with near-segments */
 			if(obj->type == SEGMENT && res[j].obj->type == SEGMENT &&
-			  res[j].obj->u.seg.trk == obj->u.seg.trk) {
-				if(res[j].p2 == obj->u.seg.p1) {
-					// g_message("share on p %d. new %d..%d", res[j].p2->serial, res[j].p1->serial, obj->u.seg.p2->serial);
-					res[j].p2 = obj->u.seg.p2;
+			  res[j].obj->u.seg.seg == obj->u.seg.seg) {
+				if(res[j].i2 == obj->u.seg.i1) {
+					res[j].i2 = obj->u.seg.i2;
 
 					goto update_existing;
 				}
-				else if(res[j].p1 == obj->u.seg.p2) {
-					// g_message("share on p %d. new %d..%d", res[j].p1->serial, obj->u.seg.p1->serial, res[j].p2->serial);
-					res[j].p1 = obj->u.seg.p1;
+				else if(res[j].i1 == obj->u.seg.i2) {
+					res[j].i1 = obj->u.seg.i1;
 					goto update_existing;
 				}
 				else
@@ -364,25 +371,23 @@ find_objects_xy(struct TreeNode *t, int x, int y, int n, int maxdist, struct Tre
 			res[j].obj = obj;
 			res[j].u = u;
 			if(obj->type == SEGMENT) {
-				res[j].p1 = obj->u.seg.p1;
-				res[j].p2 = obj->u.seg.p2;
-				// g_message("inserted at %d %d..%d", j, res[j].p1->serial, res[j].p2->serial);
+				res[j].i1 = obj->u.seg.i1;
+				res[j].i2 = obj->u.seg.i2;
 			}
 		}
 		if(j < n && res[j].obj->type == SEGMENT) {
 			int j1;
 			for(j1 = j+1; j1 < n && res[j1].obj != NULL; j1++) {
 				while(res[j1].obj != NULL) {
-					if(res[j].obj->type != SEGMENT ||
-					   res[j1].obj->u.seg.trk != res[j].obj->u.seg.trk)
+					if(res[j1].obj->type != SEGMENT ||
+					   res[j1].obj->u.seg.seg != res[j].obj->u.seg.seg)
 						break;
-					if(res[j].p2 == res[j1].p1)
-						res[j].p2 = res[j1].p2;
-					else if(res[j].p1 == res[j1].p2)
-						res[j].p1 = res[j1].p1;
+					if(res[j].i2 == res[j1].i1)
+						res[j].i2 = res[j1].i2;
+					else if(res[j].i1 == res[j1].i2)
+						res[j].i1 = res[j1].i1;
 					else
 						break;
-					// g_message("delete point %d: %d..%d", j1, res[j1].p1->serial, res[j1].p2->serial);
 					for(k = j1; k < n-1; k++) {
 						res[k] = res[k+1];
 						if(res[k].obj == NULL)
@@ -398,29 +403,18 @@ find_objects_xy(struct TreeNode *t, int x, int y, int n, int maxdist, struct Tre
 
 int
 get_time(char *ptr, int left, struct TreeObject *t, double u) {
-	GTimeVal t1, t2;
+	GTimeVal t1;
+	gint64 T1, T2;
 	int ret;
-	double D;
 	gchar *ts;
 
 	switch(t->type) {
 	case SEGMENT:
-		t1.tv_sec = t->u.seg.p1->time.tv_sec;
-		t1.tv_usec = t->u.seg.p1->time.tv_usec;
-		t2.tv_sec = t->u.seg.p2->time.tv_sec;
-		t2.tv_usec = t->u.seg.p2->time.tv_usec;
-		t2.tv_sec -= t1.tv_sec;
-		t2.tv_usec -= t1.tv_usec;
-		if(t2.tv_usec < 0) {
-			t2.tv_usec += 1000000;
-			t2.tv_sec--;
-		}
-		D = t2.tv_sec * 1000000 + t2.tv_usec;
-		D *= u;
-		t2.tv_sec = (int)(D/1000000);
-		t2.tv_usec = (int)fmod(D, 1000000);;
-		t1.tv_sec += t2.tv_sec;
-		t1.tv_usec += t2.tv_usec;
+		T1 = trackseg_point_time(t->u.seg.seg, t->u.seg.i1);
+		T2 = trackseg_point_time(t->u.seg.seg, t->u.seg.i2);
+		T1 += (gint64)((T2 - T1) * u);
+		t1.tv_sec = T1 / G_USEC_PER_SEC;
+		t1.tv_usec = T1 % G_USEC_PER_SEC;
 
 		ts = g_time_val_to_iso8601(&t1);
 		if(ts == NULL) {
@@ -451,7 +445,7 @@ Heading(struct Point *p1, struct Point *p2) {
 
 #define NP 100
 char *
-get_near_object(struct MapView *mapview, int x, int y) {
+get_near_object(const struct RenderTarget *target, int x, int y) {
 	struct TreeSearchResult res[NP];
 	int i;
 	static char ret[1000];
@@ -459,10 +453,10 @@ get_near_object(struct MapView *mapview, int x, int y) {
 
 	memset(res, 0, sizeof(res));
 
-	for(i = 0; i < mapview->rt.n_layers; i++) {
-		if(mapview->rt.layers[i].flags & LAYER_IS_TREE_SEARCHABLE) {
+	for(i = 0; i < target->n_layers; i++) {
+		if(target->layers[i].flags & LAYER_IS_TREE_SEARCHABLE) {
 			// g_message("--------------");
-			find_objects_xy(mapview->rt.layers[i].priv, x, y, NP, 5, res);
+			find_objects_xy(pointset_tree(&target->layers[i]), x, y, NP, 5, res);
 		}
 	}
 
@@ -477,18 +471,47 @@ get_near_object(struct MapView *mapview, int x, int y) {
 		if(i > 0)
 			filled += snprintf(ret+filled, sizeof(ret)-filled, "\n%s", UTF8[UTF8_LTRMARK]);
 		switch(res[i].obj->type) {
-		case SEGMENT:
+		case SEGMENT: {
+			struct Track *trk = res[i].obj->u.seg.trk;
+			struct TrackSeg *seg = res[i].obj->u.seg.seg;
+			struct TrackPoint p1, p2;
+			struct TrackStats st;
+			double ele;
+
+			trackseg_get_point(seg, res[i].obj->u.seg.i1, &p1);
+			trackseg_get_point(seg, res[i].obj->u.seg.i2, &p2);
+
 			if(filled >= sizeof(ret))
 				break;
-			filled += snprintf(ret+filled, sizeof(ret)-filled, "%s: %.3f Km %s %.1fm",
-				res[i].obj->u.seg.trk->name,
-				((1-res[i].u)*res[i].obj->u.seg.p1->distance + res[i].u*res[i].obj->u.seg.p2->distance)/1000,
-				Heading(&res[i].obj->u.seg.p1->point, &res[i].obj->u.seg.p2->point),
-				(1-res[i].u)*res[i].obj->u.seg.p1->point.elevation + res[i].u*res[i].obj->u.seg.p2->point.elevation);
+			filled += snprintf(ret+filled, sizeof(ret)-filled, "%s: %.3f Km %s",
+				trk->name,
+				((1-res[i].u)*p1.distance + res[i].u*p2.distance)/1000,
+				Heading(&p1.point, &p2.point));
+			ele = (1-res[i].u)*p1.point.elevation + res[i].u*p2.point.elevation;
+			if(filled < sizeof(ret) && !isnan(ele))
+				filled += snprintf(ret+filled, sizeof(ret)-filled, " %.1fm", ele);
 			if(filled >= sizeof(ret))
 				break;
 			filled += get_time(ret+filled, sizeof(ret)-filled, res[i].obj, res[i].u);
+
+			/* Track totals and progress along the segment */
+			if(filled >= sizeof(ret))
+				break;
+			filled += snprintf(ret+filled, sizeof(ret)-filled, "\n\tTrack: ");
+			if(filled >= sizeof(ret))
+				break;
+			filled += format_track_stats(ret+filled, sizeof(ret)-filled, &trk->stats);
+			if(res[i].obj->u.seg.i1 > 0 &&
+			   trackseg_range_stats(seg, 0, res[i].obj->u.seg.i1, &st)) {
+				if(filled >= sizeof(ret))
+					break;
+				filled += snprintf(ret+filled, sizeof(ret)-filled, "\n\tSo far: ");
+				if(filled >= sizeof(ret))
+					break;
+				filled += format_track_stats(ret+filled, sizeof(ret)-filled, &st);
+			}
 			break;
+		}
 		case WAYPOINT:
 			if(filled >= sizeof(ret))
 				break;